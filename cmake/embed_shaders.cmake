@@ -0,0 +1,10 @@
+# Writes every GLSL file in SHADER_DIR into OUTPUT, as entries of the 
+# embedded shader table in src/shader_library.cpp. Run with cmake -P.
+
+file(GLOB shaders "${SHADER_DIR}/*.glsl")
+file(WRITE ${OUTPUT} "// Generated from ${SHADER_DIR} by embed_shaders.cmake. Do not edit.\n")
+foreach(shader ${shaders})
+    get_filename_component(name ${shader} NAME)
+    file(READ ${shader} source)
+    file(APPEND ${OUTPUT} "{\"${name}\", R\"ashigaru_glsl(${source})ashigaru_glsl\"},\n")
+endforeach()
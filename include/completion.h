@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+#include <exception>
+
+#include "geometry.h"
+
+namespace Ashigaru 
+{
+    /* Completion callbacks, for consuming slices without parking a thread on 
+     * each output's future. Callbacks run on the thread that finished the
+     * slice, off the render thread, so they may chain further work (encode,
+     * write...) directly. They should not block on the server that called
+     * them, since a view being dropped waits for its callbacks.
+     */
+    
+    /* Called once per output of a slice, with the output, or with the error 
+     * that prevented it and no data.
+     */
+    using OutputCallback = std::function<void(size_t output, std::unique_ptr<char> data, std::exception_ptr error)>;
+    
+    // Called once per slice, with all outputs in order, or with the first error.
+    using SliceCallback = std::function<void(std::vector<std::unique_ptr<char>> outputs, std::exception_ptr error)>;
+    
+    /* Called as parts of a slice's images are placed, before the slice is
+     * handed over, for consumers that work a band at a time. Parts come in
+     * the view's tile order (see TileOrder), on a thread of their own.
+     * 
+     * Arguments:
+     * region - the tile or band of tiles placed, in image pixels. For 
+     *    downsampled outputs (see RenderAction::OutputScales()), divide it
+     *    by the output's scale.
+     * images - each output's image buffer, null for reduction outputs. Only 
+     *    the placed regions of each are final, and the buffers are valid 
+     *    for the duration of the call only.
+     */
+    using RegionCallback = std::function<void(size_t slice_num, const Rect<unsigned int>& region, 
+        const std::vector<const char*>& images)>;
+    
+    /* WhenAll() joins the outputs of a slice into one completion.
+     * 
+     * Arguments:
+     * num_outputs - outputs the slice has (see RenderServer::OutputSizes()).
+     * on_slice - called when the last output completes, on its thread.
+     * 
+     * Returns:
+     * the per-output callback to request the slice with.
+     */
+    OutputCallback WhenAll(size_t num_outputs, SliceCallback on_slice);
+    
+    // Completes a promise per output; how the future-based API is served.
+    OutputCallback FulfillPromises(std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>> promises);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#include "util.h"
+#include "render_server.h"
+#include "worker_protocol.h"
+
+namespace Ashigaru 
+{
+    /* The RenderServer interface, served by worker processes instead of a 
+     * render thread (see Worker::RunWorker(), or `ashigaru --worker`). Each
+     * worker has its own GL context and address space, so N workers render
+     * up to N slices at once.
+     * 
+     * Models, views and edits go to every worker, so any of them can render 
+     * any slice. Each slice goes to the worker with the fewest slices in 
+     * flight, and comes back through shared memory.
+     * 
+     * Render actions are code, and can't be sent, so views name them by
+     * Worker::ActionSpec instead.
+     */
+    class DistributedRenderServer {
+    public:
+        using ViewHandle = RenderServer::ViewHandle;
+        using ModelHandle = RenderServer::ModelHandle;
+        using Placement = RenderServer::Placement;
+        
+    private:
+        // Called with the reply's payload after the ok flag, or with an 
+        // error message (and a null reader) if the request failed.
+        using ReplyHandler = std::function<void(Worker::Reader* reply, const std::string& error)>;
+        
+        struct WorkerLink {
+            std::unique_ptr<Worker::Connection> conn;
+            std::thread reader;
+            
+            std::mutex lock; // guards the following.
+            std::map<uint64_t, ReplyHandler> pending;
+            size_t slices_in_flight = 0;
+            bool alive = true;
+        };
+        std::vector<std::unique_ptr<WorkerLink>> m_workers;
+        std::atomic<uint64_t> m_next_request;
+        
+        // Front-end view handles, mapped to each worker's handle for the view.
+        std::mutex m_views_lock;
+        ViewHandle m_next_view;
+        std::map<ViewHandle, std::vector<ViewHandle>> m_worker_views;
+        std::map<ViewHandle, size_t> m_view_outputs;
+        
+        void ReaderFunction(WorkerLink& worker);
+        void Request(WorkerLink& worker, Worker::MessageType type, const std::string& payload, ReplyHandler handler);
+        
+        /* Sends a request to every worker.
+         * 
+         * Arguments:
+         * payload_for - builds the request for worker i.
+         * on_reply - reads worker i's reply.
+         * on_done - called once all have replied, with the first error if any
+         *    failed.
+         */
+        void Broadcast(Worker::MessageType type, 
+            std::function<std::string(size_t)> payload_for, 
+            std::function<void(size_t, Worker::Reader&)> on_reply,
+            std::function<void(std::exception_ptr)> on_done);
+        
+        // Same, for requests with nothing to reply but success.
+        std::future<void> Broadcast(Worker::MessageType type, 
+            std::function<std::string(size_t)> payload_for);
+        
+        std::future<void> Edit(ViewHandle view, Worker::EditKind kind, const Placement& placement);
+        
+    public:
+        /* Connects to running workers, one per socket path.
+         * Throws std::runtime_error if any can't be reached.
+         */
+        DistributedRenderServer(const std::vector<std::string>& worker_sockets);
+        ~DistributedRenderServer();
+        
+        // As in RenderServer. Blocks until all workers have the models.
+        std::vector<ModelHandle> RegisterModels(
+            const std::vector<std::shared_ptr<const Model>>& models,
+            const std::vector<glm::mat4>& transforms = std::vector<glm::mat4>{});
+        
+        // As in RenderServer, with the actions named by spec.
+        std::future<ViewHandle> RegisterView(const std::vector<Worker::ActionSpec>& render_actions,
+            unsigned int full_width, unsigned int full_height, 
+            const std::vector<Placement>& placements);
+        
+        std::future<void> AddInstance(ViewHandle view, const Placement& placement);
+        std::future<void> RemoveInstance(ViewHandle view, unsigned int id);
+        std::future<void> MoveInstance(ViewHandle view, unsigned int id, const glm::mat4& transform);
+        std::future<void> UnregisterView(ViewHandle view);
+        
+        std::vector<std::future<std::unique_ptr<char>>>
+        ViewSlice(ViewHandle view, size_t slice_num);
+        
+        // Calls back from the worker's reader thread, as in RenderServer.
+        void ViewSlice(ViewHandle view, size_t slice_num, OutputCallback on_output);
+    };
+}
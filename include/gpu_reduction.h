@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <utility>
+#include <memory>
+#include "opengl_utils.h"
+
+namespace Ashigaru {
+    /* GPUReduction reduces an RGBA32F texture to a single texel, by repeated 
+     * 2x2 reduction passes, each into a texture of half the size. Each 
+     * channel is reduced by its own operation. Only the final texel is read
+     * back, so summarizing a tile costs 16 bytes of transfer instead of the
+     * whole image.
+     * 
+     * Like RenderAction, construction is GL-free and InitGL()/ReleaseGL() 
+     * must be called from the render thread.
+     */
+    class GPUReduction {
+    public:
+        enum class Op { Min = 0, Max = 1, Sum = 2 };
+        using Ops = std::array<Op, 4>;
+        
+    private:
+        unsigned int m_width, m_height;
+        
+        std::shared_ptr<GLObject> m_program;
+        GLObject m_quad_buffer, m_quad_varray;
+        GLObject m_source_fbo; // for reading a 1x1 source directly.
+        std::vector<GLObject> m_levels; // halving sizes, down to 1x1.
+        std::vector<GLObject> m_level_fbos; // one per level, so passes don't re-attach.
+        std::vector<std::pair<unsigned int, unsigned int>> m_level_sizes;
+        GLint m_src_size_loc, m_ops_loc;
+        
+    public:
+        // Arguments: width, height - size of the textures to reduce.
+        GPUReduction(unsigned int width, unsigned int height) : m_width{width}, m_height{height} {}
+        
+        void InitGL();
+        void ReleaseGL();
+        
+        /* Reduce() runs the reduction passes and starts an async read of the 
+         * result: 4 floats, one per channel, into a new PBO. 
+         * 
+         * Arguments:
+         * source - RGBA32F texture of the size given on construction.
+         * ops - operation for each channel.
+         * 
+         * Returns:
+         * the fence and PBO for the read, as with RenderAction results.
+         * Leaves the last level's FBO bound.
+         */
+        std::pair<GLsync, GLuint> Reduce(GLuint source, Ops ops);
+    };
+}
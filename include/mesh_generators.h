@@ -0,0 +1,39 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "util.h"
+
+namespace Ashigaru {
+    /* Synthetic meshes, for testing and benchmarking on inputs of known size.
+     * All are deterministic: the same arguments give the same mesh, vertex
+     * for vertex, as far as the platform's sin() and cos() agree.
+     */
+    namespace Generate {
+        /* A UV sphere: `rings` bands of latitude, each cut into `segments`
+         * around. Has segments*(2*rings - 2) triangles.
+         * 
+         * Arguments:
+         * center, radius - where and how big.
+         * rings, segments - at least 2 and 3, respectively.
+         */
+        Model Sphere(glm::vec3 center, float radius, unsigned int rings, unsigned int segments);
+        
+        /* A cubic lattice of square struts along the edges of a grid of
+         * cells, from the origin up. Each strut is a box of 12 triangles,
+         * overlapping its neighbours at the nodes.
+         * 
+         * Arguments:
+         * cells - cells along each axis.
+         * cell_size - side of a cell.
+         * strut - side of a strut's square section.
+         */
+        Model Lattice(unsigned int cells, float cell_size, float strut);
+        
+        /* A dense array of small parts: `per_side` x `per_side` copies of a
+         * part centered on the origin, laid on the XY plane `spacing` apart,
+         * the first at (spacing/2, spacing/2). The copies are merged into one
+         * mesh; for an array of instances, place the part itself instead.
+         */
+        Model Array(const Model& part, unsigned int per_side, float spacing);
+    }
+}
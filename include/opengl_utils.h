@@ -1,4 +1,55 @@
 #pragma once
 #include <GL/glew.h>
 
-GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path);
+/* GLObject owns one OpenGL object name, and deletes it when destroyed. 
+ * Like any other GL call, creation and destruction must happen in the thread
+ * holding the context. Move-only, like std::unique_ptr.
+ */
+class GLObject {
+public:
+    enum class Kind { Buffer, VertexArray, Framebuffer, Renderbuffer, Texture, Program };
+    
+private:
+    Kind m_kind;
+    GLuint m_name;
+    
+public:
+    GLObject() : m_kind{Kind::Buffer}, m_name{0} {}
+    
+    // Generates a new object of the given kind.
+    explicit GLObject(Kind kind);
+    
+    // Takes ownership of an existing name.
+    GLObject(Kind kind, GLuint name) : m_kind{kind}, m_name{name} {}
+    
+    GLObject(const GLObject&) = delete;
+    GLObject& operator=(const GLObject&) = delete;
+    
+    GLObject(GLObject&& other) : m_kind{other.m_kind}, m_name{other.m_name} { other.m_name = 0; }
+    GLObject& operator=(GLObject&& other);
+    
+    ~GLObject() { Reset(); }
+    
+    // Deletes the object, if any, leaving this empty.
+    void Reset();
+    
+    GLuint Get() const { return m_name; }
+    operator GLuint() const { return m_name; }
+};
+
+/* GLState filters out state changes that would change nothing. It remembers 
+ * what it last set in the calling thread's context, so all changes to the 
+ * state it covers must go through it. The first call of each kind always 
+ * reaches GL. GLObject tells it when a bound object is deleted, since GL may 
+ * hand the name out again.
+ */
+namespace GLState {
+    void UseProgram(GLuint program);
+    void BindFramebuffer(GLuint fbo); // both draw and read.
+    void BindVertexArray(GLuint varray);
+    void Viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+    void DepthTest(bool enabled);
+    void ClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+    
+    void Forget(GLObject::Kind kind, GLuint name);
+}
@@ -1,14 +1,19 @@
 #pragma once
 
 #include <vector>
+#include <utility>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <string>
 #include <glm/glm.hpp>
 #include "opengl_utils.h"
 #include "vertex_db.h"
+#include "geometry.h"
+#include "gpu_reduction.h"
+#include "render_targets.h"
 
 namespace Ashigaru {
-    template <typename DT>
-    class Rect; // Will come from geometry.h when it comes.
-    
     // A result is represented by fence and a PBO.
     // When the fence signals completion, we should have finished reading into the PBO.
     using RenderAsyncResult = std::pair<GLsync, GLuint>; 
@@ -31,11 +36,19 @@ namespace Ashigaru {
         * Instead, we require the object to be used in this 
         * way: do whatever non-GL thing you want in the subclass' constructor and other 
         * new methods. Methods defined in this interface can use OpenGL but can only
-        * be called in the render thread. The render thread must call InitGL once
-        * before usage.
+        * be called in the render thread. The render thread must call InitGL 
+        * before usage. It may be called again by each view using the action, so
+        * implementations should do nothing if already initialized.
         */
         virtual void InitGL() = 0;
         
+        /* Frees whatever InitGL() created, in the render thread, once no view 
+        * uses the action. InitGL() may be called again afterwards. Since the
+        * destructor runs in the user's thread, it must not touch OpenGL, so 
+        * this is the only chance to clean up.
+        */
+        virtual void ReleaseGL() = 0;
+        
         /* All subclasses are expected to work within a tiling loop. Therefore,
         * this step is here for setting tile parameters before rendering.
         * the implementation can set uniforms or do whatever is necessary.
@@ -56,57 +69,259 @@ namespace Ashigaru {
         
         virtual bool PrepareSlice(size_t slice_num) = 0;
         
-        // Well, the description of triangles given to StartRender will evolve yet.
-        virtual std::vector<RenderAsyncResult> StartRender(VertexDB vertices) = 0;
+        /* Records how the action reads a batch's buffers into the vertex 
+        * array currently bound, which the batch then carries (see VertexDB). 
+        * Called once whenever a batch is built, so that StartRender() needs 
+        * no attribute setup per tile. The batch's element buffer is already 
+        * bound. Read "positions" in its GetFormat(): a view may store them 
+        * quantized, decoded by the instance transform (see TiledView).
+        */
+        virtual void SetupVertexArray(const VertexDB& batch) = 0;
+        
+        /* Renders the current tile and starts reading back its outputs.
+        * 
+        * Arguments:
+        * batches - the geometry of the tile, as one VertexDB per mesh. Each 
+        *    is drawn instanced, with "positions" per vertex and "instances" 
+        *    (of InstanceRecord) per instance, and carries a vertex array 
+        *    recorded by SetupVertexArray().
+        */
+        virtual std::vector<RenderAsyncResult> StartRender(const std::vector<VertexDB>& batches) = 0;
         
         // How many elements per tile result? That is, what is sizeof(pixel) per result?
         virtual std::vector<unsigned int> OutputPixelSizes() const = 0;
+        
+        /* Downsampling of each image output: output i has a pixel for each
+        * block of OutputScales()[i] x OutputScales()[i] pixels of the tile, so
+        * its tile results, and its slice images, are that many times smaller
+        * on each side. Such levels are made on the GPU from the tile's full
+        * resolution targets, so thumbnails come with the slice for next to 
+        * nothing. Scales must divide the tile's sides.
+        * 
+        * Default: all 1, full resolution.
+        */
+        virtual std::vector<unsigned int> OutputScales() const { 
+            return std::vector<unsigned int>(OutputPixelSizes().size(), 1);
+        }
+        
+        /* The band of Z values, around the slice set by PrepareSlice(), in which 
+        * geometry can affect the result. A tile with no geometry in this band 
+        * renders as BackgroundPixels() everywhere, so the caller may skip the GPU 
+        * work for it altogether. Keep it as tight as the outputs allow: both
+        * skipping and reusing results (see ShiftInvariant()) look at all the
+        * geometry in the band.
+        * 
+        * Returns:
+        * (bottom, top) of the band, in model coordinates.
+        */
+        virtual std::pair<float, float> SliceInfluence() const = 0;
+        
+        /* The value of one pixel of each output, for pixels that see no geometry.
+        * Each entry is OutputPixelSizes()[i] bytes long, in the same layout as 
+        * the rendered results.
+        */
+        virtual std::vector<std::vector<char>> BackgroundPixels() const = 0;
+        
+        /* Reduction outputs summarize a slice in a few bytes, reduced on the 
+        * GPU, instead of an image. They follow the image outputs, both in 
+        * StartRender()'s results and in the results of a slice. Each tile 
+        * reads back ReductionSizes()[i] bytes for reduction i, which the 
+        * caller folds into the slice's result with CombineReduction().
+        * 
+        * Default: no reductions.
+        */
+        virtual std::vector<unsigned int> ReductionSizes() const { return std::vector<unsigned int>{}; }
+        
+        /* Sets a slice's result for reduction `which` to its value when 
+        * nothing is seen. Tiles skipped as background contribute nothing else.
+        */
+        virtual void InitReduction(size_t which, char* slice_result) const {}
+        
+        /* Folds a tile's result for reduction `which` into the slice's.
+        * tile_rect gives the tile's position, for results in image coordinates.
+        */
+        virtual void CombineReduction(size_t which, char* slice_result, const char* tile_result, 
+            Rect<unsigned int> tile_rect) const {}
+        
+        /* True if the outputs depend only on the geometry in SliceInfluence(),
+        * as seen from the slice, so that moving the slice and the geometry
+        * together in Z changes nothing. A view may then reuse a tile's
+        * results for the next slice when the geometry in both bands is a
+        * prism, i.e. all its faces are vertical (meshes are assumed closed).
+        * A band of thousands of slices is rarely all prism, so reuse pays 
+        * only with a tight SliceInfluence().
+        * 
+        * Default: false, every slice is rendered.
+        */
+        virtual bool ShiftInvariant() const { return false; }
+        
+        /* Identifies everything besides the scene and slice number that
+        * goes into the outputs, such as sizes, options and shader sources,
+        * for keying the on-disk slice cache (see slice_cache.h). Only
+        * compared, so it may be long.
+        * 
+        * Default: empty, meaning the results may not be cached on disk.
+        */
+        virtual std::string CacheKey() const { return std::string(); }
     };
 
     class TestRenderAction : public RenderAction {
-        GLuint m_full_program, m_height_program;
-        GLuint m_fbo = 0;
+    public:
+        // Reduction outputs, when constructed with statistics:
+        
+        // Bounding box, in image pixels, of where geometry is seen in range. 
+        // Empty (min > max) if nowhere.
+        struct SliceBounds {
+            float min_x, min_y, max_x, max_y;
+        };
+        
+        struct SliceSummary {
+            float min_proximity; // normalized, as the proximity output. 1 if nothing in range.
+            float covered_area;  // number of pixels where geometry is seen in range.
+            float reserved[2];   // pads to the 4 channels read back.
+        };
+        
+    private:
+        std::shared_ptr<GLObject> m_full_program, m_height_program;
         unsigned int m_width, m_height;
         
+        // Uniforms of m_full_program, looked up once.
+        GLint m_look_loc, m_slice_z_loc;
+        
         static const GLuint pos_attribute = 0;
+        static const GLuint id_attribute = 1;
+        static const GLuint transform_attribute = 2; // a mat4 takes 4 locations.
+        static const GLuint uv_attribute = 1; // of the quad passes.
+        static const GLuint looks_binding = 0; // uniform buffer binding of the Looks block.
+        float m_depth_range; // far plane of both looks, in slices.
         
         size_t m_slice;
         
-        /* SetupRenderTarget() creates a Frame Buffer Object with one
-        * RenderBuffer, sized to the given image dimensions. The internal
-        * storage is 32 bit (RGBA).
+        /* SetupRenderTarget() creates the Frame Buffer Objects of the looks: 
+        * one per look, each drawing into a layer of the depth texture, the 
+        * upward one also into an ID texture sized to the given image 
+        * dimensions. In layered mode, the layered framebuffer replaces them.
+        * The combining pass draws into m_combined.
         * 
         * Arguments:
         * width, height - image dimensions, in [px].
-        * 
-        * Returns:
-        * the GL handle for the FBO, for use with `glBindFramebuffer()`.
         */
-        GLuint SetupRenderTarget(unsigned int width, unsigned int height);
+        void SetupRenderTarget(unsigned int width, unsigned int height);
         
     public:
-        TestRenderAction(unsigned int width, unsigned int height);
+        /* Arguments:
+        * width, height - tile size.
+        * with_stats - if true, add the SliceBounds and SliceSummary reduction 
+        *    outputs, in this order.
+        * layered - if true, render both looks in one pass over the geometry, 
+        *    with a geometry shader sending each triangle to a layer per look.
+        *    Halves the vertex work, at the cost of the geometry shader stage.
+        * level_scale - if not 0, add the ID and proximity outputs again, in
+        *    this order and downsampled by this factor (see OutputScales()): 
+        *    each pixel has the most common ID of its block, and the nearest 
+        *    proximity in it, or their mean if `box_filter`. At most 16, and
+        *    must divide the tile size.
+        * depth_range - how far each look sees from the slice, in slices. 
+        *    Proximity is a fraction of this, and saturates beyond it. This is
+        *    also the SliceInfluence() band, so a short range lets many more 
+        *    tiles be skipped, or reused across slices.
+        */
+        TestRenderAction(unsigned int width, unsigned int height, bool with_stats = false, bool layered = false,
+            unsigned int level_scale = 0, bool box_filter = false, float depth_range = 2048.f);
         
         virtual void InitGL() override;
+        virtual void ReleaseGL() override;
         virtual bool PrepareTile(Rect<unsigned int> tile_rect) override;
         virtual bool PrepareSlice(size_t slice_num) override { m_slice = slice_num; return true; }
-        virtual std::vector<RenderAsyncResult> StartRender(VertexDB vertices) override;
+        virtual void SetupVertexArray(const VertexDB& batch) override;
+        virtual std::vector<RenderAsyncResult> StartRender(const std::vector<VertexDB>& batches) override;
+        
+        // ID and proximity, ushort each, then their levels if any.
+        virtual std::vector<unsigned int> OutputPixelSizes() const override;
+        virtual std::vector<unsigned int> OutputScales() const override;
+        
+        // Both looks see as far as the far plane of the projection.
+        virtual std::pair<float, float> SliceInfluence() const override {
+            return std::make_pair((float)m_slice - m_depth_range, (float)m_slice + m_depth_range);
+        }
+        virtual std::vector<std::vector<char>> BackgroundPixels() const override;
+        
+        virtual std::vector<unsigned int> ReductionSizes() const override;
+        virtual void InitReduction(size_t which, char* slice_result) const override;
+        virtual void CombineReduction(size_t which, char* slice_result, const char* tile_result, 
+            Rect<unsigned int> tile_rect) const override;
         
-        // first return is RGBA color, 1 byte per channel. Second is ushort.
-        virtual std::vector<unsigned int> OutputPixelSizes() const override { return std::vector<unsigned int>{2, 2}; }
+        // The looks are fixed relative to the slice (see m_looks_ubo).
+        virtual bool ShiftInvariant() const override { return true; }
+        virtual std::string CacheKey() const override;
         
     // Scratch data for rendering. Generated in preparation of slice or tile,
     // and used in the actual rendering.
     private:
-        glm::mat4 m_look_up, m_look_down;
-        GLuint m_depth_tex[2]; // first looking up, then looking down.
-        GLuint m_quad_buffer, m_quad_uv_buffer;
+        GLObject m_depth_tex; // 2D array: layer 0 looking up, layer 1 looking down.
+        GLObject m_look_fbo[2]; // render into each layer; the down look is depth-only.
+        
+        // Layered mode: both looks go into m_layered_fbo in one pass.
+        bool m_layered;
+        GLObject m_layered_fbo, m_layered_color;
+        GLObject m_quad_buffer, m_quad_uv_buffer, m_quad_varray;
+        
+        /* The looks of each tile (up, down) are computed once, as if the slice 
+        * were at Z = 0, and kept in a slot of m_looks_ubo. PrepareTile() only 
+        * picks the slot, and the slice enters as an offset uniform.
+        */
+        using TileKey = std::tuple<unsigned int, unsigned int, unsigned int, unsigned int>;
+        std::map<TileKey, size_t> m_tile_slots;
+        GLObject m_looks_ubo;
+        size_t m_ubo_slots; // capacity.
+        GLint m_slot_stride; // bytes, padded to the buffer offset alignment.
+        size_t m_tile_slot; // of the prepared tile.
+        
+        // Statistics: per-pixel values drawn with the proximity, into the 
+        // "bounds" and "summary" targets of m_combined, then reduced.
+        bool m_with_stats;
+        GPUReduction m_reduction;
+        
+        // The combining pass, from both looks' depths: "proximity", then the
+        // statistics if any, in one pass as multiple render targets.
+        RenderTargets m_combined;
+        
+        // Downsampled levels of the ID and proximity outputs, when asked for:
+        // "ids" and "proximity", drawn together.
+        unsigned int m_level_scale; // 0 for none.
+        bool m_box_filter;
+        std::shared_ptr<GLObject> m_level_program;
+        GLint m_level_scale_loc, m_box_filter_loc; // set per draw, as actions share the program.
+        GLObject m_id_tex; // the upward look's IDs, when not layered, to sample.
+        RenderTargets m_levels;
         
         static const float quad_vertices[][3];
         static const float quad_UV[][2];
     
     // Internal operations.
     private:
+        /* DrawBatches() draws each batch instanced, through its vertex array,
+        * with the current program and framebuffer.
+        */
+        void DrawBatches(const std::vector<VertexDB>& batches);
+        
+        /* Returns the slot of a tile's looks, computing and uploading them 
+        * if the tile is new.
+        */
+        size_t TileSlot(Rect<unsigned int> tile_rect);
+        
+        /* RenderLevels() draws the downsampled outputs from the IDs and the
+        * depths of the tile just rendered, and starts reading them back.
+        */
+        void RenderLevels(std::vector<RenderAsyncResult>& ret);
+        
+        /* RenderDepths() and RenderDepthsLayered() fill both layers of 
+        * m_depth_tex, in two passes or in one, and start reading back the ID 
+        * output of the upward look into `ret`.
+        */
+        void RenderDepths(const std::vector<VertexDB>& batches, std::vector<RenderAsyncResult>& ret);
+        void RenderDepthsLayered(const std::vector<VertexDB>& batches, std::vector<RenderAsyncResult>& ret);
+        
         /* CommitBufferAsync() starts a read from GL to memory of one of the buffers in the frame buffer.
         * It generates the pair of fence/PBO required by external code to track completion and act of 
         * the copied buffer.
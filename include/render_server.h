@@ -6,9 +6,13 @@
 #include <future>
 #include <memory>
 #include <unordered_map>
+#include <list>
+#include <atomic>
+#include <set>
 
 #include "util.h"
 #include "tiled_view.h"
+#include "transform.h"
 
 namespace Ashigaru 
 {
@@ -19,74 +23,314 @@ namespace Ashigaru
     public:
         using ViewHandle = unsigned int;
         using ModelHandle = size_t;
+        
+        // Where a registered model goes in a view, and the shell ID it gets there.
+        // The same model may be placed any number of times.
+        struct Placement {
+            ModelHandle model;
+            glm::mat4 transform;
+            unsigned int id;
+        };
     
     // Core properties:
     private:
         std::thread m_render_thread; // well, that's what it's all about!
-        bool m_keep_running;
+        std::atomic<bool> m_keep_running;
         
         unsigned int m_tile_width, m_tile_height;
+        
+        // GPU memory for view geometry, beyond which idle views are evicted.
+        // 0 for no limit.
+        size_t m_gpu_budget;
 
     // Parallel processing machinery:        
     private:
-        std::vector<std::shared_ptr<Model>> m_models; 
+        std::vector<std::shared_ptr<const Model>> m_models; 
+        std::vector<BoundingBox> m_model_bounds;
         
         struct ViewRequest {
-            RenderAction& render_action;
+            ViewHandle handle;
+            std::vector<RenderAction*> render_actions;
             unsigned int full_width, full_height;
-            std::vector<std::shared_ptr<const Model>> geometry;
+            std::vector<ModelInstance> instances;
             std::shared_ptr<std::promise<ViewHandle>> ready;
         };
         std::queue<ViewRequest> m_view_requests;
+        std::queue<ViewRequest> m_preview_requests; // built before other views.
         std::mutex m_view_reqs_lock;
+        
+        // Handles are given out by the user thread, which also needs to know 
+        // the outputs of a view without touching it. Guarded by m_view_reqs_lock.
+        ViewHandle m_next_view;
+        std::unordered_map<ViewHandle, std::vector<size_t>> m_view_outputs; // bytes of each.
+        std::set<ViewHandle> m_previews;
+        
+        // Views registered but not built yet, and those of them unregistered
+        // since, which are then never built. Edits of pending views wait for
+        // their build. Guarded by m_view_reqs_lock.
+        std::set<ViewHandle> m_pending_views;
+        std::set<ViewHandle> m_cancelled_views;
+        
+        // Meshes being simplified for previews, in the background. Waited 
+        // for on shutdown. Guarded by m_view_reqs_lock.
+        std::list<std::future<void>> m_preview_builds;
+        
+        // Build the first view in a queue, if any. Returns whether there was one.
+        bool BuildNextView(std::queue<ViewRequest>& requests);
+        
+        // Render thread only:
         std::unordered_map<ViewHandle, TiledView> m_views;
+        std::list<ViewHandle> m_views_lru; // most recently used first.
+        std::unordered_map<RenderAction*, unsigned int> m_action_users;
+        
+        // Mark a view as used now, and evict others if over budget.
+        void TouchView(ViewHandle view);
+        void DropView(ViewHandle view);
+        
+        // GPU memory of all views, summing what each keeps count of.
+        size_t GPUMemoryUsed() const;
+        
+        // Evict views used less recently than `keep`, least recently used 
+        // first, until within the budget.
+        void EnforceBudget(ViewHandle keep);
+        
+        /* With nothing else to do, build one more tile of the most recently
+         * used view that has some not built yet, while within the budget.
+         * If that tile takes it over, other views are evicted as above.
+         * Returns whether one was built.
+         */
+        bool PrebuildTile();
+        
+        struct EditRequest {
+            enum class Kind { Add, Remove, Move, Drop, Order, Quantize };
+            
+            ViewHandle view;
+            Kind kind;
+            ModelInstance instance; // Remove uses only the ID, Move the ID and transform, Drop nothing.
+            std::shared_ptr<std::promise<void>> done;
+            TileOrder order = TileOrder::Columns; // for Order only.
+            float max_error = 0; // for Quantize only.
+        };
+        std::queue<EditRequest> m_edit_requests;
+        std::mutex m_edit_reqs_lock;
+        
+        std::future<void> RequestEdit(EditRequest req);
         
         struct SliceRequest {
             ViewHandle view;
             size_t slice_num;
-            std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>> promises; // Where to put the result.
+            size_t num_outputs = 0;
+            OutputCallback on_output; // Where to put the result.
+            
+            // Optionally, who gets it streamed, and in what parts.
+            RegionCallback on_region;
+            bool whole_bands = true;
+            
+            // Or, where to write it instead, and what to tell when done.
+            SliceSink* sink = nullptr;
+            std::shared_ptr<std::promise<void>> written;
         };
         std::queue<SliceRequest> m_slice_requests;
+        std::queue<SliceRequest> m_preview_slice_requests; // ahead of building views.
         std::mutex m_slice_reqs_lock;
         
+        // Render the first slice in a queue, if any. Returns whether there was one.
+        bool RenderNextSlice(std::queue<SliceRequest>& requests);
+        
         void RenderThreadFunction();
     
     // Public interface:
     public:
-        RenderServer(unsigned int tile_width, unsigned int tile_height);
+        /* Arguments:
+         * tile_width, tile_height - size of the tiles all views render in.
+         * gpu_memory_budget - bytes of GPU memory that view geometry may take.
+         *    When exceeded, the least recently used views give up their 
+         *    buffers, and rebuild them when next used. 0 for no limit.
+         */
+        RenderServer(unsigned int tile_width, unsigned int tile_height, size_t gpu_memory_budget = 0);
         ~RenderServer();
         
-        /* Copy models into the server and get handles for referring to them later. 
-         * Why copy? because then we are free to transform the objects into the 
-         * tray just once, without altering the user's copy. That transform is
-         * necessary to do in advance so that the tiling procedure can check which
-         * vertices apply to which tile.
+        /* Register models with the server and get handles for referring to them 
+         * later. Each model may come with a transform into the tray, which is
+         * applied here, once, so that the tiling procedure can check which 
+         * vertices apply to which tile. Transformed models are written into a
+         * server-owned copy, without altering the user's copy. Untransformed 
+         * models are shared, not copied, and the user must not change them
+         * afterwards.
          * 
-         * In this demo models have no transform so it's not done, but the 
-         * architecture is valid in the more general case.
+         * Arguments:
+         * models - the models to register.
+         * transforms - affine transforms, one per model, or empty for none.
+         * 
+         * Returns:
+         * a handle per model, in order.
          */
-        std::vector<ModelHandle> RegisterModels(const std::vector<std::shared_ptr<Model>> models);
+        std::vector<ModelHandle> RegisterModels(
+            const std::vector<std::shared_ptr<const Model>>& models,
+            const std::vector<glm::mat4>& transforms = std::vector<glm::mat4>{});
+        
+        /* Register a low resolution preview of a scene, for scrubbing through
+         * slices while the full view is still being built. The preview is a
+         * view of its own, with each model simplified to its pixel size (see
+         * ClusterVertices()). Simplifying runs in the background, and the 
+         * preview is then built ahead of other pending views, which are 
+         * bigger. Its slices are rendered ahead of building other views too.
+         * Views build their tiles lazily (see TiledView), so building one 
+         * holds preview slices up only briefly.
+         * 
+         * Previews are for viewing, not editing: edits would place full 
+         * resolution models in them.
+         * 
+         * Arguments:
+         * render_actions, full_width, full_height, placements - the full view,
+         *    as given to RegisterView(). Placements should be rigid, so that 
+         *    a model's units stay pixels of the full view.
+         * scale - pixels of the full view per preview pixel, along X and Y.
+         *    Slice numbers stay those of the full view.
+         * 
+         * Returns:
+         * a future that would give a handle to the preview. Its outputs are of
+         * PreviewSize() pixels.
+         */
+        std::future<ViewHandle> RegisterPreview(const std::vector<RenderAction*>& render_actions,
+            unsigned int full_width, unsigned int full_height, 
+            const std::vector<Placement>& placements, unsigned int scale);
+        
+        // The image size of a preview: the full size shrunk by `scale`, rounded
+        // up to whole tiles.
+        std::pair<unsigned int, unsigned int> PreviewSize(
+            unsigned int full_width, unsigned int full_height, unsigned int scale) const;
+        
+        // Bounding box of a registered model, after its registration transform.
+        BoundingBox ModelBounds(ModelHandle model) const { return m_model_bounds.at(model); }
         
         /* Instruct the render thread to construct a new view and ready it for 
          * rendering - tiled or otherwise. 
          * 
          * Arguments:
-         * geometry - a rendering scene (3D objects) to copy into the render thread.
+         * render_actions - what to render of the scene. Several actions make 
+         *    a grouped view: they share its tiles and buffers, and each slice 
+         *    renders all of them in one pass over the tiles. Each action may 
+         *    appear once.
+         * placements - the rendering scene: registered models, each placed in 
+         *    the tray by a transform. Models placed several times are stored 
+         *    once and rendered instanced.
+         * 
+         * The view is ready as soon as its instances are placed. Its tiles
+         * are built when a slice first needs them, and in idle time before 
+         * that, in tile order, so the first slice takes about as long 
+         * whatever the image size.
          * 
          * Returns:
-         * a future that would give a handle to the new view when it's done.
+         * a future that would give a handle to the new view when it's done,
+         * or the exception that prevented creating it.
+         */
+        std::future<ViewHandle> RegisterView(const std::vector<RenderAction*>& render_actions,
+            unsigned int full_width, unsigned int full_height, 
+            const std::vector<Placement>& placements);
+        
+        // Same, for a single action.
+        std::future<ViewHandle> RegisterView(RenderAction& render_action,
+            unsigned int full_width, unsigned int full_height, 
+            const std::vector<Placement>& placements);
+        
+        /* Same, for models that are already in place. Each model is placed
+         * once, untransformed, with its position in `models` as shell ID.
          */
         std::future<ViewHandle> RegisterView(RenderAction& render_action,
             unsigned int full_width, unsigned int full_height, 
             const std::vector<ModelHandle>& models);
         
+        /* Edit the scene of an existing view, without rebuilding it. Only 
+         * tiles under the footprint of the changed instance are re-binned and
+         * re-uploaded. Instances are identified by their placement ID, which 
+         * must be unique in the view for Remove/Move to be meaningful.
+         * 
+         * Edits are applied in order, but ahead of any slices still pending,
+         * so wait for those first if they must see the old scene. Edits of a
+         * view not built yet wait for it to be built, holding back those 
+         * after them.
+         * 
+         * Returns:
+         * a future that is ready when the edit is applied. For Remove/Move, 
+         * it holds an exception if the view has no instance with that ID.
+         */
+        std::future<void> AddInstance(ViewHandle view, const Placement& placement);
+        std::future<void> RemoveInstance(ViewHandle view, unsigned int id);
+        std::future<void> MoveInstance(ViewHandle view, unsigned int id, const glm::mat4& transform);
+        
+        /* UnregisterView() destroys a view and frees its GPU resources. Like 
+         * edits, this goes ahead of pending slices, which then fail with an
+         * exception. The handle is invalid after. When the last view using a 
+         * RenderAction goes, the action's GL resources are released too.
+         * A view not built yet is never built, and its RegisterView() future
+         * holds an exception.
+         * 
+         * Returns:
+         * a future that is ready when the view is gone.
+         */
+        std::future<void> UnregisterView(ViewHandle view);
+        
         /* ViewSlice() instructs the render thread to render a slice.
          * 
          * Arguments:
          * view - a handle to an already created view (see RegisterView). 
          * slice_num - number of slice to render (currently ignored).
+         * 
+         * Returns:
+         * a future per output of the view's render actions. For each action in
+         * the order given on registration: first the images, then the 
+         * reduction results, if any.
          */
         std::vector<std::future<std::unique_ptr<char>>>
         ViewSlice(ViewHandle view, size_t slice_num);
+        
+        /* Same, but calls back with each output as it's ready, instead of 
+         * giving futures. Use WhenAll() for one call with all outputs. 
+         * See completion.h on what callbacks may do.
+         */
+        void ViewSlice(ViewHandle view, size_t slice_num, OutputCallback on_output);
+        
+        /* Same, also streaming the slice's images as they're placed, to 
+         * consumers that work in bands. Regions come in the view's tile 
+         * order (see SetTileOrder()), all before `on_output` is called.
+         * 
+         * Arguments:
+         * on_region - gets each region as it's placed.
+         * whole_bands - stream bands of tiles across the image, rather than 
+         *    each tile.
+         */
+        void ViewSlice(ViewHandle view, size_t slice_num, OutputCallback on_output, 
+            RegionCallback on_region, bool whole_bands = true);
+        
+        /* Sets the order a view's tiles are rendered and streamed in. Use the
+         * order a streaming consumer takes bands in, so that its first band
+         * comes first. Like edits, this goes ahead of pending slices.
+         */
+        std::future<void> SetTileOrder(ViewHandle view, TileOrder order);
+        
+        /* Lets a view store its meshes' vertices in 16 bits per coordinate,
+         * where that moves them no more than `max_error` pixels (see 
+         * TiledView::SetVertexQuantization()). The view's buffers are 
+         * rebuilt, tile by tile as they're used.
+         */
+        std::future<void> SetVertexQuantization(ViewHandle view, float max_error);
+        
+        /* Same, but the render thread writes the outputs into a sink, e.g. a
+         * SliceRing shared with another process, instead of new buffers.
+         * Slices are written in the order requested. A full sink blocks the
+         * render thread until it has room, holding back all views.
+         * 
+         * Arguments:
+         * sink - takes the outputs, sized as OutputSizes(view). Must stay
+         *    alive until the returned future is ready.
+         * 
+         * Returns:
+         * a future that is ready when the slice is published in the sink.
+         */
+        std::future<void> ViewSliceTo(ViewHandle view, size_t slice_num, SliceSink& sink);
+        
+        // Bytes of each output of a view, in the order ViewSlice() gives them.
+        std::vector<size_t> OutputSizes(ViewHandle view);
     };
 }
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "opengl_utils.h"
+
+namespace Ashigaru {
+    /* RenderTargets is a framebuffer of named color attachments, each a
+     * texture of its own format, all drawn at once as multiple render
+     * targets: a fragment shader's output at location i goes to attachment i.
+     * Outputs computed from the same inputs thus come out of one pass, and
+     * are read back one after the other, with no clears or passes between.
+     * Render actions declare their targets with it, and read back their
+     * results by name.
+     * 
+     * Like RenderAction, construction is GL-free and InitGL()/ReleaseGL()
+     * must be called from the render thread.
+     */
+    class RenderTargets {
+    public:
+        struct Attachment {
+            std::string name;
+            GLenum internal_format; // of the texture, e.g. GL_R16.
+            GLenum format, type; // of the pixels read back, e.g. GL_RED, GL_UNSIGNED_SHORT.
+            unsigned int pixel_size; // bytes per pixel read back.
+        };
+    
+    private:
+        unsigned int m_width, m_height;
+        std::vector<Attachment> m_attachments;
+        GLObject m_fbo;
+        std::vector<GLObject> m_textures;
+        
+        size_t Index(const std::string& name) const;
+    
+    public:
+        RenderTargets(unsigned int width, unsigned int height, const std::vector<Attachment>& attachments)
+            : m_width{width}, m_height{height}, m_attachments{attachments} {}
+        
+        void InitGL();
+        void ReleaseGL();
+        
+        GLuint Framebuffer() const { return m_fbo; }
+        GLuint Texture(const std::string& name) const { return m_textures[Index(name)]; }
+        
+        // Binds the framebuffer, drawing into all attachments, and sets the
+        // viewport to cover it.
+        void Bind() const;
+        
+        /* ReadAsync() starts reading an attachment back, whole, into a new
+         * PBO. Binds the framebuffer.
+         * 
+         * Returns:
+         * the fence and PBO for the read, as with RenderAction results.
+         */
+        std::pair<GLsync, GLuint> ReadAsync(const std::string& name) const;
+    };
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <GL/glew.h>
+
+#include "opengl_utils.h"
+
+namespace Ashigaru {
+    /* Shaders are referred to by file name in the shaders/ directory, e.g. 
+    * "vertex.glsl". Builds that embed the sources (see CMakeLists.txt) take 
+    * them from the binary, so they run from any working directory. Otherwise,
+    * or for names not embedded, the file is read from the directory named by 
+    * the ASHIGARU_SHADER_DIR environment variable, or "shaders" if unset.
+    * 
+    * Throws std::runtime_error if the source is nowhere to be found.
+    */
+    std::string ShaderSource(const std::string& name);
+    
+    struct ShaderStage {
+        GLenum type; // e.g. GL_VERTEX_SHADER
+        std::string name;
+    };
+    
+    /* SharedProgram() gives the linked program for a set of stages. Within a 
+    * render thread (i.e. a GL context), users asking for the same stages share
+    * one program, which lives while any of them holds it. 
+    * 
+    * When a program must be built, its binary is first looked up in the 
+    * shader cache directory, keyed by the driver and the sources, so only the 
+    * first run on a given driver compiles anything. Newly linked programs are
+    * written back to the cache. Drivers without program binaries just compile.
+    * 
+    * Must be called in the render thread, like any GL work.
+    * 
+    * Throws std::runtime_error, with the GL log, if compiling or linking fails.
+    */
+    std::shared_ptr<GLObject> SharedProgram(const std::vector<ShaderStage>& stages);
+    
+    /* Sets where SharedProgram() keeps program binaries. An empty string 
+    * disables the disk cache. The default is the ASHIGARU_SHADER_CACHE 
+    * environment variable if set, otherwise ashigaru/ under the user's cache 
+    * directory. Call before starting any render thread.
+    */
+    void SetShaderCacheDirectory(const std::string& dir);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace Ashigaru {
+    /* The slice cache keeps the outputs of rendered slices on disk, one file
+     * per slice, so that a job that was rendered before, by this process or
+     * any other sharing the directory, comes back without touching the GPU.
+     * Keys are composed by the caller with HashBytes(), from everything that
+     * goes into a slice (see TiledView::Render()).
+     * 
+     * Files are never removed here; clear the directory when it grows too
+     * large.
+     */
+    
+    /* Sets the cache directory. An empty string, the default unless the
+     * ASHIGARU_SLICE_CACHE environment variable is set, disables the cache.
+     * Call before starting any render thread.
+     */
+    void SetSliceCacheDirectory(const std::string& dir);
+    bool SliceCacheEnabled();
+    
+    /* HashBytes() continues a 64-bit FNV-1a hash over some bytes. Unlike
+     * std::hash, it's the same from one build and one machine to the next.
+     */
+    const uint64_t hash_start = 14695981039346656037ull;
+    uint64_t HashBytes(const void* data, size_t size, uint64_t hash = hash_start);
+    
+    /* LoadCachedSlice() reads a cached slice into the given buffers.
+     * 
+     * Arguments:
+     * key - as the slice was stored with.
+     * outputs - where to put each output, of the respective size in `sizes`.
+     * 
+     * Returns:
+     * true on a hit. On a miss, which includes files of other sizes, the
+     * buffers may be partly overwritten.
+     */
+    bool LoadCachedSlice(uint64_t key, const std::vector<char*>& outputs, const std::vector<size_t>& sizes);
+    
+    /* StoreCachedSlice() writes a slice to the cache. Failures to write are
+     * ignored, as a cache miss only costs rendering again.
+     */
+    void StoreCachedSlice(uint64_t key, const std::vector<char*>& outputs, const std::vector<size_t>& sizes);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+namespace Ashigaru {
+    /* Delta coding of slice stacks. Consecutive slices of a view differ in
+     * few pixels, so each slice is stored as the XOR against the one before,
+     * which is mostly zeros, in runs: skipped spans where nothing changed,
+     * runs of one repeated byte, and literal spans. Every so often a
+     * keyframe is coded against a blank slice instead, so that any slice
+     * can be rebuilt from the nearest keyframe before it.
+     * 
+     * Code each output of a view as a stack of its own, e.g. the IDs of
+     * every slice, in slice order.
+     * 
+     * A frame: 'K' (keyframe) or 'D' (delta), the slice's size as a varint,
+     * then tokens until the slice is covered. Each token is a varint of
+     * (count << 2 | kind): kind 0 skips `count` bytes, 1 repeats the byte
+     * that follows `count` times, 2 copies the `count` bytes that follow.
+     * Varints are LEB128, 7 bits a byte, low bits first.
+     */
+    
+    class SliceDeltaEncoder {
+        size_t m_keyframe_interval;
+        size_t m_since_keyframe; // 0 when the next slice is a keyframe.
+        std::vector<char> m_previous;
+    
+    public:
+        // keyframe_interval - slices from one keyframe to the next, at least 1.
+        explicit SliceDeltaEncoder(size_t keyframe_interval = 32);
+        
+        /* Codes the next slice of the stack. A slice of a different size
+         * than the last one starts a keyframe.
+         */
+        std::vector<char> Encode(const char* slice, size_t size);
+        
+        // Makes the next slice a keyframe, e.g. when starting a new consumer.
+        void ForceKeyframe() { m_since_keyframe = 0; }
+    };
+    
+    class SliceDeltaDecoder {
+        std::vector<char> m_current;
+        bool m_have_keyframe;
+    
+    public:
+        SliceDeltaDecoder() : m_have_keyframe{false} {}
+        
+        /* Applies the next frame of the stack. Deltas need the frames since
+         * the last keyframe to have been decoded in order.
+         * 
+         * Returns:
+         * the slice, valid until the next call.
+         * 
+         * Throws std::runtime_error for malformed frames, and deltas with no
+         * keyframe before them.
+         */
+        const std::vector<char>& Decode(const char* frame, size_t size);
+        
+        // The slice decoded last.
+        const std::vector<char>& Current() const { return m_current; }
+        
+        static bool IsKeyframe(const char* frame, size_t size) { return size > 0 && frame[0] == 'K'; }
+    };
+    
+    /* A file of one delta coded stack: "ASHSTACK", the slice size as 64 bits,
+     * then each frame, preceded by its length as 64 bits.
+     */
+    class SliceStackWriter {
+        std::ofstream m_file;
+        std::string m_path;
+        size_t m_slice_size;
+        SliceDeltaEncoder m_encoder;
+    
+    public:
+        // Throws std::runtime_error if the file can't be created.
+        SliceStackWriter(const std::string& path, size_t slice_size, size_t keyframe_interval = 32);
+        
+        // Appends the next slice, of the stack's slice size.
+        void Write(const char* slice);
+    };
+    
+    class SliceStackReader {
+        std::ifstream m_file;
+        std::string m_path;
+        size_t m_slice_size;
+        std::vector<uint64_t> m_offsets; // of each frame's data.
+        std::vector<uint64_t> m_lengths;
+        std::vector<size_t> m_keyframes; // slice numbers, ascending.
+        
+        SliceDeltaDecoder m_decoder;
+        size_t m_decoded; // slice in the decoder, or NumSlices() if none.
+        std::vector<char> m_frame;
+    
+    public:
+        // Indexes the frames. Throws std::runtime_error if not a stack file.
+        explicit SliceStackReader(const std::string& path);
+        
+        size_t NumSlices() const { return m_offsets.size(); }
+        size_t SliceSize() const { return m_slice_size; }
+        
+        /* Rebuilds a slice from the nearest keyframe before it, or onwards
+         * from the slice read last, if that's nearer. Reading in order
+         * therefore decodes each frame once.
+         * 
+         * Returns:
+         * the slice, valid until the next call.
+         */
+        const std::vector<char>& ReadSlice(size_t slice_num);
+    };
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "slice_sink.h"
+
+namespace Ashigaru 
+{
+    /* A file of slices, written straight through a memory mapping, for
+     * images larger than memory. The render thread places tiles directly
+     * into the mapping (see RenderServer::ViewSliceTo()), and the kernel
+     * writes them out as it sees fit, so the size of a slice is bounded by
+     * the disk rather than by RAM.
+     * 
+     * The file is created at its full size up front, but sparse: a slice's
+     * region takes disk space only once written. Only the region of the
+     * slice being written is mapped. Publishing a slice starts writing it
+     * out, and the one before it is then dropped from the page cache, so
+     * finished slices don't crowd out memory.
+     * 
+     * Layout: a header page (FileHeader, below), then a region per slice in
+     * the file's range, each page aligned. Within a region, the outputs are
+     * laid out as the view's (see RenderServer::OutputSizes()), each at its
+     * offset in the header, and page aligned.
+     * 
+     * POSIX only.
+     */
+    class SliceFile : public SliceSink {
+    public:
+        // Regions can't hold more outputs than this.
+        static const unsigned int max_outputs = 32;
+        
+        struct FileHeader {
+            uint32_t magic; // "ASHF"
+            uint32_t num_outputs;
+            uint64_t first_slice, num_slices;
+            uint64_t header_size; // where the first slice's region starts.
+            uint64_t slice_stride;
+            uint64_t output_offsets[max_outputs]; // within a region.
+            uint64_t output_sizes[max_outputs];
+        };
+    
+    private:
+        int m_fd;
+        std::string m_path;
+        FileHeader m_header;
+        
+        // The region being written, and the last one published.
+        char* m_mapping;
+        uint64_t m_mapped_slice;
+        bool m_have_published;
+        uint64_t m_published_slice;
+        
+        SliceFile(int fd, const std::string& path, const FileHeader& header);
+        uint64_t RegionOffset(uint64_t slice_num) const;
+        void Unmap();
+    
+    public:
+        /* Creates the file, replacing any of the same name.
+         * 
+         * Arguments:
+         * path - where.
+         * first_slice, num_slices - the slice numbers the file takes.
+         * output_sizes - bytes of each output of the slices to be written.
+         * 
+         * Throws std::runtime_error if the file can't be created.
+         */
+        static std::unique_ptr<SliceFile> Create(const std::string& path,
+            uint64_t first_slice, uint64_t num_slices, const std::vector<size_t>& output_sizes);
+        
+        virtual ~SliceFile();
+        SliceFile(const SliceFile&) = delete;
+        SliceFile& operator=(const SliceFile&) = delete;
+        
+        const FileHeader& Header() const { return m_header; }
+        virtual std::vector<size_t> OutputSizes() const;
+        
+        /* As a SliceSink, for the render thread. Slices may come in any
+         * order, but each must be in the file's range, or AcquireOutputs()
+         * throws std::runtime_error.
+         */
+        virtual std::vector<char*> AcquireOutputs(size_t slice_num);
+        virtual void PublishOutputs();
+    };
+}
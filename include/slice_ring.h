@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "slice_sink.h"
+
+namespace Ashigaru 
+{
+    /* A ring of slice frames in POSIX shared memory, for handing slices to 
+     * another process without copying or encoding them. The render thread
+     * writes tiles straight into a frame (see RenderServer::ViewSliceTo()),
+     * and the consumer maps the same memory and reads them in place.
+     * 
+     * There is one producer and one consumer. Frames are published and 
+     * released in order. When all frames are published but not yet released,
+     * the producer blocks until the consumer releases one; a slow consumer 
+     * therefore holds back the render thread, rather than the ring growing.
+     * Waiting is on a futex in the shared header on Linux, polling elsewhere.
+     * 
+     * A consumer that goes away, closing its end or dying with frames held,
+     * would hold the render thread back for good. Instead, a producer 
+     * waiting for a frame checks whether the consumer is still there, and 
+     * AcquireFrame() throws if not, failing the slice.
+     * 
+     * Each frame holds the outputs of one slice, laid out as the view's 
+     * outputs (see RenderServer::OutputSizes()), each cache line aligned.
+     * 
+     * POSIX only.
+     */
+    class SliceRing : public SliceSink {
+    public:
+        // Frames can't hold more outputs than this.
+        static const unsigned int max_outputs = 32;
+        
+        struct Frame {
+            uint64_t slice_num;
+            std::vector<char*> outputs; // consumers only read these.
+        };
+        
+    private:
+        struct Header;
+        
+        Header* m_header;
+        size_t m_mapped_size;
+        std::string m_name;
+        bool m_owner; // the producer, who unlinks the segment.
+        uint32_t m_next_read; // consumer's next frame.
+        
+        SliceRing(const std::string& name, bool owner);
+        void Map(int fd, size_t size);
+        char* FrameBase(uint32_t sequence) const;
+        Frame MakeFrame(uint32_t sequence) const;
+        
+    public:
+        /* Creates the ring, replacing any stale segment of the same name. 
+         * 
+         * Arguments:
+         * name - the segment name, "/something" as for shm_open().
+         * num_frames - frames in the ring; at least 2 to overlap rendering 
+         *    with consumption.
+         * output_sizes - bytes of each output of the slices to be written.
+         * 
+         * Throws std::runtime_error if the segment can't be created.
+         */
+        static std::unique_ptr<SliceRing> Create(const std::string& name, unsigned int num_frames, 
+            const std::vector<size_t>& output_sizes);
+        
+        /* Opens the consumer's end of a ring another process created. One
+         * consumer at a time; it closes its end when destroyed.
+         */
+        static std::unique_ptr<SliceRing> Open(const std::string& name);
+        
+        virtual ~SliceRing();
+        SliceRing(const SliceRing&) = delete;
+        SliceRing& operator=(const SliceRing&) = delete;
+        
+        virtual std::vector<size_t> OutputSizes() const;
+        unsigned int NumFrames() const;
+        
+        /* Producer side: AcquireFrame() blocks until a frame is free, and 
+         * gives it for writing. PublishFrame() hands it to the consumer.
+         * One frame may be acquired at a time.
+         * 
+         * AcquireFrame() throws std::runtime_error if it would wait for a 
+         * consumer that closed its end, or whose process is gone.
+         */
+        Frame AcquireFrame(uint64_t slice_num);
+        void PublishFrame();
+        
+        // As a SliceSink, for the render thread.
+        virtual std::vector<char*> AcquireOutputs(size_t slice_num) { return AcquireFrame(slice_num).outputs; }
+        virtual void PublishOutputs() { PublishFrame(); }
+        
+        /* Consumer side: WaitFrame() gives the next published frame, which 
+         * stays valid until released. Several frames may be held, and are
+         * released oldest first.
+         * 
+         * Arguments:
+         * frame - output, the frame if one came.
+         * timeout_ms - how long to wait, or negative for no limit.
+         * 
+         * Returns:
+         * false on timeout.
+         */
+        bool WaitFrame(Frame& frame, int timeout_ms = -1);
+        void ReleaseFrame();
+    };
+}
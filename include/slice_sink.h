@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+namespace Ashigaru 
+{
+    /* Somewhere a view renders a slice into directly, instead of into fresh
+     * buffers handed out through futures. Tiles are copied straight into the
+     * sink's buffers, so a sink in shared memory (see SliceRing) gives the 
+     * slice to another process without a further copy.
+     * 
+     * Sinks are called only from the render thread.
+     */
+    class SliceSink {
+    public:
+        virtual ~SliceSink() {}
+        
+        // Bytes of each output the sink takes; must match the view's.
+        virtual std::vector<size_t> OutputSizes() const = 0;
+        
+        /* Blocks until the sink has room for a slice, then returns a buffer 
+         * per output for it, to be written before PublishOutputs().
+         */
+        virtual std::vector<char*> AcquireOutputs(size_t slice_num) = 0;
+        
+        // The buffers last acquired are complete.
+        virtual void PublishOutputs() = 0;
+    };
+}
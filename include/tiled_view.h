@@ -1,7 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <list>
+#include <map>
+#include <set>
 #include <future>
+#include <memory>
 #include <thread>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -10,46 +14,288 @@
 #include "opengl_utils.h"
 #include "util.h"
 #include "render_action.h"
+#include "slice_sink.h"
+#include "completion.h"
+#include "transform.h"
+#include "vertex_soa.h"
+#include "slice_cache.h"
 
 namespace Ashigaru {
+    /* One placement of a mesh in the view. Many instances may share a mesh,
+     * which is then stored on the GPU only once.
+     */
+    struct ModelInstance {
+        std::shared_ptr<const Model> model;
+        glm::mat4 transform;
+        unsigned int id; // the shell ID its pixels get.
+    };
+    
+    /* The order a view renders its tiles in, and so the order streamed 
+     * regions of a slice come in (see RegionCallback). Bands are rows of 
+     * tiles, across the image.
+     */
+    enum class TileOrder {
+        Columns,      // column by column, from the left. The default.
+        Bands,        // band by band, from image row 0.
+        BandsReversed // band by band, from the last image row.
+    };
+    
     /* This class should hold all persistent tile data. For example, the
      * per-tile VBOs and per-tile model lookup database that allows only
      * parts of a VBO to be used.
      * 
+     * A view may serve several render actions over the same scene. They share
+     * the binning and the buffers, and each slice renders all of them in one
+     * traversal of the tiles, so each additional action costs only its draws.
+     * 
+     * Tiles are built lazily: construction only places the instances, and 
+     * each tile is binned and uploaded when a slice first renders it, or 
+     * ahead of that by BuildNextTile(). Meshes are uploaded with the first
+     * tile that draws them. A view is thus ready at once, however large.
+     * 
      * TiledView is expected to be used *only* in the render thread, and
      * therefore can execute OpenGL calls with impunity.
      */
     class TiledView {
-        RenderAction& m_render_action;
+        std::vector<RenderAction*> m_render_actions;
         unsigned int m_full_width, m_full_height;
         unsigned int m_tile_width, m_tile_height;
-        std::vector<std::shared_ptr<const Model>> m_models; 
+        unsigned int m_num_width_tiles, m_num_height_tiles;
         
-        // OpenGL resources:
-        GLuint m_varray;
+        // OpenGL resources, in the structures below. All are owned, and freed 
+        // with the view or when evicted (see Evict()).
+        bool m_resident;
+        size_t m_gpu_bytes; // held by the buffers below, kept up as they change.
+        
+        // Each mesh's vertices are uploaded once, and tiles select from them
+        // through their own index buffers, drawing each mesh instanced.
+        struct Mesh {
+            std::shared_ptr<const Model> model;
+            GLObject positions; // empty while evicted.
+            
+            // The vertices again, for binning on the CPU. Made when a tile
+            // of the mesh is built, and kept only while others are left.
+            VertexSoA soa;
+            size_t unbuilt; // pairs of the mesh in m_unbuilt.
+            
+            BoundingBox bounds; // untransformed.
+            unsigned int num_instances;
+            uint64_t hash; // of the contents, for the slice cache. 0 until needed.
+            
+            // Quantized meshes store positions as 16-bit fractions of their
+            // bounds, which `dequantize` maps back into the mesh's space.
+            // Instances get it folded into their transforms, so shaders see 
+            // no difference. `stretch` is the most any instance ever placed
+            // stretched each axis, to bound the error in the tray.
+            bool quantized;
+            glm::mat4 dequantize;
+            glm::vec3 stretch;
+        };
+        std::map<const Model*, Mesh> m_meshes;
+        
+        struct Instance {
+            ModelInstance placement;
+            std::vector<size_t> footprint; // indices of the tiles its bounds overlap.
+        };
+        std::vector<Instance> m_instances;
+        
+        // The draw of one mesh on one tile, with the Z extent of what it draws.
+        struct Batch {
+            VertexDB vertices; // without a vertex array.
+            GLObject indices, instances;
+            std::vector<GLObject> varrays; // per render action, as it set them up.
+            float z_min, z_max;
+            
+            // Z extents of the faces drawn that aren't vertical, each sorted,
+            // for telling where the tile's geometry is a prism. Only kept when
+            // some action has ShiftInvariant() results.
+            std::vector<float> slanted_bottoms, slanted_tops;
+        };
+        
+        // A tile's last results for an action, reference counted so that 
+        // copies out of them may outlive the entry.
+        struct KeptResult {
+            bool valid;
+            float z_min, z_max; // the band of influence they hold for.
+            std::vector<std::shared_ptr<std::vector<char>>> outputs; // images, then reductions.
+        };
         
         struct Tile {
             Rect<unsigned int> region;
-            VertexDB vertices;
+            bool built; // false until first used, and again once evicted.
+            std::map<const Model*, Batch> mesh_batches;
+            
+            // The above, as given to each render action, with its vertex arrays.
+            std::vector<std::vector<VertexDB>> batches;
+            
+            // Z extent of the tile's geometry, so that slices which can't see
+            // any of it are filled on the CPU instead of rendered.
+            bool occupied;
+            float z_min, z_max;
+            
+            // Per render action. While the geometry around consecutive slices
+            // is a prism, their tiles are the same, so ShiftInvariant() 
+            // actions keep what they rendered and reuse it.
+            std::vector<KeptResult> kept;
         };
         std::vector<Tile> m_tiles;
+        std::vector<size_t> m_tile_order; // indices into m_tiles.
+        
+        bool m_keep_results; // some action is ShiftInvariant().
+        
+        // Largest error, in pixels, allowed by quantizing mesh vertices. 0
+        // keeps all of them in floats.
+        float m_max_quantization_error;
+        
+        // Hash of everything that goes into a slice but its number, for the
+        // slice cache. Recomputed after edits; 0 if an action can't be cached.
+        uint64_t m_cache_key;
+        bool m_cache_key_valid;
+        
+        // Slices whose outputs are still being handed over, after Render() 
+        // returned. Waited for when the view goes.
+        std::list<std::future<void>> m_completions;
+        
+        // Tile/mesh pairs whose batches need rebuilding after an edit.
+        using DirtySet = std::set<std::pair<size_t, const Model*>>;
+        
+        // Pairs of tiles not built yet, to bin when they are.
+        DirtySet m_unbuilt;
+        size_t m_prebuild_pos; // in m_tile_order; tiles before it are built.
+    
+    // Internal operations.
+    private:
+        // Find or upload a mesh, counting one more instance of it.
+        void UseMesh(const std::shared_ptr<const Model>& model);
+        
+        // Count one less instance of a mesh, and free it if it has none left.
+        void ReleaseMesh(const Model* model);
+        
+        std::vector<size_t> Footprint(const ModelInstance& placement) const;
+        
+        /* RebuildBatch() re-bins all instances of a mesh that overlap a tile,
+         * and replaces the tile's batch for that mesh with the result.
+         */
+        void RebuildBatch(size_t tile_ix, const Model* mesh);
+        
+        // Rebuilds built tiles, and notes pairs of the others for later.
+        void Rebuild(const DirtySet& dirty);
+        
+        // Bins and uploads a tile that isn't built yet.
+        void BuildTile(size_t tile_ix);
+        
+        std::vector<Instance>::iterator FindInstance(unsigned int id);
+        
+        void UploadMesh(Mesh& mesh);
+        
+        // GPU buffer bytes of a mesh's positions, and of a batch.
+        static size_t MeshBytes(const Mesh& mesh);
+        static size_t BatchBytes(const Batch& batch);
+        
+        // A mesh's SoA vertices, made if they aren't there.
+        const VertexSoA& BinningVertices(Mesh& mesh);
+        
+        // Whether a mesh's positions are best quantized, with its instances.
+        bool ShouldQuantize(const Mesh& mesh) const;
+        
+        /* UpdateMeshFormat() uploads a mesh that isn't yet, or again if its 
+         * instances changed whether it should be quantized, and then marks 
+         * all of its tiles dirty.
+         */
+        void UpdateMeshFormat(const Model* model, DirtySet& dirty);
+        
+        // Whether no face a tile draws, but vertical ones, reaches into a band.
+        bool Prismatic(const Tile& tile, float z_min, float z_max) const;
+        
+        // Drop a tile's kept results, when its geometry changes or goes.
+        void ForgetResults(Tile& tile);
         
+        // The slice cache key of a slice, or 0 if the view isn't cached.
+        uint64_t SliceCacheKey(size_t slice_num);
+    
     public:
         // For now, assume integer number of tiles in each dimension.
         // The neccessry adjustments to non-integer will wait.
         TiledView(
-            RenderAction& render_action,
+            const std::vector<RenderAction*>& render_actions,
             unsigned int full_width, unsigned int full_height, 
             unsigned int tile_width, unsigned int tile_height,
-            std::vector<std::shared_ptr<const Model>>& geometry
+            const std::vector<ModelInstance>& instances
         );
         
-        size_t NumOutputs() { return m_render_action.OutputPixelSizes().size(); }
+        // For each render action in order, images first, then reductions.
+        size_t NumOutputs() const;
+        std::vector<size_t> OutputSizes() const; // bytes of each.
+        const std::vector<RenderAction*>& GetRenderActions() const { return m_render_actions; }
+        
+        /* Eviction: a view may give up its GPU buffers when idle, keeping 
+         * only what's needed to rebuild them. Rendering or editing an evicted
+         * view makes it resident again automatically.
+         */
+        bool Resident() const { return m_resident; }
+        void Evict();
+        void MakeResident();
+        
+        void SetTileOrder(TileOrder order);
+        
+        /* BuildNextTile() builds the first tile in tile order that isn't 
+         * built yet, i.e. the one the next slice will need first. Meant for 
+         * idle time, a tile at a time, so that it never holds up much else.
+         * 
+         * Returns:
+         * false if there was none, or the view is evicted.
+         */
+        bool BuildNextTile();
+        
+        // Whether BuildNextTile() has nothing left to do.
+        bool Built() const { return !m_resident || m_prebuild_pos == m_tile_order.size(); }
+        
+        /* Vertex quantization stores each mesh's positions as 16-bit 
+         * fractions of its bounding box, 8 bytes a vertex instead of 12, 
+         * for meshes where that errs by at most `max_error` pixels (or 
+         * layers) in the tray, for every instance. Others stay in floats.
+         * Binning is still exact; only what the GPU draws moves. 0, the 
+         * default, turns quantization off.
+         */
+        void SetVertexQuantization(float max_error);
+        
+        // Bytes of GPU buffer memory held for the view's geometry. Counted as
+        // buffers come and go, so it's cheap to ask.
+        size_t GPUMemory() const { return m_gpu_bytes; }
+        
+        /* Editing the scene. Only the tiles under the old and new footprint of 
+         * the changed instance are re-binned and re-uploaded. Instances are 
+         * identified by their ID, which must be unique in the view for these 
+         * to be meaningful.
+         * 
+         * Returns:
+         * false if there is no instance with the given ID (nothing is done).
+         */
+        void AddInstance(const ModelInstance& instance);
+        bool RemoveInstance(unsigned int id);
+        bool MoveInstance(unsigned int id, const glm::mat4& transform);
         
-        /* This generates the GPU instructions for all tiles, and returns future
-         * pointers to the images generated. The future becomes valid after all tiles
-         * have been rendered and copied to their final place, in the background.
+        /* This generates the GPU instructions for all tiles, and hands over the
+         * images generated. After all tiles have been rendered and copied to 
+         * their final place, `on_output` is called for each output, ordered as
+         * in NumOutputs(), in the background.
+         * 
+         * With a sink, the outputs are written into the sink's buffers 
+         * instead, and published there before returning; `on_output` may 
+         * then be empty. The sink's output sizes must match OutputSizes().
+         * 
+         * With `on_region`, each tile, or each band of tiles if `whole_bands`,
+         * is also streamed as soon as it's placed, before the outputs are 
+         * handed over. If it throws, the stream stops there, and each output
+         * gets the error instead; with a sink, Render() throws it.
+         * 
+         * Tiles whose geometry is a prism around this slice and the last one
+         * rendered reuse that one's results, for ShiftInvariant() actions.
+         * With the slice cache enabled (see slice_cache.h), and all actions 
+         * giving a CacheKey(), slices are first looked up there, and written
+         * there once rendered.
          */
-        void Render(size_t slice_num, std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>>& promises);
+        void Render(size_t slice_num, OutputCallback on_output, SliceSink* sink = nullptr,
+            RegionCallback on_region = nullptr, bool whole_bands = true);
     };
 }
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "util.h"
+
+namespace Ashigaru
+{
+    // Axis-aligned bounding box. An empty box has min > max.
+    struct BoundingBox {
+        Vertex min, max;
+    };
+    
+    /* TransformVertices() applies an affine transform to vertices and finds the
+     * bounding box of the result, in the same pass. Large inputs are split 
+     * into chunks processed in parallel, with VertexSoA's vector kernels.
+     * 
+     * Arguments:
+     * source - vertices to transform.
+     * dest - output, resized to fit. May be the same vector as `source`.
+     * transform - an affine transform. The bottom row is assumed (0, 0, 0, 1).
+     * 
+     * Returns:
+     * the bounding box of the transformed vertices.
+     */
+    BoundingBox TransformVertices(const VertexVec& source, VertexVec& dest, const glm::mat4& transform);
+    
+    /* ComputeBounds() finds the bounding box of vertices, in parallel 
+     * like TransformVertices().
+     */
+    BoundingBox ComputeBounds(const VertexVec& vertices);
+    
+    /* ClusterVertices() simplifies a mesh by vertex clustering: vertices are 
+     * binned in a grid of box cells, each cell's vertices merge into one at
+     * their mean, and faces left with fewer than 3 distinct vertices, or 
+     * repeating another face, are dropped. Detail under a cell is lost, so 
+     * the cell should match the size of what still shows, e.g. a pixel of 
+     * a low resolution render.
+     * 
+     * Arguments:
+     * model - the mesh to simplify. Vertices need not be shared between 
+     *    faces; coincident ones merge anyway.
+     * cell_size - side of a grid cell along X and Y, in the model's units.
+     * z_cell_size - the same along Z, e.g. a slice when only the image 
+     *    shrinks.
+     * 
+     * Returns:
+     * the simplified mesh.
+     * 
+     * Throws std::runtime_error if the mesh spans more than 2^21 cells 
+     * along an axis.
+     */
+    Model ClusterVertices(const Model& model, float cell_size, float z_cell_size);
+}
@@ -5,6 +5,7 @@
 #include <vector>
 #include <array>
 #include <utility>
+#include <string>
 #include <glm/glm.hpp>
 
 enum class ImageType {Color, Gray};
@@ -18,4 +19,16 @@ using Model = std::pair<VertexVec, TriangleVec>;
 
 Model readBinarySTL(const char *filename);
 
+// Writes a binary STL, with face normals from the winding. Throws 
+// std::runtime_error if the file can't be written.
+void writeBinarySTL(const char *filename, const Model& model);
+
+// Creates the directory and any missing parents. Failures show up later, 
+// when files can't be written there.
+void makeDirectories(const std::string& path);
+
+// A name to write `path` aside under before renaming it into place, unique
+// among all processes and threads writing into the same directory.
+std::string tempPath(const std::string& path);
+
 #endif
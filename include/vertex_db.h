@@ -1,7 +1,12 @@
 #pragma once
 
 #include <map>
+#include <string>
+#include <stdexcept>
 #include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "opengl_utils.h"
 
 /* the idea of VertexDB is that it enables vertex selection without regard to 
  * which vertex properties are available. This way, we gain the following:
@@ -17,13 +22,43 @@
  * 3. We can add to this class vertex indexing/selection such that we can 
  *    e,g. select on priority without caring what else is in the VertexDB.
  * 
- * for now, though, it stores a variable number of equal-length named columns.
+ * for now, though, it stores a variable number of equal-length named columns,
+ * and optionally an element buffer selecting the triangles to draw from them.
+ * This lets many VertexDBs share the same columns, each drawing its own subset.
+ * A VertexDB may also be drawn instanced, with per-instance data in an 
+ * "instances" buffer of InstanceRecord. Finally, it may carry a vertex array
+ * with all of the above already recorded, so that drawing it takes no setup.
  */
 
+// Per-instance data for instanced draws: where the mesh is placed, and the
+// ID its pixels get.
+struct InstanceRecord {
+    glm::mat4 transform;
+    GLuint id;
+};
+
+// How a column's elements are stored, as given to glVertexAttribPointer(). 
+// Columns are three floats, tightly packed, unless set otherwise.
+struct ColumnFormat {
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    GLsizei stride;
+};
+
 class VertexDB {
     std::map<std::string, GLuint> m_buffers;
+    std::map<std::string, ColumnFormat> m_formats;
     unsigned int m_num_verts;
     
+    bool m_indexed = false; // if not, draw all vertices in order.
+    GLuint m_indices = 0;
+    unsigned int m_num_indices = 0;
+    
+    unsigned int m_num_instances = 0; // 0 for a non-instanced draw.
+    
+    GLuint m_varray = 0; // not owned. 0 if the caller sets up attributes.
+    
 public:
     VertexDB() : m_num_verts{0} {}
     VertexDB(unsigned int num_verts) : m_num_verts{num_verts} {}
@@ -42,5 +77,57 @@ public:
     void AddBuffer(const std::string& name, GLuint buff) { m_buffers[name] = buff; }
     
     GLuint GetBuffer(const std::string& name) const { return m_buffers.at(name); }
+    
+    void SetFormat(const std::string& name, ColumnFormat format) { m_formats[name] = format; }
+    ColumnFormat GetFormat(const std::string& name) const {
+        auto found = m_formats.find(name);
+        if (found == m_formats.end())
+            return ColumnFormat{3, GL_FLOAT, GL_FALSE, 0};
+        return found->second;
+    }
     unsigned int VertexCount() { return m_num_verts; }
+    
+    // Element buffer holds GL_UNSIGNED_INT indices into the columns.
+    void SetIndices(GLuint index_buff, unsigned int num_indices) {
+        m_indexed = true;
+        m_indices = index_buff;
+        m_num_indices = num_indices;
+    }
+    bool Indexed() const { return m_indexed; }
+    
+    void SetInstanceCount(unsigned int num_instances) { m_num_instances = num_instances; }
+    unsigned int InstanceCount() const { return m_num_instances; }
+    GLuint IndexBuffer() const { return m_indices; }
+    unsigned int IndexCount() const { return m_num_indices; }
+    
+    // A vertex array holding the attribute pointers and the element buffer.
+    void SetVertexArray(GLuint varray) { m_varray = varray; }
+    GLuint VertexArray() const { return m_varray; }
+    
+    /* Draw() issues the draw call for the selected vertices, as triangles.
+     * Binds the vertex array if there is one. Otherwise, assumes the caller 
+     * has already set up the attribute pointers for whichever columns it 
+     * uses, including per-instance ones.
+     */
+    void Draw() const {
+        if (m_varray)
+            GLState::BindVertexArray(m_varray);
+        
+        if (Indexed()) {
+            if (m_num_indices == 0)
+                return;
+            if (!m_varray)
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indices);
+            if (m_num_instances)
+                glDrawElementsInstanced(GL_TRIANGLES, m_num_indices, GL_UNSIGNED_INT, (void*)0, m_num_instances);
+            else
+                glDrawElements(GL_TRIANGLES, m_num_indices, GL_UNSIGNED_INT, (void*)0);
+        }
+        else {
+            if (m_num_instances)
+                glDrawArraysInstanced(GL_TRIANGLES, 0, m_num_verts, m_num_instances);
+            else
+                glDrawArrays(GL_TRIANGLES, 0, m_num_verts);
+        }
+    }
 };
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "util.h"
+#include "transform.h"
+
+namespace Ashigaru
+{
+    /* Allocates with the alignment the widest vector kernels load at. */
+    template <typename T>
+    struct AlignedAllocator {
+        using value_type = T;
+        static const size_t alignment = 32;
+        
+        AlignedAllocator() {}
+        template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+        
+        T* allocate(size_t count) {
+            void* mem = nullptr;
+#ifdef _WIN32
+            mem = _aligned_malloc(count*sizeof(T), alignment);
+#else
+            if (posix_memalign(&mem, alignment, count*sizeof(T)) != 0)
+                mem = nullptr;
+#endif
+            if (mem == nullptr)
+                throw std::bad_alloc();
+            return (T*)mem;
+        }
+        
+        void deallocate(T* mem, size_t) {
+#ifdef _WIN32
+            _aligned_free(mem);
+#else
+            free(mem);
+#endif
+        }
+        
+        template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+        template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+    };
+    
+    using AlignedFloats = std::vector<float, AlignedAllocator<float>>;
+    
+    /* Vertices stored as separate, aligned X, Y and Z arrays, for the CPU 
+     * passes over whole meshes: bounds, transforms, and tile tests. Each
+     * runs at vector width (AVX2 or SSE, whichever the build targets, else
+     * scalar code).
+     * 
+     * The arrays are padded to a multiple of the widest vector by repeating 
+     * the last vertex, so kernels need no tail loop, and the padding never
+     * changes bounds.
+     */
+    class VertexSoA {
+        size_t m_size;
+        AlignedFloats m_x, m_y, m_z;
+        
+        void Resize(size_t size);
+        
+    public:
+        static const size_t lanes = 8; // padding granularity.
+        
+        VertexSoA() : m_size{0} {}
+        explicit VertexSoA(const VertexVec& vertices);
+        
+        // Replaces the contents with `count` interleaved vertices, keeping
+        // the arrays' memory when it's enough.
+        void Assign(const Vertex* vertices, size_t count);
+        
+        size_t size() const { return m_size; }
+        size_t PaddedSize() const { return m_x.size(); }
+        
+        const float* X() const { return m_x.data(); }
+        const float* Y() const { return m_y.data(); }
+        const float* Z() const { return m_z.data(); }
+        
+        // Back to interleaved vertices, as GL buffers take them.
+        VertexVec Interleaved() const;
+        void CopyTo(Vertex* dest) const; // size() vertices.
+        
+        BoundingBox Bounds() const;
+        
+        /* Transform() writes the vertices under an affine transform into 
+         * `dest`, which may be this, and returns their bounds.
+         */
+        BoundingBox Transform(const glm::mat4& transform, VertexSoA& dest) const;
+        
+        /* MarkInRect() tests which vertices lie in an XY rectangle, edges 
+         * included.
+         * 
+         * Arguments:
+         * inside - output, resized to PaddedSize(). 1 for vertices inside, 
+         *    0 for the rest.
+         */
+        void MarkInRect(float left, float bottom, float right, float top, std::vector<uint8_t>& inside) const;
+    };
+}
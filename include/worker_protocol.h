@@ -0,0 +1,144 @@
+#pragma once
+
+/* The wire protocol between a DistributedRenderServer and its slice workers
+ * (see RunWorker()). Messages are framed over a Unix-domain stream socket; 
+ * slice results travel in POSIX shared memory, one segment per slice, and 
+ * only the segment's name goes over the socket. The front-end unlinks each 
+ * segment once read; the worker unlinks any left unread when the 
+ * connection closes, e.g. after the front-end died.
+ * 
+ * Every request carries an ID which its reply repeats, so replies may come 
+ * back in any order.
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "render_action.h"
+
+namespace Ashigaru {
+namespace Worker {
+    enum class MessageType : uint32_t {
+        RegisterModels, // models with their transforms -> model handles.
+        RegisterView,   // action specs, size, placements -> view handle.
+        EditView,       // add/remove/move an instance -> nothing.
+        UnregisterView, // view handle -> nothing.
+        ViewSlice,      // view handle, slice -> shm segment name, output sizes.
+        Reply           // ok flag, then the above, or an error string.
+    };
+    
+    enum class EditKind : uint32_t { Add, Remove, Move };
+    
+    /* A render action as the workers can build it. Actions are code, so only
+     * kinds known to the worker can be asked for; for now, TestRenderAction.
+     * The fields are its constructor's arguments.
+     */
+    struct ActionSpec {
+        uint32_t width, height; // tile size.
+        uint8_t with_stats, layered, box_filter;
+        uint32_t level_scale; // 0 for no downsampled levels.
+        float depth_range; // of the looks, in slices.
+    };
+    
+    std::unique_ptr<RenderAction> MakeAction(const ActionSpec& spec);
+    
+    /* Accumulates a message payload. Only plain data goes in, copied as is:
+     * both ends run the same binary, so layouts agree.
+     */
+    class Writer {
+        std::string m_data;
+        
+    public:
+        template <typename T> void Put(const T& value) { PutArray(&value, 1); }
+        
+        template <typename T> void PutArray(const T* values, size_t count) {
+            m_data.append((const char*)values, count*sizeof(T));
+        }
+        
+        void PutString(const std::string& str) {
+            Put<uint64_t>(str.size());
+            m_data.append(str);
+        }
+        
+        const std::string& Data() const { return m_data; }
+    };
+    
+    // Reads back what Writer wrote. Throws std::runtime_error when short.
+    class Reader {
+        const std::string& m_data;
+        size_t m_pos;
+        
+    public:
+        explicit Reader(const std::string& data) : m_data{data}, m_pos{0} {}
+        
+        template <typename T> T Get() {
+            T value;
+            GetArray(&value, 1);
+            return value;
+        }
+        
+        template <typename T> void GetArray(T* values, size_t count) {
+            size_t bytes = count*sizeof(T);
+            if (m_data.size() - m_pos < bytes)
+                throw std::runtime_error("Truncated worker message.");
+            std::memcpy((void*)values, m_data.data() + m_pos, bytes);
+            m_pos += bytes;
+        }
+        
+        std::string GetString() {
+            uint64_t size = Get<uint64_t>();
+            if (m_data.size() - m_pos < size)
+                throw std::runtime_error("Truncated worker message.");
+            m_pos += size;
+            return m_data.substr(m_pos - size, size);
+        }
+    };
+    
+    /* One end of a connected socket, owning it. Sends may come from several
+     * threads; receives from one at a time.
+     */
+    class Connection {
+        int m_fd;
+        std::mutex m_send_lock;
+        
+    public:
+        explicit Connection(int fd) : m_fd{fd} {}
+        ~Connection();
+        
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+        
+        // Throws std::runtime_error if nobody listens at the path.
+        static std::unique_ptr<Connection> Connect(const std::string& socket_path);
+        
+        // Throws std::runtime_error if the peer is gone.
+        void Send(MessageType type, uint64_t request_id, const std::string& payload);
+        
+        /* Blocks for the next message.
+         * Returns:
+         * false when the peer closed the connection.
+         */
+        bool Receive(MessageType& type, uint64_t& request_id, std::string& payload);
+        
+        // Makes a blocked Receive() return, e.g. to stop a reader thread.
+        void Shutdown();
+    };
+    
+    // Returns a socket listening at the path, replacing any stale socket file.
+    int Listen(const std::string& socket_path);
+    
+    /* Serves slice requests from one front-end at a time, until killed.
+     * Each connection gets a fresh RenderServer, so state doesn't leak from 
+     * one front-end to the next.
+     * 
+     * Returns:
+     * non-zero if the socket can't be set up.
+     */
+    int RunWorker(const std::string& socket_path, unsigned int tile_width, unsigned int tile_height);
+}
+}
@@ -0,0 +1,46 @@
+#version 330 core
+
+// Downsampled levels of a tile's ID and proximity outputs, a texel per block
+// of scale x scale tile texels: the most common ID in the block, and the
+// nearest proximity in it (the least depth), or with box_filter, the mean.
+
+in vec2 UV;
+uniform sampler2DArray depths; // layer 0 looking up, 1 looking down.
+uniform sampler2DArray ids; // layer 0 is the upward look's.
+uniform int scale;
+uniform bool box_filter;
+
+layout(location = 0) out vec4 id_level;
+layout(location = 1) out vec4 proximity_level;
+
+void main(){
+	ivec2 base = ivec2(gl_FragCoord.xy)*scale;
+	int block = scale*scale;
+	
+	// Proximity per texel, as take_min.glsl has it.
+	float nearest = 1.0, total = 0.0;
+	for (int i = 0; i < block; ++i) {
+		ivec3 texel = ivec3(base + ivec2(i % scale, i / scale), 0);
+		float proximity = min(texelFetch(depths, texel, 0).r, texelFetch(depths, texel + ivec3(0, 0, 1), 0).r);
+		nearest = min(nearest, proximity);
+		total += proximity;
+	}
+	proximity_level.r = box_filter ? total/float(block) : nearest;
+	
+	// The mode, by counting each texel's ID over the block. IDs come back
+	// exactly as written, so comparing them as floats is safe. Ties go to
+	// the first in row order.
+	float mode = 0.0;
+	int mode_count = 0;
+	for (int i = 0; i < block; ++i) {
+		float id = texelFetch(ids, ivec3(base + ivec2(i % scale, i / scale), 0), 0).r;
+		int count = 0;
+		for (int j = 0; j < block; ++j)
+			count += (texelFetch(ids, ivec3(base + ivec2(j % scale, j / scale), 0), 0).r == id) ? 1 : 0;
+		if (count > mode_count) {
+			mode = id;
+			mode_count = count;
+		}
+	}
+	id_level.r = mode;
+}
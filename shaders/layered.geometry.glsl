@@ -0,0 +1,28 @@
+#version 330 core
+
+// Emits each triangle into both layers of the target: layer 0 looking up,
+// layer 1 looking down, so one traversal of the geometry serves both looks.
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 6) out;
+
+// As in vertex.glsl.
+layout(std140) uniform Looks {
+	mat4 looks[2]; // up, down.
+};
+
+flat in uint vertexShellID[];
+flat out uint shellID;
+
+void main()
+{
+	for (int layer = 0; layer < 2; ++layer) {
+		for (int v = 0; v < 3; ++v) {
+			gl_Layer = layer;
+			gl_Position = looks[layer]*gl_in[v].gl_Position;
+			shellID = vertexShellID[v];
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
@@ -0,0 +1,19 @@
+#version 330 core
+
+// Places the instance in the tray, relative to the slice. Projection is left 
+// to layered.geometry.glsl, which needs the vertex once per look.
+
+// Possibly quantized, as in vertex.glsl.
+layout(location = 0) in vec3 vertexPosition_modelspace;
+layout(location = 1) in uint instance_ID;
+layout(location = 2) in mat4 instance_transform;
+
+uniform float slice_z;
+
+flat out uint vertexShellID;
+
+void main()
+{
+	gl_Position = instance_transform*vec4(vertexPosition_modelspace, 1) - vec4(0, 0, slice_z, 0);
+	vertexShellID = instance_ID;
+}
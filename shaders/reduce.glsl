@@ -0,0 +1,38 @@
+#version 330 core
+
+// One 2x2 reduction step. Each output texel combines up to 4 source 
+// texels, per channel by ops: 0 - min, 1 - max, 2 - sum.
+
+uniform sampler2D src;
+uniform ivec2 src_size;
+uniform ivec4 ops;
+
+out vec4 result;
+
+vec4 combine(vec4 a, vec4 b)
+{
+	vec4 ret;
+	for (int ch = 0; ch < 4; ++ch) {
+		if (ops[ch] == 0)
+			ret[ch] = min(a[ch], b[ch]);
+		else if (ops[ch] == 1)
+			ret[ch] = max(a[ch], b[ch]);
+		else
+			ret[ch] = a[ch] + b[ch];
+	}
+	return ret;
+}
+
+void main(){
+	ivec2 base = ivec2(gl_FragCoord.xy)*2;
+	result = texelFetch(src, base, 0);
+	
+	// Odd sizes leave the last row/column without a partner.
+	if (base.x + 1 < src_size.x)
+		result = combine(result, texelFetch(src, base + ivec2(1, 0), 0));
+	if (base.y + 1 < src_size.y) {
+		result = combine(result, texelFetch(src, base + ivec2(0, 1), 0));
+		if (base.x + 1 < src_size.x)
+			result = combine(result, texelFetch(src, base + ivec2(1, 1), 0));
+	}
+}
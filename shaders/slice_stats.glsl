@@ -0,0 +1,25 @@
+#version 330 core
+
+// The proximity output, as take_min.glsl, together with per-pixel values to 
+// reduce into slice statistics. Coverage is where the upward look sees 
+// geometry in range.
+
+in vec2 UV;
+uniform sampler2DArray depths; // layer 0 looking up, 1 looking down.
+
+layout(location = 0) out vec4 proximity;
+layout(location = 1) out vec4 bounds; // x, y, x, y - reduced by min, min, max, max.
+layout(location = 2) out vec4 summary; // proximity, coverage - reduced by min, sum.
+
+const float big = 1e30;
+
+void main(){
+	float up = texture(depths, vec3(UV, 0)).r;
+	float down = texture(depths, vec3(UV, 1)).r;
+	vec2 pixel = gl_FragCoord.xy - vec2(0.5);
+	
+	bool covered = up < 1.0;
+	proximity.r = min(up, down);
+	bounds = covered ? vec4(pixel, pixel) : vec4(big, big, -big, -big);
+	summary = vec4(min(up, down), covered ? 1.0 : 0.0, 0.0, 0.0);
+}
@@ -1,10 +1,10 @@
 #version 330 core
 
 in vec2 UV;
-uniform sampler2D tex1, tex2;
+uniform sampler2DArray depths; // layer 0 looking up, 1 looking down.
 
 out vec3 color;
 
 void main(){
-	color.r = min( texture(tex1, UV), texture(tex2, UV) ).r;
+	color.r = min( texture(depths, vec3(UV, 0)), texture(depths, vec3(UV, 1)) ).r;
 }
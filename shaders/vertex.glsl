@@ -1,14 +1,24 @@
 #version 330 core
 
+// Positions may come quantized, as fractions of the mesh's bounds; the 
+// instance transform then also maps them back to model space.
 layout(location = 0) in vec3 vertexPosition_modelspace;
-layout(location = 1) in uint vertex_shellID;
+layout(location = 1) in uint instance_ID;
+layout(location = 2) in mat4 instance_transform;
 
-uniform mat4 projection;
+// The tile's looks, as if the slice were at Z = 0. The slice is then just an 
+// offset, so looks are computed once per tile rather than per slice.
+layout(std140) uniform Looks {
+	mat4 looks[2]; // up, down.
+};
+uniform int look;
+uniform float slice_z;
 
 flat out uint shellID;
 
 void main()
 {
-	gl_Position = projection*vec4(vertexPosition_modelspace, 1);
-	shellID = vertex_shellID;
+	vec4 tray_position = instance_transform*vec4(vertexPosition_modelspace, 1);
+	gl_Position = looks[look]*(tray_position - vec4(0, 0, slice_z, 0));
+	shellID = instance_ID;
 }
@@ -0,0 +1,45 @@
+#include "completion.h"
+
+#include <mutex>
+
+using namespace Ashigaru;
+
+OutputCallback Ashigaru::WhenAll(size_t num_outputs, SliceCallback on_slice)
+{
+    struct Gather {
+        std::mutex lock;
+        std::vector<std::unique_ptr<char>> outputs;
+        size_t remaining;
+        std::exception_ptr error;
+    };
+    auto gather = std::make_shared<Gather>();
+    gather->outputs.resize(num_outputs);
+    gather->remaining = num_outputs;
+    
+    return [gather, on_slice](size_t output, std::unique_ptr<char> data, std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lck {gather->lock};
+            if (error && !gather->error)
+                gather->error = error;
+            gather->outputs[output] = std::move(data);
+            if (--gather->remaining > 0)
+                return;
+        }
+        
+        // The last one in; nobody else touches the gather now.
+        if (gather->error)
+            on_slice(std::vector<std::unique_ptr<char>>{}, gather->error);
+        else
+            on_slice(std::move(gather->outputs), nullptr);
+    };
+}
+
+OutputCallback Ashigaru::FulfillPromises(std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>> promises)
+{
+    return [promises](size_t output, std::unique_ptr<char> data, std::exception_ptr error) {
+        if (error)
+            promises[output]->set_exception(error);
+        else
+            promises[output]->set_value(std::move(data));
+    };
+}
@@ -0,0 +1,455 @@
+#include "distributed_render_server.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <cstring>
+
+using namespace Ashigaru;
+using namespace Ashigaru::Worker;
+
+DistributedRenderServer::DistributedRenderServer(const std::vector<std::string>& worker_sockets) :
+    m_next_request {0},
+    m_next_view {0}
+{
+    if (worker_sockets.empty())
+        throw std::runtime_error("A distributed server needs at least one worker.");
+    
+    for (auto& path : worker_sockets) {
+        m_workers.emplace_back(new WorkerLink);
+        m_workers.back()->conn = Connection::Connect(path);
+    }
+    
+    // Started last, so that they see everything initialized.
+    for (auto& worker : m_workers) {
+        WorkerLink* link = worker.get();
+        link->reader = std::thread([this, link]() { ReaderFunction(*link); });
+    }
+}
+
+DistributedRenderServer::~DistributedRenderServer()
+{
+    for (auto& worker : m_workers) {
+        worker->conn->Shutdown();
+        if (worker->reader.joinable())
+            worker->reader.join();
+    }
+}
+
+void DistributedRenderServer::ReaderFunction(WorkerLink& worker)
+{
+    MessageType type;
+    uint64_t request_id;
+    std::string payload;
+    
+    while (worker.conn->Receive(type, request_id, payload)) {
+        ReplyHandler handler;
+        {
+            std::lock_guard<std::mutex> lck {worker.lock};
+            auto found = worker.pending.find(request_id);
+            if (type != MessageType::Reply || found == worker.pending.end())
+                continue;
+            handler = std::move(found->second);
+            worker.pending.erase(found);
+        }
+        
+        Reader reply {payload};
+        try {
+            if (reply.Get<uint8_t>() != 0)
+                handler(&reply, "");
+            else
+                handler(nullptr, reply.GetString());
+        }
+        catch (std::exception& e) {
+            handler(nullptr, e.what()); // a malformed reply.
+        }
+    }
+    
+    // The worker is gone, and so are the answers it owed.
+    std::map<uint64_t, ReplyHandler> orphans;
+    {
+        std::lock_guard<std::mutex> lck {worker.lock};
+        worker.alive = false;
+        orphans.swap(worker.pending);
+    }
+    for (auto& orphan : orphans)
+        orphan.second(nullptr, "Worker connection lost.");
+}
+
+void DistributedRenderServer::Request(WorkerLink& worker, MessageType type, const std::string& payload, ReplyHandler handler)
+{
+    uint64_t request_id = m_next_request++;
+    bool alive;
+    {
+        std::lock_guard<std::mutex> lck {worker.lock};
+        alive = worker.alive;
+        if (alive)
+            worker.pending[request_id] = handler;
+    }
+    if (!alive) {
+        handler(nullptr, "Worker connection lost.");
+        return;
+    }
+    
+    try {
+        worker.conn->Send(type, request_id, payload);
+    }
+    catch (std::exception& e) {
+        // Unless the reader thread got to it first.
+        std::unique_lock<std::mutex> lck {worker.lock};
+        if (worker.pending.erase(request_id)) {
+            lck.unlock();
+            handler(nullptr, e.what());
+        }
+    }
+}
+
+void DistributedRenderServer::Broadcast(MessageType type, 
+    std::function<std::string(size_t)> payload_for, 
+    std::function<void(size_t, Reader&)> on_reply,
+    std::function<void(std::exception_ptr)> on_done)
+{
+    struct Gather {
+        std::mutex lock;
+        size_t remaining;
+        std::exception_ptr error;
+    };
+    auto gather = std::make_shared<Gather>();
+    gather->remaining = m_workers.size();
+    
+    for (size_t worker_ix = 0; worker_ix < m_workers.size(); ++worker_ix) {
+        Request(*m_workers[worker_ix], type, payload_for(worker_ix), 
+            [gather, worker_ix, on_reply, on_done](Reader* reply, const std::string& error)
+        {
+            std::exception_ptr failure;
+            if (reply) {
+                try {
+                    on_reply(worker_ix, *reply);
+                }
+                catch (...) {
+                    failure = std::current_exception();
+                }
+            }
+            else
+                failure = std::make_exception_ptr(std::runtime_error(error));
+            
+            std::exception_ptr result;
+            {
+                std::lock_guard<std::mutex> lck {gather->lock};
+                if (failure && !gather->error)
+                    gather->error = failure;
+                if (--gather->remaining > 0)
+                    return;
+                result = gather->error;
+            }
+            on_done(result);
+        });
+    }
+}
+
+std::future<void> DistributedRenderServer::Broadcast(MessageType type, 
+    std::function<std::string(size_t)> payload_for)
+{
+    auto done = std::make_shared<std::promise<void>>();
+    Broadcast(type, payload_for, [](size_t, Reader&) {}, 
+        [done](std::exception_ptr error) {
+            if (error)
+                done->set_exception(error);
+            else
+                done->set_value();
+        }
+    );
+    return done->get_future();
+}
+
+std::vector<DistributedRenderServer::ModelHandle> DistributedRenderServer::RegisterModels(
+    const std::vector<std::shared_ptr<const Model>>& models,
+    const std::vector<glm::mat4>& transforms)
+{
+    if (!transforms.empty() && transforms.size() != models.size())
+        throw std::runtime_error("Expected one transform per registered model.");
+    
+    Writer req;
+    req.Put<uint64_t>(models.size());
+    req.Put<uint8_t>(!transforms.empty());
+    for (size_t model_ix = 0; model_ix < models.size(); ++model_ix) {
+        const Model& model = *models[model_ix];
+        req.Put<uint64_t>(model.first.size());
+        req.PutArray(model.first.data(), model.first.size());
+        req.Put<uint64_t>(model.second.size());
+        req.PutArray(model.second.data(), model.second.size());
+        
+        if (!transforms.empty())
+            req.Put(transforms[model_ix]);
+    }
+    
+    // All workers see the same registrations, so they hand out the same 
+    // handles. Keep the first worker's.
+    std::vector<ModelHandle> handles;
+    std::promise<void> done;
+    Broadcast(MessageType::RegisterModels, 
+        [&req](size_t) { return req.Data(); },
+        [&handles](size_t worker_ix, Reader& reply) {
+            if (worker_ix != 0)
+                return;
+            handles.resize(reply.Get<uint64_t>());
+            for (auto& handle : handles)
+                handle = reply.Get<uint64_t>();
+        },
+        [&done](std::exception_ptr error) {
+            if (error)
+                done.set_exception(error);
+            else
+                done.set_value();
+        }
+    );
+    done.get_future().get();
+    
+    return handles;
+}
+
+std::future<DistributedRenderServer::ViewHandle> DistributedRenderServer::RegisterView(
+    const std::vector<ActionSpec>& render_actions,
+    unsigned int full_width, unsigned int full_height, 
+    const std::vector<Placement>& placements)
+{
+    if (render_actions.empty())
+        throw std::runtime_error("A view needs render actions.");
+    
+    // Count the outputs here, so that ViewSlice() knows without asking.
+    size_t num_outputs = 0;
+    for (auto& spec : render_actions) {
+        std::unique_ptr<RenderAction> action = MakeAction(spec);
+        num_outputs += action->OutputPixelSizes().size() + action->ReductionSizes().size();
+    }
+    
+    Writer req;
+    req.Put<uint32_t>(render_actions.size());
+    req.PutArray(render_actions.data(), render_actions.size());
+    req.Put<uint32_t>(full_width);
+    req.Put<uint32_t>(full_height);
+    req.Put<uint64_t>(placements.size());
+    req.PutArray(placements.data(), placements.size());
+    
+    struct Pending {
+        ViewHandle handle;
+        std::vector<ViewHandle> worker_views;
+        std::vector<bool> built;
+        std::promise<ViewHandle> ready;
+    };
+    auto pending = std::make_shared<Pending>();
+    pending->worker_views.resize(m_workers.size());
+    pending->built.resize(m_workers.size(), false);
+    {
+        std::lock_guard<std::mutex> lck {m_views_lock};
+        pending->handle = m_next_view++;
+    }
+    std::future<ViewHandle> ret = pending->ready.get_future();
+    
+    // Usable only once every worker has built it. If some failed, the rest
+    // drop theirs.
+    Broadcast(MessageType::RegisterView, 
+        [&req](size_t) { return req.Data(); },
+        [pending](size_t worker_ix, Reader& reply) {
+            pending->worker_views[worker_ix] = reply.Get<uint32_t>();
+            pending->built[worker_ix] = true;
+        },
+        [this, pending, num_outputs](std::exception_ptr error) {
+            if (!error) {
+                {
+                    std::lock_guard<std::mutex> lck {m_views_lock};
+                    m_worker_views[pending->handle] = pending->worker_views;
+                    m_view_outputs[pending->handle] = num_outputs;
+                }
+                pending->ready.set_value(pending->handle);
+                return;
+            }
+            
+            for (size_t worker_ix = 0; worker_ix < m_workers.size(); ++worker_ix) {
+                if (!pending->built[worker_ix])
+                    continue;
+                Writer req;
+                req.Put<uint32_t>(pending->worker_views[worker_ix]);
+                Request(*m_workers[worker_ix], MessageType::UnregisterView, req.Data(), 
+                    [](Reader*, const std::string&) {});
+            }
+            pending->ready.set_exception(error);
+        }
+    );
+    
+    return ret;
+}
+
+std::future<void> DistributedRenderServer::Edit(ViewHandle view, EditKind kind, const Placement& placement)
+{
+    std::vector<ViewHandle> worker_views;
+    {
+        std::lock_guard<std::mutex> lck {m_views_lock};
+        worker_views = m_worker_views.at(view);
+    }
+    
+    return Broadcast(MessageType::EditView, 
+        [&](size_t worker_ix) {
+            Writer req;
+            req.Put<uint32_t>(worker_views[worker_ix]);
+            req.Put(kind);
+            req.Put(placement);
+            return req.Data();
+        }
+    );
+}
+
+std::future<void> DistributedRenderServer::AddInstance(ViewHandle view, const Placement& placement)
+{
+    return Edit(view, EditKind::Add, placement);
+}
+
+std::future<void> DistributedRenderServer::RemoveInstance(ViewHandle view, unsigned int id)
+{
+    return Edit(view, EditKind::Remove, Placement{0, glm::mat4(1.0f), id});
+}
+
+std::future<void> DistributedRenderServer::MoveInstance(ViewHandle view, unsigned int id, const glm::mat4& transform)
+{
+    return Edit(view, EditKind::Move, Placement{0, transform, id});
+}
+
+std::future<void> DistributedRenderServer::UnregisterView(ViewHandle view)
+{
+    std::vector<ViewHandle> worker_views;
+    {
+        std::lock_guard<std::mutex> lck {m_views_lock};
+        worker_views = m_worker_views.at(view);
+        m_worker_views.erase(view);
+        m_view_outputs.erase(view);
+    }
+    
+    return Broadcast(MessageType::UnregisterView, 
+        [&](size_t worker_ix) {
+            Writer req;
+            req.Put<uint32_t>(worker_views[worker_ix]);
+            return req.Data();
+        }
+    );
+}
+
+/* CollectSlice() copies a slice's outputs out of the worker's shared memory
+ * segment, and removes the segment.
+ */
+static std::vector<std::unique_ptr<char>> CollectSlice(Reader& reply)
+{
+    std::string name = reply.GetString();
+    std::vector<uint64_t> sizes(reply.Get<uint64_t>());
+    reply.GetArray(sizes.data(), sizes.size());
+    
+    uint64_t total = 0;
+    for (auto size : sizes)
+        total += size;
+    
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        throw std::runtime_error("Can't open shared memory segment " + name);
+    shm_unlink(name.c_str()); // Gone once unmapped.
+    
+    void* mem = mmap(nullptr, total, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("Can't map shared memory segment " + name);
+    
+    std::vector<std::unique_ptr<char>> outputs;
+    const char* src = (const char*)mem;
+    for (auto size : sizes) {
+        outputs.emplace_back(new char[size]);
+        std::memcpy(outputs.back().get(), src, size);
+        src += size;
+    }
+    munmap(mem, total);
+    
+    return outputs;
+}
+
+std::vector<std::future<std::unique_ptr<char>>>
+DistributedRenderServer::ViewSlice(ViewHandle view, size_t slice_num)
+{
+    size_t num_outputs;
+    {
+        std::lock_guard<std::mutex> lck {m_views_lock};
+        num_outputs = m_view_outputs.at(view);
+    }
+    
+    std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>> promises;
+    std::vector<std::future<std::unique_ptr<char>>> images;
+    for (size_t output = 0; output < num_outputs; ++output) {
+        promises.push_back(std::make_shared<std::promise<std::unique_ptr<char>>>());
+        images.push_back(promises.back()->get_future());
+    }
+    
+    ViewSlice(view, slice_num, FulfillPromises(std::move(promises)));
+    return images;
+}
+
+void DistributedRenderServer::ViewSlice(ViewHandle view, size_t slice_num, OutputCallback on_output)
+{
+    size_t num_outputs;
+    std::vector<ViewHandle> worker_views;
+    {
+        std::lock_guard<std::mutex> lck {m_views_lock};
+        num_outputs = m_view_outputs.at(view);
+        worker_views = m_worker_views.at(view);
+    }
+    
+    // The least busy live worker gets it.
+    size_t chosen = 0;
+    size_t least_busy = SIZE_MAX;
+    for (size_t worker_ix = 0; worker_ix < m_workers.size(); ++worker_ix) {
+        WorkerLink& worker = *m_workers[worker_ix];
+        std::lock_guard<std::mutex> lck {worker.lock};
+        if (worker.alive && worker.slices_in_flight < least_busy) {
+            least_busy = worker.slices_in_flight;
+            chosen = worker_ix;
+        }
+    }
+    WorkerLink& worker = *m_workers[chosen];
+    {
+        std::lock_guard<std::mutex> lck {worker.lock};
+        ++worker.slices_in_flight;
+    }
+    
+    Writer req;
+    req.Put<uint32_t>(worker_views[chosen]);
+    req.Put<uint64_t>(slice_num);
+    
+    WorkerLink* link = &worker;
+    Request(worker, MessageType::ViewSlice, req.Data(), 
+        [link, num_outputs, on_output](Reader* reply, const std::string& error) 
+    {
+        {
+            std::lock_guard<std::mutex> lck {link->lock};
+            --link->slices_in_flight;
+        }
+        
+        std::exception_ptr failure;
+        std::vector<std::unique_ptr<char>> outputs;
+        if (reply) {
+            try {
+                outputs = CollectSlice(*reply);
+                if (outputs.size() != num_outputs)
+                    throw std::runtime_error("Worker returned the wrong number of outputs.");
+            }
+            catch (...) {
+                failure = std::current_exception();
+            }
+        }
+        else
+            failure = std::make_exception_ptr(std::runtime_error(error));
+        
+        for (size_t output = 0; output < num_outputs; ++output) {
+            if (failure)
+                on_output(output, nullptr, failure);
+            else
+                on_output(output, std::move(outputs[output]), nullptr);
+        }
+    });
+}
@@ -0,0 +1,113 @@
+#include "gpu_reduction.h"
+#include "shader_library.h"
+
+#include <algorithm>
+
+using namespace Ashigaru;
+
+static const float quad_vertices[][3] = {
+    {-1., -1., 0.},
+    {+1., -1., 0.},
+    {+1., +1., 0.},
+    {-1., +1., 0.}
+};
+
+void GPUReduction::InitGL()
+{
+    if (m_program)
+        return;
+    
+    m_program = SharedProgram({{GL_VERTEX_SHADER, "passthrough.vertex.glsl"}, {GL_FRAGMENT_SHADER, "reduce.glsl"}});
+    m_src_size_loc = glGetUniformLocation(*m_program, "src_size");
+    m_ops_loc = glGetUniformLocation(*m_program, "ops");
+    
+    // The source is always read from texture unit 0.
+    GLState::UseProgram(*m_program);
+    glUniform1i(glGetUniformLocation(*m_program, "src"), 0);
+    
+    m_quad_varray = GLObject(GLObject::Kind::VertexArray);
+    GLState::BindVertexArray(m_quad_varray);
+    m_quad_buffer = GLObject(GLObject::Kind::Buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_quad_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad_vertices), quad_vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    m_source_fbo = GLObject(GLObject::Kind::Framebuffer);
+    
+    // The chain of levels, each half the last, rounding up.
+    unsigned int width = m_width, height = m_height;
+    while (width > 1 || height > 1) {
+        width = (width + 1)/2;
+        height = (height + 1)/2;
+        
+        GLObject level(GLObject::Kind::Texture);
+        glBindTexture(GL_TEXTURE_2D, level);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        
+        GLObject fbo(GLObject::Kind::Framebuffer);
+        GLState::BindFramebuffer(fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, level, 0);
+        
+        m_levels.push_back(std::move(level));
+        m_level_fbos.push_back(std::move(fbo));
+        m_level_sizes.push_back(std::make_pair(width, height));
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void GPUReduction::ReleaseGL()
+{
+    m_program.reset();
+    m_quad_buffer.Reset();
+    m_quad_varray.Reset();
+    m_source_fbo.Reset();
+    m_levels.clear();
+    m_level_fbos.clear();
+    m_level_sizes.clear();
+}
+
+std::pair<GLsync, GLuint> GPUReduction::Reduce(GLuint source, Ops ops)
+{
+    GLState::UseProgram(*m_program);
+    glUniform4i(m_ops_loc, (GLint)ops[0], (GLint)ops[1], (GLint)ops[2], (GLint)ops[3]);
+    
+    GLState::BindVertexArray(m_quad_varray);
+    GLState::DepthTest(false);
+    glActiveTexture(GL_TEXTURE0);
+    
+    GLuint src = source;
+    unsigned int src_width = m_width, src_height = m_height;
+    for (size_t level = 0; level < m_levels.size(); ++level) {
+        GLState::BindFramebuffer(m_level_fbos[level]);
+        GLState::Viewport(0, 0, m_level_sizes[level].first, m_level_sizes[level].second);
+        
+        glBindTexture(GL_TEXTURE_2D, src);
+        glUniform2i(m_src_size_loc, src_width, src_height);
+        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+        
+        src = m_levels[level];
+        src_width = m_level_sizes[level].first;
+        src_height = m_level_sizes[level].second;
+    }
+    
+    // A 1x1 source has no levels; read it directly.
+    if (m_levels.empty()) {
+        GLState::BindFramebuffer(m_source_fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, source, 0);
+    }
+    
+    GLuint pbo;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, 4*sizeof(float), NULL, GL_STREAM_READ);
+    
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, 1, 1, GL_RGBA, GL_FLOAT, 0);
+    
+    GLsync read_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    return std::make_pair(read_fence, pbo);
+}
@@ -11,18 +11,101 @@
 #include "geometry.h"
 #include "opengl_utils.h"
 #include "render_server.h"
+#ifndef _WIN32
+#include "distributed_render_server.h"
+#endif
 
+#include <glm/gtc/matrix_transform.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
 
+/* Renders the demo scene on any server with the RenderServer interface.
+ * 
+ * Arguments:
+ * server - where to render.
+ * actions - what to render, in whatever form the server takes.
+ * geometry - the model, already sized to fit a width x width tray.
+ * slice_num - slice to save as images, or 0 to time a batch of slices.
+ */
+template <typename Server, typename Actions>
+static void RenderDemo(Server& server, const Actions& actions, 
+    std::shared_ptr<const Model> geometry, const glm::mat4& size_to_fit,
+    unsigned int width, unsigned int height, size_t slice_num, bool stats)
+{
+    // Create the view we want to render. The model is registered once and
+    // placed twice, side by side.
+    auto models = server.RegisterModels(
+        std::vector<std::shared_ptr<const Model>>{geometry}, std::vector<glm::mat4>{size_to_fit});
+    std::vector<Ashigaru::RenderServer::Placement> tray {
+        {models[0], glm::mat4(1.0f), 0},
+        {models[0], glm::translate(glm::mat4(1.0f), glm::vec3{width, 0, 0}), 1}
+    };
+    auto view = server.RegisterView(actions, 2*width, height, tray).get();
+    
+    // Render slices:
+	std::cout << "Slicing: " << std::endl;
+	bool batch = slice_num == 0;
+	if (batch) {
+		std::vector<std::vector<std::future<std::unique_ptr<char>>>> slices;
+
+		auto start = std::chrono::system_clock::now();
+		for (size_t slice = 0; slice < 500; ++slice) {
+			slices.push_back(server.ViewSlice(view, slice));
+		}
+		auto end = std::chrono::system_clock::now();
+
+		while (slices.size()) {
+			auto& slice = slices.back();
+			slice[0].get();
+			slice[1].get();
+			slices.pop_back();
+		}
+		auto fullEnd = std::chrono::system_clock::now();
+
+		std::cout << "Sending slice instructions: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << std::endl;
+		std::cout << "Finish all slices: " << std::chrono::duration_cast<std::chrono::milliseconds>(fullEnd - start).count() << std::endl;
+	}
+	else {
+		std::vector<std::future<std::unique_ptr<char>>> res = server.ViewSlice(view, slice_num);
+		// wait for results and save them:
+		std::unique_ptr<char> data = std::move(res[0].get());
+		writeImage("dump.png", 2 * width, height, ImageType::Gray, data.get(), "Ashigaru slice");
+
+		data = res[1].get();
+		writeImage("depth.png", 2 * width, height, ImageType::Gray, data.get(), "Ashigaru depth");
+		
+		if (stats) {
+			using Action = Ashigaru::TestRenderAction;
+			data = res[2].get();
+			const Action::SliceBounds& bounds = *(Action::SliceBounds*)data.get();
+			std::cout << "Bounds: " << bounds.min_x << ", " << bounds.min_y << " - " 
+				<< bounds.max_x << ", " << bounds.max_y << std::endl;
+			
+			data = res[3].get();
+			const Action::SliceSummary& summary = *(Action::SliceSummary*)data.get();
+			std::cout << "Min. proximity: " << summary.min_proximity 
+				<< ", covered area: " << summary.covered_area << " px" << std::endl;
+		}
+	}
+}
+
 int main(int argc, char **argv) {
     namespace po = boost::program_options;
 
     po::options_description desc("Allowed options");
     desc.add_options()
+            ("model", po::value<std::string>()->default_value("models/crystal.stl"), "Binary STL to slice.")
             ("img-size", po::value<unsigned int>()->default_value(2048u), "Side of square image generated.")
             ("tile-size", po::value<unsigned int>()->default_value(1024u), "Side of square tile for rendering.")
             ("slice", po::value<size_t>()->default_value(0u))
+            ("stats", po::bool_switch(), "Also reduce slice statistics on the GPU, and print them.")
+            ("layered", po::bool_switch(), "Render both looks in a single geometry pass.")
+            ("depth-range", po::value<float>()->default_value(2048.f), 
+                "How far the looks see from the slice, in slices. Shorter lets more tiles be skipped or reused.")
+#ifndef _WIN32
+            ("worker", po::value<std::string>(), "Run as a slice worker, listening at this socket path.")
+            ("connect", po::value<std::vector<std::string>>()->multitoken(), "Render on the workers at these socket paths.")
+#endif
     ;
 
     po::variables_map vm;
@@ -43,69 +126,49 @@ int main(int argc, char **argv) {
     unsigned int tile_width = vm["tile-size"].as <unsigned int>();
     unsigned int tile_height = tile_width;
     
-    // Load a model, do Q&D size-to-fit and then duplicate it.
-    // the two models are the (possibly) rendered scene.
-    std::shared_ptr<Model> geometry = std::make_shared<Model>(readBinarySTL("models/donkey.stl"));
-    Vertex maxV{ 0., 0., 0. }, minV{ 20000, 20000, 20000 };
-    for (auto& vertex : geometry->first) // find bounding box
-    {
-		maxV = glm::max(vertex, maxV);
-        minV = glm::min(vertex, minV); 
-    }
+    bool stats = vm["stats"].as<bool>();
+    float depth_range = vm["depth-range"].as<float>();
+    
+#ifndef _WIN32
+    // Serve slices to other processes, until killed.
+    if (vm.count("worker"))
+        return Ashigaru::Worker::RunWorker(vm["worker"].as<std::string>(), tile_width, tile_height);
+#endif
+    
+    // Load a model, do Q&D size-to-fit and then place it twice.
+    // the two instances are the (possibly) rendered scene.
+    std::shared_ptr<const Model> geometry = std::make_shared<Model>(readBinarySTL(vm["model"].as<std::string>().c_str()));
+    Ashigaru::BoundingBox bounds = Ashigaru::ComputeBounds(geometry->first);
+    Vertex minV = bounds.min, maxV = bounds.max;
     glm::vec3 dims = maxV - minV;
 	Vertex::value_type maxDim = std::max({ dims.x, dims.y, dims.z });
-    glm::vec3 scale_factor = {width, width, width};
-	for (auto& vertex : geometry->first) {
-		vertex = (vertex - minV) / maxDim * scale_factor;
-	}
+    
+    glm::mat4 size_to_fit = glm::scale(glm::mat4(1.0f), glm::vec3{width, width, width} / maxDim);
+    size_to_fit = glm::translate(size_to_fit, -minV);
 	std::cout << glm::to_string(minV) << std::endl;
 	std::cout << glm::to_string(maxV) << std::endl;
     
-    std::shared_ptr<Model> partner_geom {new Model{*geometry}};
-    for (auto& vertex : partner_geom->first) {
-        vertex.x += width;
+#ifndef _WIN32
+    // Slices rendered by worker processes instead of a render thread here.
+    if (vm.count("connect")) {
+        std::vector<Ashigaru::Worker::ActionSpec> actions {
+            {tile_width, tile_height, (uint8_t)stats, (uint8_t)vm["layered"].as<bool>(), 0, 0, depth_range}
+        };
+        Ashigaru::DistributedRenderServer server {vm["connect"].as<std::vector<std::string>>()};
+        RenderDemo(server, actions, geometry, size_to_fit, width, height, vm["slice"].as<size_t>(), stats);
+        
+        std::cout << "Healthy finish!" << std::endl;
+        return 0;
     }
+#endif
     
-    // Start the render server:
+    // Start the render server. The render action must outlive it, since the
+    // server releases the action's GL resources on shutdown.
+    Ashigaru::TestRenderAction program{tile_width, tile_height, stats, vm["layered"].as<bool>(), 0, false, depth_range};
     Ashigaru::RenderServer server(tile_width, tile_height);
+    RenderDemo(server, std::vector<Ashigaru::RenderAction*>{&program}, 
+        geometry, size_to_fit, width, height, vm["slice"].as<size_t>(), stats);
     
-    // Create the view we want to render:
-    Ashigaru::TestRenderAction program{tile_width, tile_height};
-    auto models = server.RegisterModels(std::vector<std::shared_ptr<Model>>{geometry, partner_geom});
-    auto view = server.RegisterView(program, 2*width, height, models).get();
-    
-    // Render slices:
-	std::cout << "Slicing: " << std::endl;
-	bool batch = vm["slice"].as<size_t>() == 0;
-	if (batch) {
-		std::vector<std::vector<std::future<std::unique_ptr<char>>>> slices;
-
-		auto start = std::chrono::system_clock::now();
-		for (size_t slice = 0; slice < 500; ++slice) {
-			slices.push_back(server.ViewSlice(view, slice));
-		}
-		auto end = std::chrono::system_clock::now();
-
-		while (slices.size()) {
-			auto& slice = slices.back();
-			slice[0].get();
-			slice[1].get();
-			slices.pop_back();
-		}
-		auto fullEnd = std::chrono::system_clock::now();
-
-		std::cout << "Sending slice instructions: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << std::endl;
-		std::cout << "Finish all slices: " << std::chrono::duration_cast<std::chrono::milliseconds>(fullEnd - start).count() << std::endl;
-	}
-	else {
-		std::vector<std::future<std::unique_ptr<char>>> res = server.ViewSlice(view, vm["slice"].as<size_t>());
-		// wait for results and save them:
-		std::unique_ptr<char> data = std::move(res[0].get());
-		writeImage("dump.png", 2 * width, height, ImageType::Gray, data.get(), "Ashigaru slice");
-
-		data = res[1].get();
-		writeImage("depth.png", 2 * width, height, ImageType::Gray, data.get(), "Ashigaru depth");
-	}
     std::cout << "Healthy finish!" << std::endl;
     return 0;
 }
@@ -0,0 +1,109 @@
+#include "mesh_generators.h"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace Ashigaru;
+
+static const float pi = 3.14159265358979f;
+
+Model Generate::Sphere(glm::vec3 center, float radius, unsigned int rings, unsigned int segments)
+{
+    if (rings < 2 || segments < 3)
+        throw std::runtime_error("A sphere needs at least 2 rings and 3 segments.");
+    
+    // The poles, then the inner circles of latitude, from the bottom.
+    Model sphere;
+    VertexVec& vertices = sphere.first;
+    TriangleVec& faces = sphere.second;
+    vertices.push_back(center - glm::vec3{0.f, 0.f, radius});
+    vertices.push_back(center + glm::vec3{0.f, 0.f, radius});
+    
+    for (unsigned int ring = 1; ring < rings; ++ring) {
+        float polar = pi*ring/rings;
+        for (unsigned int segment = 0; segment < segments; ++segment) {
+            float azimuth = 2*pi*segment/segments;
+            vertices.push_back(center + radius*glm::vec3{
+                std::sin(polar)*std::cos(azimuth), std::sin(polar)*std::sin(azimuth), -std::cos(polar)});
+        }
+    }
+    
+    // Outward winding, counter-clockwise seen from outside.
+    auto circle = [segments](unsigned int ring, unsigned int segment) {
+        return 2 + (ring - 1)*segments + segment % segments;
+    };
+    for (unsigned int segment = 0; segment < segments; ++segment) {
+        faces.push_back(Triangle{0, circle(1, segment + 1), circle(1, segment)});
+        faces.push_back(Triangle{1, circle(rings - 1, segment), circle(rings - 1, segment + 1)});
+        
+        for (unsigned int ring = 1; ring < rings - 1; ++ring) {
+            faces.push_back(Triangle{circle(ring, segment), circle(ring, segment + 1), circle(ring + 1, segment + 1)});
+            faces.push_back(Triangle{circle(ring, segment), circle(ring + 1, segment + 1), circle(ring + 1, segment)});
+        }
+    }
+    
+    return sphere;
+}
+
+// Appends an axis-aligned box, outward wound.
+static void AddBox(Model& model, glm::vec3 low, glm::vec3 high)
+{
+    unsigned int first = (unsigned int)model.first.size();
+    for (int corner = 0; corner < 8; ++corner) {
+        model.first.push_back(Vertex{
+            (corner & 1) ? high.x : low.x,
+            (corner & 2) ? high.y : low.y,
+            (corner & 4) ? high.z : low.z
+        });
+    }
+    
+    // Two triangles per side, by corner bits (x = 1, y = 2, z = 4).
+    static const unsigned int sides[6][4] = {
+        {0, 2, 3, 1}, // bottom, -z
+        {4, 5, 7, 6}, // top, +z
+        {0, 1, 5, 4}, // -y
+        {2, 6, 7, 3}, // +y
+        {0, 4, 6, 2}, // -x
+        {1, 3, 7, 5}, // +x
+    };
+    for (auto& side : sides) {
+        model.second.push_back(Triangle{first + side[0], first + side[1], first + side[2]});
+        model.second.push_back(Triangle{first + side[0], first + side[2], first + side[3]});
+    }
+}
+
+Model Generate::Lattice(unsigned int cells, float cell_size, float strut)
+{
+    Model lattice;
+    float half = strut/2;
+    for (unsigned int i = 0; i <= cells; ++i) {
+        for (unsigned int j = 0; j <= cells; ++j) {
+            for (unsigned int k = 0; k < cells; ++k) {
+                // A strut along each axis, starting at node (k, i, j) in that
+                // axis' order.
+                float a = i*cell_size, b = j*cell_size, start = k*cell_size, end = (k + 1)*cell_size;
+                AddBox(lattice, glm::vec3{start - half, a - half, b - half}, glm::vec3{end + half, a + half, b + half});
+                AddBox(lattice, glm::vec3{a - half, start - half, b - half}, glm::vec3{a + half, end + half, b + half});
+                AddBox(lattice, glm::vec3{a - half, b - half, start - half}, glm::vec3{a + half, b + half, end + half});
+            }
+        }
+    }
+    return lattice;
+}
+
+Model Generate::Array(const Model& part, unsigned int per_side, float spacing)
+{
+    Model array;
+    for (unsigned int row = 0; row < per_side; ++row) {
+        for (unsigned int col = 0; col < per_side; ++col) {
+            glm::vec3 offset {(col + 0.5f)*spacing, (row + 0.5f)*spacing, 0.f};
+            unsigned int first = (unsigned int)array.first.size();
+            
+            for (auto& vertex : part.first)
+                array.first.push_back(vertex + offset);
+            for (auto& face : part.second)
+                array.second.push_back(Triangle{first + face[0], first + face[1], first + face[2]});
+        }
+    }
+    return array;
+}
@@ -1,96 +1,118 @@
 #include "opengl_utils.h"
 
-#include <string>
-#include <fstream>
-#include <sstream>
-#include <vector>
+#include <algorithm>
 
-// Source: http://www.opengl-tutorial.org/beginners-tutorials/tutorial-2-the-first-triangle/
-GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path)
+GLObject::GLObject(Kind kind) : m_kind{kind}, m_name{0}
 {
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if (VertexShaderStream.is_open()){
-		std::stringstream sstr;
-		sstr << VertexShaderStream.rdbuf();
-		VertexShaderCode = sstr.str();
-		VertexShaderStream.close();
-	}
-	else{
-		printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", vertex_file_path);
-		getchar();
-		return 0;
+	switch (m_kind) {
+	case Kind::Buffer: glGenBuffers(1, &m_name); break;
+	case Kind::VertexArray: glGenVertexArrays(1, &m_name); break;
+	case Kind::Framebuffer: glGenFramebuffers(1, &m_name); break;
+	case Kind::Renderbuffer: glGenRenderbuffers(1, &m_name); break;
+	case Kind::Texture: glGenTextures(1, &m_name); break;
+	case Kind::Program: m_name = glCreateProgram(); break;
 	}
+}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if (FragmentShaderStream.is_open()){
-		std::stringstream sstr;
-		sstr << FragmentShaderStream.rdbuf();
-		FragmentShaderCode = sstr.str();
-		FragmentShaderStream.close();
+GLObject& GLObject::operator=(GLObject&& other)
+{
+	if (this != &other) {
+		Reset();
+		m_kind = other.m_kind;
+		m_name = other.m_name;
+		other.m_name = 0;
 	}
+	return *this;
+}
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
-
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	if (InfoLogLength > 0){
-		std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
-		glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-		printf("%s\n", &VertexShaderErrorMessage[0]);
+void GLObject::Reset()
+{
+	if (m_name == 0)
+		return;
+	
+	GLState::Forget(m_kind, m_name);
+	switch (m_kind) {
+	case Kind::Buffer: glDeleteBuffers(1, &m_name); break;
+	case Kind::VertexArray: glDeleteVertexArrays(1, &m_name); break;
+	case Kind::Framebuffer: glDeleteFramebuffers(1, &m_name); break;
+	case Kind::Renderbuffer: glDeleteRenderbuffers(1, &m_name); break;
+	case Kind::Texture: glDeleteTextures(1, &m_name); break;
+	case Kind::Program: glDeleteProgram(m_name); break;
 	}
+	m_name = 0;
+}
 
-	// Compile Fragment Shader
-	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
-	glCompileShader(FragmentShaderID);
+namespace {
+    // Unknown values are ones GL can't have, so that the first set goes through.
+    struct StateCache {
+        GLuint program = ~0u, fbo = ~0u, varray = ~0u;
+        GLint viewport[4] = {-1, -1, -1, -1};
+        int depth_test = -1;
+        GLfloat clear_color[4] = {-1.f, -1.f, -1.f, -1.f};
+    };
+    
+    thread_local StateCache state;
+}
 
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	if (InfoLogLength > 0){
-		std::vector<char> FragmentShaderErrorMessage(InfoLogLength + 1);
-		glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-		printf("%s\n", &FragmentShaderErrorMessage[0]);
-	}
+void GLState::UseProgram(GLuint program)
+{
+	if (state.program == program)
+		return;
+	glUseProgram(program);
+	state.program = program;
+}
 
-	// Link the program
-	printf("Linking program\n");
-	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
+void GLState::BindFramebuffer(GLuint fbo)
+{
+	if (state.fbo == fbo)
+		return;
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	state.fbo = fbo;
+}
 
-	// Check the program
-	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	if (InfoLogLength > 0){
-		std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
-		glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-		printf("%s\n", &ProgramErrorMessage[0]);
-	}
+void GLState::BindVertexArray(GLuint varray)
+{
+	if (state.varray == varray)
+		return;
+	glBindVertexArray(varray);
+	state.varray = varray;
+}
+
+void GLState::Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	GLint viewport[4] = {x, y, width, height};
+	if (std::equal(viewport, viewport + 4, state.viewport))
+		return;
+	glViewport(x, y, width, height);
+	std::copy(viewport, viewport + 4, state.viewport);
+}
 
-	glDetachShader(ProgramID, VertexShaderID);
-	glDetachShader(ProgramID, FragmentShaderID);
+void GLState::DepthTest(bool enabled)
+{
+	if (state.depth_test == (int)enabled)
+		return;
+	if (enabled)
+		glEnable(GL_DEPTH_TEST);
+	else
+		glDisable(GL_DEPTH_TEST);
+	state.depth_test = enabled;
+}
 
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
+void GLState::ClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+	GLfloat color[4] = {r, g, b, a};
+	if (std::equal(color, color + 4, state.clear_color))
+		return;
+	glClearColor(r, g, b, a);
+	std::copy(color, color + 4, state.clear_color);
+}
 
-	return ProgramID;
-}
\ No newline at end of file
+void GLState::Forget(GLObject::Kind kind, GLuint name)
+{
+	switch (kind) {
+	case GLObject::Kind::Program: if (state.program == name) state.program = ~0u; break;
+	case GLObject::Kind::Framebuffer: if (state.fbo == name) state.fbo = ~0u; break;
+	case GLObject::Kind::VertexArray: if (state.varray == name) state.varray = ~0u; break;
+	default: break;
+	}
+}
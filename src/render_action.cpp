@@ -5,12 +5,18 @@
 
 #include <glm/gtc/matrix_transform.hpp>
 #include "render_action.h"
+#include "shader_library.h"
 #include "geometry.h"
 
 #include <iostream>
+#include <algorithm>
+#include <limits>
+#include <cstddef>
+#include <stdexcept>
 
 using namespace Ashigaru;
 
+
 const float TestRenderAction::quad_vertices[][3] = {
     {-1., -1., 0.},
     {+1., -1., 0.},
@@ -25,60 +31,183 @@ const float TestRenderAction::quad_UV[][2] = {
     {0., 1.}
 };
 
-TestRenderAction::TestRenderAction(unsigned int width, unsigned int height) 
-    : m_width{width}, m_height{height}
-{}
+// Both passes' targets, in the order of their shaders' outputs.
+static std::vector<RenderTargets::Attachment> CombinedTargets(bool with_stats)
+{
+    std::vector<RenderTargets::Attachment> targets {{"proximity", GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2}};
+    if (with_stats) {
+        targets.push_back({"bounds", GL_RGBA32F, GL_RGBA, GL_FLOAT, 16});
+        targets.push_back({"summary", GL_RGBA32F, GL_RGBA, GL_FLOAT, 16});
+    }
+    return targets;
+}
+
+static std::vector<RenderTargets::Attachment> LevelTargets(unsigned int level_scale)
+{
+    if (!level_scale)
+        return std::vector<RenderTargets::Attachment>{};
+    return std::vector<RenderTargets::Attachment>{
+        {"ids", GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2},
+        {"proximity", GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2}
+    };
+}
+
+TestRenderAction::TestRenderAction(unsigned int width, unsigned int height, bool with_stats, bool layered,
+    unsigned int level_scale, bool box_filter, float depth_range) 
+    : m_width{width}, m_height{height}, m_depth_range{depth_range}, m_layered{layered}, m_ubo_slots{0}, m_with_stats{with_stats}, 
+      m_reduction{width, height}, m_combined{width, height, CombinedTargets(with_stats)},
+      m_level_scale{level_scale}, m_box_filter{box_filter}, m_level_scale_loc{-1}, m_box_filter_loc{-1}, 
+      m_levels{level_scale ? width/level_scale : 0, level_scale ? height/level_scale : 0, LevelTargets(level_scale)}
+{
+    // The mode takes scale^4 texel reads per pixel, so scales stay small.
+    if (level_scale > 16 || (level_scale && (width % level_scale || height % level_scale)))
+        throw std::runtime_error("Level scale must be at most 16, and divide the tile size.");
+    if (!(depth_range > 0))
+        throw std::runtime_error("The looks' depth range must be positive.");
+}
 
 void TestRenderAction::InitGL()
 {
+    if (m_combined.Framebuffer() != 0)
+        return;
+    
     // Create and compile our GLSL program from the shaders
-    m_full_program = LoadShaders("shaders/vertex.glsl", "shaders/frag.glsl");
-    m_height_program = LoadShaders("shaders/passthrough.vertex.glsl", "shaders/take_min.glsl");
-    m_fbo = SetupRenderTarget(m_width, m_height);
+    if (m_layered)
+        m_full_program = SharedProgram({{GL_VERTEX_SHADER, "layered.vertex.glsl"}, 
+            {GL_GEOMETRY_SHADER, "layered.geometry.glsl"}, {GL_FRAGMENT_SHADER, "frag.glsl"}});
+    else
+        m_full_program = SharedProgram({{GL_VERTEX_SHADER, "vertex.glsl"}, {GL_FRAGMENT_SHADER, "frag.glsl"}});
+    
+    // With statistics, the combining pass computes them too, with the proximity.
+    m_height_program = SharedProgram({{GL_VERTEX_SHADER, "passthrough.vertex.glsl"}, 
+        {GL_FRAGMENT_SHADER, m_with_stats ? "slice_stats.glsl" : "take_min.glsl"}});
+    
+    // Uniforms that never change are set here, the rest located once. Programs 
+    // may be shared with other actions, but these values are the same for all.
+    m_look_loc = glGetUniformLocation(*m_full_program, "look"); // -1 if layered, which GL ignores.
+    m_slice_z_loc = glGetUniformLocation(*m_full_program, "slice_z");
+    glUniformBlockBinding(*m_full_program, glGetUniformBlockIndex(*m_full_program, "Looks"), looks_binding);
+    
+    GLState::UseProgram(*m_height_program);
+    glUniform1i(glGetUniformLocation(*m_height_program, "depths"), 0);
+    
+    GLint alignment;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    m_slot_stride = (GLint)(2*sizeof(glm::mat4) + alignment - 1)/alignment*alignment;
+    m_looks_ubo = GLObject(GLObject::Kind::Buffer);
+    
+    SetupRenderTarget(m_width, m_height);
+    m_combined.InitGL();
     
     // Prepare a quad for deferred-shading methods.
-    glGenBuffers(1, &m_quad_buffer);
+    m_quad_varray = GLObject(GLObject::Kind::VertexArray);
+    GLState::BindVertexArray(m_quad_varray);
+    
+    m_quad_buffer = GLObject(GLObject::Kind::Buffer);
     glBindBuffer(GL_ARRAY_BUFFER, m_quad_buffer);
     glBufferData(GL_ARRAY_BUFFER, sizeof(quad_vertices), quad_vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(pos_attribute);
+    glVertexAttribPointer(pos_attribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
     
-    glGenBuffers(1, &m_quad_uv_buffer);
+    m_quad_uv_buffer = GLObject(GLObject::Kind::Buffer);
     glBindBuffer(GL_ARRAY_BUFFER, m_quad_uv_buffer);
     glBufferData(GL_ARRAY_BUFFER, sizeof(quad_UV), quad_UV, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(uv_attribute);
+    glVertexAttribPointer(uv_attribute, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
     
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    if (m_with_stats)
+        m_reduction.InitGL();
+    
+    if (m_level_scale) {
+        m_level_program = SharedProgram({{GL_VERTEX_SHADER, "passthrough.vertex.glsl"}, {GL_FRAGMENT_SHADER, "downsample.glsl"}});
+        GLState::UseProgram(*m_level_program);
+        glUniform1i(glGetUniformLocation(*m_level_program, "depths"), 0);
+        glUniform1i(glGetUniformLocation(*m_level_program, "ids"), 1);
+        m_level_scale_loc = glGetUniformLocation(*m_level_program, "scale");
+        m_box_filter_loc = glGetUniformLocation(*m_level_program, "box_filter");
+        m_levels.InitGL();
+    }
 }
 
-GLuint TestRenderAction::SetupRenderTarget(unsigned int width, unsigned int height)
+void TestRenderAction::ReleaseGL()
 {
-    GLuint render_buf;
-    GLuint fbo;
-    glGenFramebuffers(1, &fbo);
-    glGenRenderbuffers(1, &render_buf);
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-    
-    glBindRenderbuffer(GL_RENDERBUFFER, render_buf);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA16, width, height);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, render_buf);
-    
-    // Generate two textures for depth (looking up, looking down). The textures will later be 
+    m_full_program.reset();
+    m_height_program.reset();
+    m_combined.ReleaseGL();
+    m_depth_tex.Reset();
+    for (auto& fbo : m_look_fbo)
+        fbo.Reset();
+    m_layered_fbo.Reset();
+    m_layered_color.Reset();
+    m_quad_buffer.Reset();
+    m_quad_uv_buffer.Reset();
+    m_quad_varray.Reset();
+    
+    m_looks_ubo.Reset();
+    m_tile_slots.clear();
+    m_ubo_slots = 0;
+    
+    m_reduction.ReleaseGL();
+    
+    m_level_program.reset();
+    m_id_tex.Reset();
+    m_levels.ReleaseGL();
+}
+
+void TestRenderAction::SetupRenderTarget(unsigned int width, unsigned int height)
+{
+    // Generate a two-layer texture for depth (looking up, looking down). The layers will later be 
     // Combined by quad rendering ("deferred shading")
-    glGenTextures(2, m_depth_tex);
-    for (auto tex : m_depth_tex) 
-    {
-        glBindTexture(GL_TEXTURE_2D, tex);
-        glTexImage2D(GL_TEXTURE_2D, 0,GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    m_depth_tex = GLObject(GLObject::Kind::Texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_depth_tex);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, width, height, 2, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    
+    if (m_layered) {
+        // A layered framebuffer needs every attachment layered, so the color 
+        // is an array too. Only the ID (red) channel is kept, to keep the 
+        // down look's color writes, which nobody reads, cheap.
+        m_layered_fbo = GLObject(GLObject::Kind::Framebuffer);
+        m_layered_color = GLObject(GLObject::Kind::Texture);
+        
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_layered_color);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, width, height, 2, 0, GL_RED, GL_UNSIGNED_SHORT, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        GLState::BindFramebuffer(m_layered_fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_layered_color, 0);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depth_tex, 0);
+    }
+    else {
+        // A framebuffer per look, so that nothing is re-attached per tile.
+        // Looking down, only depth is needed. The IDs go into a texture of
+        // their own, like the layered color, for the levels to sample.
+        for (GLint look = 0; look < 2; ++look) {
+            m_look_fbo[look] = GLObject(GLObject::Kind::Framebuffer);
+            GLState::BindFramebuffer(m_look_fbo[look]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depth_tex, 0, look);
+        }
+        m_id_tex = GLObject(GLObject::Kind::Texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_id_tex);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, width, height, 1, 0, GL_RED, GL_UNSIGNED_SHORT, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        
+        GLState::BindFramebuffer(m_look_fbo[0]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_id_tex, 0, 0);
+        GLState::BindFramebuffer(m_look_fbo[1]);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
     }
         
     // No side effects, please.
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
     glBindRenderbuffer(GL_RENDERBUFFER, 0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    
-    return fbo;
+    GLState::BindFramebuffer(0);
 }
 
 void print_mat(const glm::mat4& PV) 
@@ -89,16 +218,21 @@ void print_mat(const glm::mat4& PV)
     std::cout << PV[3][0] << " " << PV[3][1] << " " << PV[3][2] << " " << PV[3][3] << std::endl;    
 }
 
-bool TestRenderAction::PrepareTile(Rect<unsigned int> tile_rect) {
-    Rect<unsigned int>::Corner tl = tile_rect.getTopLeft();
-    Rect<unsigned int>::Corner br = tile_rect.getBottomRight();
+size_t TestRenderAction::TileSlot(Rect<unsigned int> tile_rect)
+{
+    TileKey key {tile_rect.top(), tile_rect.left(), tile_rect.bottom(), tile_rect.right()};
+    auto found = m_tile_slots.find(key);
+    if (found != m_tile_slots.end())
+        return found->second;
+    
     unsigned int tw = tile_rect.Width();
     unsigned int th = tile_rect.Height();
-    glm::mat4 projection { glm::ortho(-(float)(tw/2), (float)(tw/2), -(float)(th/2), (float)(th/2), 0.f, 2048.f) };
+    glm::mat4 projection { glm::ortho(-(float)(tw/2), (float)(tw/2), -(float)(th/2), (float)(th/2), 0.f, m_depth_range) };
     
+    // The eye is at Z = 0; the vertex shader moves the geometry by the slice.
     glm::mat4 view = glm::lookAt(
-        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, m_slice},
-        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, m_slice + 1},
+        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, 0},
+        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, 1},
         glm::vec3{0, 1, 0}
     );
     
@@ -106,98 +240,271 @@ bool TestRenderAction::PrepareTile(Rect<unsigned int> tile_rect) {
     // We just mirror the X axis of the final image, so this is applied after 
     // the orthographic projection.
     glm::mat4 mirror_image = glm::scale(glm::mat4(1.0f), glm::vec3{-1, 1, 1});
-    m_look_up = mirror_image*projection*view;
+    glm::mat4 looks[2];
+    looks[0] = mirror_image*projection*view;
     
     // Now look down from the same place:   
     view = glm::lookAt(
-        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, m_slice},
-        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, m_slice - 1},
+        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, 0},
+        glm::vec3{tile_rect.left() + tw/2, tile_rect.bottom() + th/2, -1},
         glm::vec3{0, 1, 0}
     );
-    m_look_down = projection*view;
+    looks[1] = projection*view;
+    
+    size_t slot = m_tile_slots.size();
+    m_tile_slots[key] = slot;
+    
+    glBindBuffer(GL_UNIFORM_BUFFER, m_looks_ubo);
+    if (slot >= m_ubo_slots) {
+        // Grow, keeping the slots already there. A view's tiles come in once,
+        // so this happens a handful of times at most.
+        size_t new_slots = std::max<size_t>(16, 2*m_ubo_slots);
+        std::vector<char> old_data(m_ubo_slots*m_slot_stride);
+        if (m_ubo_slots > 0)
+            glGetBufferSubData(GL_UNIFORM_BUFFER, 0, old_data.size(), old_data.data());
         
+        glBufferData(GL_UNIFORM_BUFFER, new_slots*m_slot_stride, NULL, GL_STATIC_DRAW);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, old_data.size(), old_data.data());
+        m_ubo_slots = new_slots;
+    }
+    glBufferSubData(GL_UNIFORM_BUFFER, slot*m_slot_stride, sizeof(looks), &looks[0][0][0]);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    
+    return slot;
+}
+
+bool TestRenderAction::PrepareTile(Rect<unsigned int> tile_rect) {
+    m_tile_slot = TileSlot(tile_rect);
     return true;
 }
 
-std::vector<RenderAsyncResult> TestRenderAction::StartRender(VertexDB vertices) {
-    std::vector<RenderAsyncResult> ret;
-    
-    GLuint PosBufferID = vertices.GetBuffer("positions");
-    GLuint IDBufferID = vertices.GetBuffer("shellIDs");
-    unsigned int num_verts = vertices.VertexCount();
-    
-    // Make positions an attribute of the vertex array used for drawing:
+void TestRenderAction::SetupVertexArray(const VertexDB& batch)
+{
+    ColumnFormat positions = batch.GetFormat("positions");
+    glBindBuffer(GL_ARRAY_BUFFER, batch.GetBuffer("positions"));
     glEnableVertexAttribArray(pos_attribute);
-    glBindBuffer(GL_ARRAY_BUFFER, PosBufferID);
-    glVertexAttribPointer(pos_attribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    
-    glEnableVertexAttribArray(pos_attribute + 1);
-    glBindBuffer(GL_ARRAY_BUFFER, IDBufferID);
-    glVertexAttribPointer(pos_attribute + 1, 1, GL_UNSIGNED_SHORT, GL_FALSE, 0, (void*)0);
+    glVertexAttribPointer(pos_attribute, positions.size, positions.type, positions.normalized, positions.stride, (void*)0);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, batch.GetBuffer("instances"));
+    glEnableVertexAttribArray(id_attribute);
+    glVertexAttribDivisor(id_attribute, 1);
+    glVertexAttribIPointer(id_attribute, 1, GL_UNSIGNED_INT, sizeof(InstanceRecord), 
+        (void*)offsetof(InstanceRecord, id));
+    for (GLuint col = 0; col < 4; ++col) {
+        glEnableVertexAttribArray(transform_attribute + col);
+        glVertexAttribDivisor(transform_attribute + col, 1);
+        glVertexAttribPointer(transform_attribute + col, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceRecord), 
+            (void*)(offsetof(InstanceRecord, transform) + col*sizeof(glm::vec4)));
+    }
     
-    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
-    glUseProgram(m_full_program);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void TestRenderAction::DrawBatches(const std::vector<VertexDB>& batches)
+{
+    for (auto& batch : batches)
+        batch.Draw();
+}
+
+void TestRenderAction::RenderDepths(const std::vector<VertexDB>& batches, std::vector<RenderAsyncResult>& ret)
+{
+    GLState::UseProgram(*m_full_program);
+    glUniform1f(m_slice_z_loc, (float)m_slice);
+    glBindBufferRange(GL_UNIFORM_BUFFER, looks_binding, m_looks_ubo, m_tile_slot*m_slot_stride, 2*sizeof(glm::mat4));
     
-    GLuint MatrixID = glGetUniformLocation(m_full_program, "projection");
+    // Actual drawing:
+    // (Depth test is GL_LESS, the default, which nothing changes.)
+    GLState::Viewport(0, 0, m_width, m_height);
+    GLState::DepthTest(true);
+    GLState::ClearColor(0.0, 0.0, 0.4, 1.0);
     
     // First render: look up.
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depth_tex[0], 0);
-    glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &m_look_up[0][0]);
-    
-    // Actual drawing:
-    glViewport(0, 0, m_width, m_height);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
-    glClearColor(0.0, 0.0, 0.4, 1.0);
+    GLState::BindFramebuffer(m_look_fbo[0]);
+    glUniform1i(m_look_loc, 0);
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDrawArrays(GL_TRIANGLES, 0, num_verts);
+    DrawBatches(batches);
     
     ret.push_back(CommitBufferAsync(GL_COLOR_ATTACHMENT0, 2, GL_RED, GL_UNSIGNED_SHORT));
     
-    // Second render: looking down. Only depth is needed. However, if we set draw 
-    // buffer to GL_NONE, color is trampled and nobody cares that it's been a subject 
-    // of glReadPixels either, so for the demo we just render everything again.
-    //glDrawBuffer(GL_NONE);
-    
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depth_tex[1], 0);
-    glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &m_look_down[0][0]);
+    // Second render: looking down, into a depth-only framebuffer.
+    GLState::BindFramebuffer(m_look_fbo[1]);
+    glUniform1i(m_look_loc, 1);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    DrawBatches(batches);
+}
+
+void TestRenderAction::RenderDepthsLayered(const std::vector<VertexDB>& batches, std::vector<RenderAsyncResult>& ret)
+{
+    GLState::BindFramebuffer(m_layered_fbo);
+    GLState::UseProgram(*m_full_program);
+    glUniform1f(m_slice_z_loc, (float)m_slice);
+    glBindBufferRange(GL_UNIFORM_BUFFER, looks_binding, m_looks_ubo, m_tile_slot*m_slot_stride, 2*sizeof(glm::mat4));
+    
+    // Clearing a layered framebuffer clears all layers.
+    GLState::Viewport(0, 0, m_width, m_height);
+    GLState::DepthTest(true);
+    GLState::ClearColor(0.0, 0.0, 0.4, 1.0);
+    glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    DrawBatches(batches);
     
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDrawArrays(GL_TRIANGLES, 0, num_verts);
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(0);
+    // Reads from a layered framebuffer see layer 0, the upward look.
+    ret.push_back(CommitBufferAsync(GL_COLOR_ATTACHMENT0, 2, GL_RED, GL_UNSIGNED_SHORT));
+}
+
+std::vector<RenderAsyncResult> TestRenderAction::StartRender(const std::vector<VertexDB>& batches) {
+    std::vector<RenderAsyncResult> ret;
     
+    if (m_layered)
+        RenderDepthsLayered(batches, ret);
+    else
+        RenderDepths(batches, ret);
     
-    // Combine depth buffers:
-    glUseProgram(m_height_program);
+    // Combine depth buffers, and compute statistics if any, in one pass. The
+    // quad covers every pixel, so no clearing.
+    m_combined.Bind();
+    GLState::UseProgram(*m_height_program);
+    GLState::BindVertexArray(m_quad_varray);
+    GLState::DepthTest(false);
     
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_depth_tex[0]);
-    glUniform1i(glGetUniformLocation(m_height_program, "tex1"), 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_depth_tex);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
     
-    glActiveTexture(GL_TEXTURE0 + 1);
-    glBindTexture(GL_TEXTURE_2D, m_depth_tex[1]);
-    glUniform1i(glGetUniformLocation(m_height_program, "tex2"), 1);
+    ret.push_back(m_combined.ReadAsync("proximity"));
     
-    glEnableVertexAttribArray(pos_attribute);
-    glBindBuffer(GL_ARRAY_BUFFER, m_quad_buffer);
-    glVertexAttribPointer(pos_attribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    if (m_level_scale)
+        RenderLevels(ret);
     
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, m_quad_uv_buffer);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    // Reductions take over texture unit 0, so they go last.
+    if (m_with_stats) {
+        using Op = GPUReduction::Op;
+        ret.push_back(m_reduction.Reduce(m_combined.Texture("bounds"), GPUReduction::Ops{Op::Min, Op::Min, Op::Max, Op::Max}));
+        ret.push_back(m_reduction.Reduce(m_combined.Texture("summary"), GPUReduction::Ops{Op::Min, Op::Sum, Op::Sum, Op::Sum}));
+    }
+    
+    // Return sync objects:
+    return ret;
+}
 
-    glDisable(GL_DEPTH_TEST);
-    glClear(GL_COLOR_BUFFER_BIT);
+void TestRenderAction::RenderLevels(std::vector<RenderAsyncResult>& ret)
+{
+    // The quad's vertex array and the depth texture on unit 0 are still
+    // bound from the combining pass.
+    m_levels.Bind();
+    GLState::UseProgram(*m_level_program);
+    glUniform1i(m_level_scale_loc, m_level_scale);
+    glUniform1i(m_box_filter_loc, m_box_filter);
+    
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_layered ? m_layered_color : m_id_tex);
     glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glActiveTexture(GL_TEXTURE0);
     
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(0);
-    
-    ret.push_back(CommitBufferAsync(GL_COLOR_ATTACHMENT0, 2, GL_RED, GL_UNSIGNED_SHORT));
+    ret.push_back(m_levels.ReadAsync("ids"));
+    ret.push_back(m_levels.ReadAsync("proximity"));
+}
+
+std::vector<unsigned int> TestRenderAction::OutputPixelSizes() const
+{
+    if (m_level_scale)
+        return std::vector<unsigned int>{2, 2, 2, 2};
+    return std::vector<unsigned int>{2, 2};
+}
+
+std::vector<unsigned int> TestRenderAction::OutputScales() const
+{
+    if (m_level_scale)
+        return std::vector<unsigned int>{1, 1, m_level_scale, m_level_scale};
+    return std::vector<unsigned int>{1, 1};
+}
+
+std::vector<std::vector<char>> TestRenderAction::BackgroundPixels() const
+{
+    // Nothing seen: the ID output keeps the clear color's red channel (0),
+    // and the proximity output keeps the cleared depth (1.0, i.e. all ones).
+    unsigned short no_id = 0, no_depth = 0xFFFF;
+    const char* id_bytes = (const char*)&no_id;
+    const char* depth_bytes = (const char*)&no_depth;
+    
+    std::vector<std::vector<char>> background {
+        std::vector<char>(id_bytes, id_bytes + sizeof(no_id)),
+        std::vector<char>(depth_bytes, depth_bytes + sizeof(no_depth))
+    };
+    
+    // A block of background is background, whatever the filter.
+    if (m_level_scale) {
+        background.push_back(background[0]);
+        background.push_back(background[1]);
+    }
+    return background;
+}
+
+std::string TestRenderAction::CacheKey() const
+{
+    std::string key = "TestRenderAction " + std::to_string(m_width) + "x" + std::to_string(m_height) +
+        (m_with_stats ? " stats" : "") + (m_layered ? " layered" : "") + 
+        (m_level_scale ? " levels " + std::to_string(m_level_scale) + (m_box_filter ? " box" : "") : "") + 
+        " range " + std::to_string(m_depth_range) + "\n";
+    
+    // The sources as they would be loaded now, so edited shaders miss.
+    std::vector<std::string> shaders {"frag.glsl", "passthrough.vertex.glsl", "take_min.glsl"};
+    if (m_layered) {
+        shaders.push_back("layered.vertex.glsl");
+        shaders.push_back("layered.geometry.glsl");
+    }
+    else
+        shaders.push_back("vertex.glsl");
+    if (m_with_stats) {
+        shaders.push_back("slice_stats.glsl");
+        shaders.push_back("reduce.glsl");
+    }
+    if (m_level_scale)
+        shaders.push_back("downsample.glsl");
+    for (auto& shader : shaders)
+        key += ShaderSource(shader);
     
-    // Return sync objects:
-    return ret;
+    return key;
+}
+
+std::vector<unsigned int> TestRenderAction::ReductionSizes() const
+{
+    if (!m_with_stats)
+        return std::vector<unsigned int>{};
+    return std::vector<unsigned int>{sizeof(SliceBounds), sizeof(SliceSummary)};
+}
+
+void TestRenderAction::InitReduction(size_t which, char* slice_result) const
+{
+    if (which == 0) {
+        float big = std::numeric_limits<float>::max();
+        *(SliceBounds*)slice_result = SliceBounds{big, big, -big, -big};
+    }
+    else {
+        *(SliceSummary*)slice_result = SliceSummary{1.f, 0.f, {0.f, 0.f}};
+    }
+}
+
+void TestRenderAction::CombineReduction(size_t which, char* slice_result, const char* tile_result, 
+    Rect<unsigned int> tile_rect) const
+{
+    if (which == 0) {
+        SliceBounds& slice = *(SliceBounds*)slice_result;
+        const SliceBounds& tile = *(const SliceBounds*)tile_result;
+        if (tile.min_x > tile.max_x) // nothing seen in tile.
+            return;
+        
+        slice.min_x = std::min(slice.min_x, tile.min_x + tile_rect.left());
+        slice.min_y = std::min(slice.min_y, tile.min_y + tile_rect.bottom());
+        slice.max_x = std::max(slice.max_x, tile.max_x + tile_rect.left());
+        slice.max_y = std::max(slice.max_y, tile.max_y + tile_rect.bottom());
+    }
+    else {
+        SliceSummary& slice = *(SliceSummary*)slice_result;
+        const SliceSummary& tile = *(const SliceSummary*)tile_result;
+        slice.min_proximity = std::min(slice.min_proximity, tile.min_proximity);
+        slice.covered_area += tile.covered_area;
+    }
 }
 
 RenderAsyncResult TestRenderAction::CommitBufferAsync(GLenum which, unsigned short elem_size, GLenum format,  GLenum type)
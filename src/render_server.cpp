@@ -5,6 +5,10 @@
 
 #include <iostream>
 #include <utility>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <glm/gtc/matrix_transform.hpp>
 
 using namespace Ashigaru;
 
@@ -39,109 +43,577 @@ static bool CreateWindow()
     return true;
 }
 
-RenderServer::RenderServer(unsigned int tile_width, unsigned int tile_height) : 
-    // I know it's ugly, but in this case we save a move().
-    m_render_thread {std::thread(
-        [this]() { RenderThreadFunction(); }
-    ) },
+RenderServer::RenderServer(unsigned int tile_width, unsigned int tile_height, size_t gpu_memory_budget) : 
     m_keep_running {true},
     m_tile_width {tile_width},
-    m_tile_height {tile_height}
-{}
+    m_tile_height {tile_height},
+    m_gpu_budget {gpu_memory_budget},
+    m_next_view {0}
+{
+    // Started last, so that it sees everything initialized.
+    m_render_thread = std::thread([this]() { RenderThreadFunction(); });
+}
 
 RenderServer::~RenderServer() {
+    // Previews still being simplified would queue themselves after we're gone.
+    std::list<std::future<void>> preview_builds;
+    {
+        std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+        preview_builds.swap(m_preview_builds);
+    }
+    for (auto& build : preview_builds)
+        build.wait();
+    
     m_keep_running = false;
     if (m_render_thread.joinable())
         m_render_thread.join();
 }
 
+void RenderServer::TouchView(ViewHandle view)
+{
+    m_views_lru.remove(view);
+    m_views_lru.push_front(view);
+    EnforceBudget(view);
+}
+
+size_t RenderServer::GPUMemoryUsed() const
+{
+    size_t used = 0;
+    for (auto& handle_view : m_views)
+        used += handle_view.second.GPUMemory();
+    return used;
+}
+
+void RenderServer::EnforceBudget(ViewHandle keep)
+{
+    if (m_gpu_budget == 0)
+        return;
+    
+    // Evict from the least recently used end, up to the view in use.
+    size_t used = GPUMemoryUsed();
+    for (auto victim = m_views_lru.rbegin(); used > m_gpu_budget && *victim != keep; ++victim) {
+        TiledView& victim_view = m_views.at(*victim);
+        used -= victim_view.GPUMemory();
+        victim_view.Evict();
+    }
+}
+
+void RenderServer::DropView(ViewHandle view)
+{
+    auto found = m_views.find(view);
+    std::vector<RenderAction*> actions = found->second.GetRenderActions();
+    m_views.erase(found);
+    m_views_lru.remove(view);
+    
+    for (auto action : actions) {
+        if (--m_action_users.at(action) == 0) {
+            action->ReleaseGL();
+            m_action_users.erase(action);
+        }
+    }
+}
+
+bool RenderServer::PrebuildTile()
+{
+    bool pending = std::any_of(m_views.begin(), m_views.end(), 
+        [](const std::pair<const ViewHandle, TiledView>& handle_view) { return !handle_view.second.Built(); });
+    if (!pending)
+        return false;
+    
+    if (m_gpu_budget != 0 && GPUMemoryUsed() >= m_gpu_budget)
+        return false;
+    
+    // Evicted views decline, and are built again only when used.
+    for (auto handle : m_views_lru) {
+        if (m_views.at(handle).BuildNextTile()) {
+            EnforceBudget(handle);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RenderServer::BuildNextView(std::queue<ViewRequest>& requests)
+{
+    // Built outside the lock, which the user's thread takes to ask for 
+    // slices of other views meanwhile.
+    ViewRequest req;
+    {
+        std::lock_guard<std::mutex> lck {m_view_reqs_lock};
+        if (requests.empty())
+            return false;
+        
+        req = std::move(requests.front());
+        requests.pop();
+        
+        m_pending_views.erase(req.handle);
+        if (m_cancelled_views.erase(req.handle)) {
+            req.ready->set_exception(std::make_exception_ptr(
+                std::runtime_error("View unregistered before it was built.")));
+            return true;
+        }
+    }
+    
+    // Building the view initializes the action, which may fail,
+    // e.g. on a shader that doesn't compile.
+    try {
+        m_views.emplace(req.handle, 
+            TiledView(req.render_actions, req.full_width, req.full_height, m_tile_width, m_tile_height, req.instances)
+        );
+        for (auto action : req.render_actions)
+            ++m_action_users[action];
+        TouchView(req.handle);
+        
+        req.ready->set_value(req.handle);
+    }
+    catch (...) {
+        for (auto action : req.render_actions) {
+            if (m_action_users.count(action) == 0)
+                action->ReleaseGL(); // whatever got initialized.
+        }
+        {
+            std::lock_guard<std::mutex> lck {m_view_reqs_lock};
+            m_view_outputs.erase(req.handle);
+            m_previews.erase(req.handle);
+        }
+        req.ready->set_exception(std::current_exception());
+    }
+    
+    return true;
+}
+
+bool RenderServer::RenderNextSlice(std::queue<SliceRequest>& requests)
+{
+    // Rendering is outside the lock, since writing to a sink may wait for 
+    // the sink's consumer.
+    SliceRequest req;
+    {
+        std::lock_guard<std::mutex> lck {m_slice_reqs_lock};
+        if (requests.empty())
+            return false;
+        
+        req = std::move(requests.front());
+        requests.pop();
+    }
+    
+    auto view = m_views.find(req.view);
+    if (view == m_views.end()) {
+        auto removed = std::make_exception_ptr(std::runtime_error("Slice requested from a removed view."));
+        for (size_t output = 0; req.on_output && output < req.num_outputs; ++output)
+            req.on_output(output, nullptr, removed);
+        if (req.written)
+            req.written->set_exception(removed);
+        return true;
+    }
+    
+    // Rendering builds the tiles it needs, so the budget is enforced again
+    // after it, on what they took.
+    TouchView(req.view);
+    if (!req.sink) {
+        // A failed slice fails its outputs, not the render thread. Render 
+        // throws before handing any output over.
+        try {
+            view->second.Render(req.slice_num, req.on_output, nullptr, req.on_region, req.whole_bands);
+        }
+        catch (...) {
+            auto error = std::current_exception();
+            for (size_t output = 0; req.on_output && output < req.num_outputs; ++output)
+                req.on_output(output, nullptr, error);
+        }
+        TouchView(req.view);
+        return true;
+    }
+    
+    try {
+        if (req.sink->OutputSizes() != view->second.OutputSizes())
+            throw std::runtime_error("Slice sink doesn't fit the view's outputs.");
+        
+        view->second.Render(req.slice_num, nullptr, req.sink);
+        req.written->set_value();
+    }
+    catch (...) {
+        req.written->set_exception(std::current_exception());
+    }
+    TouchView(req.view);
+    return true;
+}
+
 void RenderServer::RenderThreadFunction() {
     CreateWindow();
     
     while (m_keep_running) {
-        // Check for requests for new views.
+        // Previews come first, being small and wanted soon.
+        if (BuildNextView(m_preview_requests))
+            continue;
+        
+        // Apply scene edits to existing views. Edits of a view still to be
+        // built wait for it, below.
         {
-            std::lock_guard<std::mutex> lck {m_view_reqs_lock};
+            std::lock_guard<std::mutex> lck {m_edit_reqs_lock};
+            
+            bool waiting = false;
+            if (!m_edit_requests.empty()) {
+                std::lock_guard<std::mutex> view_lck {m_view_reqs_lock};
+                waiting = m_pending_views.count(m_edit_requests.front().view) > 0;
+            }
             
-            if (!m_view_requests.empty()) {
-                auto& req = m_view_requests.front();
+            if (!m_edit_requests.empty() && !waiting) {
+                auto& req = m_edit_requests.front();
+                auto view = m_views.find(req.view);
                 
-                // Create new handle. Revisit this when views become removable.
-                ViewHandle handle = static_cast<ViewHandle>(m_views.size());
-
-                m_views.emplace(handle, 
-                    TiledView(req.render_action, req.full_width, req.full_height, m_tile_width, m_tile_height, req.geometry)
-                );
+                bool found = (view != m_views.end());
+                if (found) {
+                    switch (req.kind) {
+                    case EditRequest::Kind::Add:
+                        view->second.AddInstance(req.instance);
+                        break;
+                    case EditRequest::Kind::Remove:
+                        found = view->second.RemoveInstance(req.instance.id);
+                        break;
+                    case EditRequest::Kind::Move:
+                        found = view->second.MoveInstance(req.instance.id, req.instance.transform);
+                        break;
+                    case EditRequest::Kind::Drop:
+                        DropView(req.view);
+                        break;
+                    case EditRequest::Kind::Order:
+                        view->second.SetTileOrder(req.order);
+                        break;
+                    case EditRequest::Kind::Quantize:
+                        view->second.SetVertexQuantization(req.max_error);
+                        break;
+                    }
+                    
+                    if (req.kind != EditRequest::Kind::Drop)
+                        TouchView(req.view);
+                }
                 
-                req.ready->set_value(handle);
-                m_view_requests.pop();
+                if (found)
+                    req.done->set_value();
+                else
+                    req.done->set_exception(std::make_exception_ptr(
+                        std::runtime_error("No such view, or no instance with the requested ID in view.")));
+                m_edit_requests.pop();
                 
                 continue;
             }
         }
         
-        // Handle requested slices.
-        {
-            std::lock_guard<std::mutex> lck {m_slice_reqs_lock};
-            
-            if (!m_slice_requests.empty()) {
-                auto& req = m_slice_requests.front();
-                m_views.at(req.view).Render(req.slice_num, req.promises);
-                m_slice_requests.pop();
-            }
-        }
+        // Preview slices don't wait for full views to be built. Other slices
+        // do, though no slice can be of a view not built yet.
+        if (RenderNextSlice(m_preview_slice_requests))
+            continue;
+        if (BuildNextView(m_view_requests))
+            continue;
+        if (RenderNextSlice(m_slice_requests))
+            continue;
+        
+        // Idle: build ahead the tiles that slices will need next.
+        PrebuildTile();
     } // requests loop.
+    
+    // GL objects must die here, while the context is alive.
+    while (!m_views.empty())
+        DropView(m_views.begin()->first);
 }
 
-std::vector<RenderServer::ModelHandle> RenderServer::RegisterModels(const std::vector<std::shared_ptr<Model>> models)
+std::vector<RenderServer::ModelHandle> RenderServer::RegisterModels(
+    const std::vector<std::shared_ptr<const Model>>& models,
+    const std::vector<glm::mat4>& transforms)
 {
+    if (!transforms.empty() && transforms.size() != models.size())
+        throw std::runtime_error("Expected one transform per registered model.");
+    
     std::vector<ModelHandle> ret;
-    for (auto model : models) {
+    for (size_t modelIx = 0; modelIx < models.size(); ++modelIx) {
+        const Model& model = *models[modelIx];
         ret.push_back(m_models.size());
-        m_models.push_back(std::make_shared<Model>(Model{*model})); // pointer to copy.
+        
+        if (transforms.empty()) {
+            m_models.push_back(models[modelIx]);
+            m_model_bounds.push_back(ComputeBounds(model.first));
+            continue;
+        }
+        
+        auto placed = std::make_shared<Model>();
+        placed->second = model.second;
+        m_model_bounds.push_back(TransformVertices(model.first, placed->first, transforms[modelIx]));
+        m_models.push_back(placed);
     }
     
     return ret;
 }
 
-std::future<RenderServer::ViewHandle> RenderServer::RegisterView(RenderAction& render_action,
+// Checks the render actions of a new view, and gives the bytes of its outputs.
+static std::vector<size_t> ViewOutputSizes(const std::vector<RenderAction*>& render_actions,
+    unsigned int full_width, unsigned int full_height, unsigned int tile_width, unsigned int tile_height)
+{
+    std::set<RenderAction*> distinct {render_actions.begin(), render_actions.end()};
+    if (render_actions.empty() || distinct.size() != render_actions.size() || distinct.count(nullptr))
+        throw std::runtime_error("A view needs render actions, each given once.");
+    
+    std::vector<size_t> output_sizes;
+    for (auto action : render_actions) {
+        std::vector<unsigned int> pixel_sizes = action->OutputPixelSizes(), scales = action->OutputScales();
+        for (size_t image = 0; image < pixel_sizes.size(); ++image) {
+            unsigned int scale = scales[image];
+            if (scale == 0 || tile_width % scale || tile_height % scale)
+                throw std::runtime_error("Output scales must divide the tile size.");
+            output_sizes.push_back((size_t)(full_width/scale)*(full_height/scale)*pixel_sizes[image]);
+        }
+        for (auto reduction_size : action->ReductionSizes())
+            output_sizes.push_back(reduction_size);
+    }
+    return output_sizes;
+}
+
+std::future<RenderServer::ViewHandle> RenderServer::RegisterView(const std::vector<RenderAction*>& render_actions,
     unsigned int full_width, unsigned int full_height, 
-    const std::vector<ModelHandle>& models)
+    const std::vector<Placement>& placements)
 {
-    std::vector<std::shared_ptr<const Model>> view_models;
+    std::vector<size_t> output_sizes = ViewOutputSizes(render_actions, full_width, full_height, m_tile_width, m_tile_height);
+    std::vector<ModelInstance> instances;
     
-    for (auto modelH : models) {
-        if (modelH >= m_models.size())
+    for (auto& placement : placements) {
+        if (placement.model >= m_models.size())
             throw std::runtime_error("Bad model handle requested for view.");
         
-        view_models.push_back(m_models[modelH]);
+        instances.push_back(ModelInstance{m_models[placement.model], placement.transform, placement.id});
     }
     
     std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+    ViewHandle handle = m_next_view++;
+    m_view_outputs[handle] = std::move(output_sizes);
+    m_pending_views.insert(handle);
     m_view_requests.push(ViewRequest{
-        render_action, full_width, full_height, std::move(view_models), std::make_shared<std::promise<ViewHandle>>(),
+        handle, render_actions, full_width, full_height, std::move(instances), std::make_shared<std::promise<ViewHandle>>(),
     });
     
     return m_view_requests.back().ready->get_future();
 }
 
+std::future<RenderServer::ViewHandle> RenderServer::RegisterView(RenderAction& render_action,
+    unsigned int full_width, unsigned int full_height, 
+    const std::vector<Placement>& placements)
+{
+    return RegisterView(std::vector<RenderAction*>{&render_action}, full_width, full_height, placements);
+}
+
+std::future<RenderServer::ViewHandle> RenderServer::RegisterView(RenderAction& render_action,
+    unsigned int full_width, unsigned int full_height, 
+    const std::vector<ModelHandle>& models)
+{
+    std::vector<Placement> placements;
+    for (auto modelH : models)
+        placements.push_back(Placement{modelH, glm::mat4(1.0f), (unsigned int)placements.size()});
+    
+    return RegisterView(render_action, full_width, full_height, placements);
+}
+
+std::pair<unsigned int, unsigned int> RenderServer::PreviewSize(
+    unsigned int full_width, unsigned int full_height, unsigned int scale) const
+{
+    unsigned int width_tiles = std::max(1u, (full_width + scale*m_tile_width - 1)/(scale*m_tile_width));
+    unsigned int height_tiles = std::max(1u, (full_height + scale*m_tile_height - 1)/(scale*m_tile_height));
+    return std::make_pair(width_tiles*m_tile_width, height_tiles*m_tile_height);
+}
+
+std::future<RenderServer::ViewHandle> RenderServer::RegisterPreview(const std::vector<RenderAction*>& render_actions,
+    unsigned int full_width, unsigned int full_height, 
+    const std::vector<Placement>& placements, unsigned int scale)
+{
+    if (scale == 0)
+        throw std::runtime_error("A preview can't be larger than its view.");
+    
+    auto size = PreviewSize(full_width, full_height, scale);
+    std::vector<size_t> output_sizes = ViewOutputSizes(render_actions, size.first, size.second, m_tile_width, m_tile_height);
+    
+    std::map<ModelHandle, std::shared_ptr<const Model>> models;
+    for (auto& placement : placements) {
+        if (placement.model >= m_models.size())
+            throw std::runtime_error("Bad model handle requested for view.");
+        models[placement.model] = m_models[placement.model];
+    }
+    
+    auto ready = std::make_shared<std::promise<ViewHandle>>();
+    std::future<ViewHandle> ret = ready->get_future();
+    
+    std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+    ViewHandle handle = m_next_view++;
+    m_view_outputs[handle] = std::move(output_sizes);
+    m_previews.insert(handle);
+    m_pending_views.insert(handle);
+    
+    m_preview_builds.remove_if([](const std::future<void>& build) {
+        return build.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
+    m_preview_builds.push_back(std::async(std::launch::async, 
+        [this, handle, render_actions, size, placements, scale, models, ready]() {
+            std::vector<ModelInstance> instances;
+            try {
+                // Each model is simplified once, however many times it's placed,
+                // and the placements shrink to the preview's pixels. Slices 
+                // stay as they are, so Z is clustered by the slice.
+                std::map<ModelHandle, std::shared_ptr<const Model>> simplified;
+                for (auto& model : models)
+                    simplified[model.first] = std::make_shared<Model>(ClusterVertices(*model.second, (float)scale, 1.f));
+                
+                glm::mat4 shrink = glm::scale(glm::mat4(1.0f), glm::vec3{1.f/scale, 1.f/scale, 1.f});
+                for (auto& placement : placements)
+                    instances.push_back(ModelInstance{simplified.at(placement.model), shrink*placement.transform, placement.id});
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+                m_view_outputs.erase(handle);
+                m_previews.erase(handle);
+                m_pending_views.erase(handle);
+                m_cancelled_views.erase(handle);
+                ready->set_exception(std::current_exception());
+                return;
+            }
+            
+            std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+            m_preview_requests.push(ViewRequest{
+                handle, render_actions, size.first, size.second, std::move(instances), ready
+            });
+        }));
+    
+    return ret;
+}
+
+std::future<void> RenderServer::RequestEdit(EditRequest req)
+{
+    req.done = std::make_shared<std::promise<void>>();
+    std::future<void> ret = req.done->get_future();
+    
+    std::lock_guard<std::mutex> lck{m_edit_reqs_lock};
+    m_edit_requests.push(std::move(req));
+    
+    return ret;
+}
+
+std::future<void> RenderServer::AddInstance(ViewHandle view, const Placement& placement)
+{
+    if (placement.model >= m_models.size())
+        throw std::runtime_error("Bad model handle requested for view.");
+    
+    return RequestEdit(EditRequest{view, EditRequest::Kind::Add, 
+        ModelInstance{m_models[placement.model], placement.transform, placement.id}, nullptr});
+}
+
+std::future<void> RenderServer::RemoveInstance(ViewHandle view, unsigned int id)
+{
+    return RequestEdit(EditRequest{view, EditRequest::Kind::Remove, 
+        ModelInstance{nullptr, glm::mat4(1.0f), id}, nullptr});
+}
+
+std::future<void> RenderServer::MoveInstance(ViewHandle view, unsigned int id, const glm::mat4& transform)
+{
+    return RequestEdit(EditRequest{view, EditRequest::Kind::Move, 
+        ModelInstance{nullptr, transform, id}, nullptr});
+}
+
+std::future<void> RenderServer::SetTileOrder(ViewHandle view, TileOrder order)
+{
+    EditRequest req {view, EditRequest::Kind::Order, ModelInstance{nullptr, glm::mat4(1.0f), 0}, nullptr};
+    req.order = order;
+    return RequestEdit(std::move(req));
+}
+
+std::future<void> RenderServer::SetVertexQuantization(ViewHandle view, float max_error)
+{
+    EditRequest req {view, EditRequest::Kind::Quantize, ModelInstance{nullptr, glm::mat4(1.0f), 0}, nullptr};
+    req.max_error = max_error;
+    return RequestEdit(std::move(req));
+}
+
+std::future<void> RenderServer::UnregisterView(ViewHandle view)
+{
+    {
+        std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+        m_view_outputs.erase(view);
+        m_previews.erase(view);
+        
+        // Not built yet: it won't be.
+        if (m_pending_views.count(view)) {
+            m_cancelled_views.insert(view);
+            std::promise<void> done;
+            done.set_value();
+            return done.get_future();
+        }
+    }
+    
+    return RequestEdit(EditRequest{view, EditRequest::Kind::Drop, 
+        ModelInstance{nullptr, glm::mat4(1.0f), 0}, nullptr});
+}
+
 std::vector<std::future<std::unique_ptr<char>>>
 RenderServer::ViewSlice(ViewHandle view, size_t slice_num)
 {
-    TiledView& tview = m_views.at(view);
+    size_t num_outputs;
+    {
+        std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+        num_outputs = m_view_outputs.at(view).size();
+    }
+    
+    std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>> promises;
+    std::vector<std::future<std::unique_ptr<char>>> images;
+    for (size_t output = 0; output < num_outputs; ++output) {
+        promises.push_back(std::make_shared<std::promise<std::unique_ptr<char>>>());
+        images.push_back(promises.back()->get_future());
+    }
+    
+    ViewSlice(view, slice_num, FulfillPromises(std::move(promises)));
+    return images;
+}
+
+void RenderServer::ViewSlice(ViewHandle view, size_t slice_num, OutputCallback on_output)
+{
+    ViewSlice(view, slice_num, std::move(on_output), nullptr);
+}
+
+void RenderServer::ViewSlice(ViewHandle view, size_t slice_num, OutputCallback on_output, 
+    RegionCallback on_region, bool whole_bands)
+{
     SliceRequest req;
     req.slice_num = slice_num;
     req.view = view;
+    req.on_output = std::move(on_output);
+    req.on_region = std::move(on_region);
+    req.whole_bands = whole_bands;
+    bool preview;
+    {
+        std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+        req.num_outputs = m_view_outputs.at(view).size();
+        preview = m_previews.count(view) > 0;
+    }
     
-    for (size_t output = 0; output < tview.NumOutputs(); ++output)
-        req.promises.push_back(std::make_shared<std::promise<std::unique_ptr<char>>>());
-    
-    std::vector<std::future<std::unique_ptr<char>>> images;
-    for (auto& promise : req.promises)
-        images.push_back(promise->get_future());
+    std::lock_guard<std::mutex> lck{m_slice_reqs_lock};
+    (preview ? m_preview_slice_requests : m_slice_requests).push(std::move(req));
+}
+
+std::future<void> RenderServer::ViewSliceTo(ViewHandle view, size_t slice_num, SliceSink& sink)
+{
+    SliceRequest req;
+    req.slice_num = slice_num;
+    req.view = view;
+    req.sink = &sink;
+    req.written = std::make_shared<std::promise<void>>();
+    std::future<void> ret = req.written->get_future();
+    bool preview;
+    {
+        std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+        preview = m_previews.count(view) > 0;
+    }
     
     std::lock_guard<std::mutex> lck{m_slice_reqs_lock};
-    m_slice_requests.push(std::move(req));
+    (preview ? m_preview_slice_requests : m_slice_requests).push(std::move(req));
     
-    return images;
+    return ret;
+}
+
+std::vector<size_t> RenderServer::OutputSizes(ViewHandle view)
+{
+    std::lock_guard<std::mutex> lck{m_view_reqs_lock};
+    return m_view_outputs.at(view);
 }
@@ -0,0 +1,77 @@
+#include "render_targets.h"
+
+#include <stdexcept>
+
+using namespace Ashigaru;
+
+void RenderTargets::InitGL()
+{
+    if (m_fbo != 0)
+        return;
+    
+    GLint max_draw_buffers;
+    glGetIntegerv(GL_MAX_DRAW_BUFFERS, &max_draw_buffers);
+    if (m_attachments.size() > (size_t)max_draw_buffers)
+        throw std::runtime_error("More render targets than the GL can draw at once.");
+    
+    m_fbo = GLObject(GLObject::Kind::Framebuffer);
+    GLState::BindFramebuffer(m_fbo);
+    
+    std::vector<GLenum> draw_buffers;
+    for (auto& attachment : m_attachments) {
+        GLObject texture(GLObject::Kind::Texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, attachment.internal_format, m_width, m_height, 0,
+            attachment.format, attachment.type, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        
+        GLenum attachment_point = GL_COLOR_ATTACHMENT0 + (GLenum)draw_buffers.size();
+        glFramebufferTexture(GL_FRAMEBUFFER, attachment_point, texture, 0);
+        draw_buffers.push_back(attachment_point);
+        m_textures.push_back(std::move(texture));
+    }
+    glDrawBuffers((GLsizei)draw_buffers.size(), draw_buffers.data());
+    
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GLState::BindFramebuffer(0);
+}
+
+void RenderTargets::ReleaseGL()
+{
+    m_fbo.Reset();
+    m_textures.clear();
+}
+
+size_t RenderTargets::Index(const std::string& name) const
+{
+    for (size_t index = 0; index < m_attachments.size(); ++index) {
+        if (m_attachments[index].name == name)
+            return index;
+    }
+    throw std::runtime_error("No render target named " + name);
+}
+
+void RenderTargets::Bind() const
+{
+    GLState::BindFramebuffer(m_fbo);
+    GLState::Viewport(0, 0, m_width, m_height);
+}
+
+std::pair<GLsync, GLuint> RenderTargets::ReadAsync(const std::string& name) const
+{
+    size_t index = Index(name);
+    const Attachment& attachment = m_attachments[index];
+    
+    GLuint pbo;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)m_width*m_height*attachment.pixel_size, NULL, GL_STREAM_READ);
+    
+    GLState::BindFramebuffer(m_fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + (GLenum)index);
+    glReadPixels(0, 0, m_width, m_height, attachment.format, attachment.type, 0);
+    
+    GLsync read_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    return std::make_pair(read_fence, pbo);
+}
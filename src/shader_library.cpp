@@ -0,0 +1,259 @@
+#include "shader_library.h"
+#include "util.h"
+
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace Ashigaru;
+
+struct EmbeddedShader {
+    const char* name;
+    const char* source;
+};
+
+// Generated at build time from shaders/, see cmake/embed_shaders.cmake.
+static const EmbeddedShader embedded_shaders[] = {
+#ifdef ASHIGARU_EMBEDDED_SHADERS
+#include "embedded_shaders.inc"
+#endif
+    {nullptr, nullptr}
+};
+
+std::string Ashigaru::ShaderSource(const std::string& name)
+{
+    for (const EmbeddedShader* shader = embedded_shaders; shader->name != nullptr; ++shader) {
+        if (name == shader->name)
+            return shader->source;
+    }
+    
+    const char* dir = std::getenv("ASHIGARU_SHADER_DIR");
+    std::string path = std::string(dir ? dir : "shaders") + "/" + name;
+    std::ifstream file(path, std::ios::in);
+    if (!file.is_open())
+        throw std::runtime_error("Shader " + name + " is not embedded, and " + path + " can't be read.");
+    
+    std::stringstream sstr;
+    sstr << file.rdbuf();
+    return sstr.str();
+}
+
+static std::string DefaultCacheDirectory()
+{
+    const char* env = std::getenv("ASHIGARU_SHADER_CACHE");
+    if (env)
+        return env;
+    
+#ifdef _WIN32
+    const char* local = std::getenv("LOCALAPPDATA");
+    if (local)
+        return std::string(local) + "/ashigaru";
+#else
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return std::string(xdg) + "/ashigaru";
+    const char* home = std::getenv("HOME");
+    if (home)
+        return std::string(home) + "/.cache/ashigaru";
+#endif
+    return std::string();
+}
+
+static std::mutex cache_dir_lock;
+static std::string cache_dir = DefaultCacheDirectory();
+
+void Ashigaru::SetShaderCacheDirectory(const std::string& dir)
+{
+    std::lock_guard<std::mutex> lck{cache_dir_lock};
+    cache_dir = dir;
+}
+
+static std::string ShaderCacheDirectory()
+{
+    std::lock_guard<std::mutex> lck{cache_dir_lock};
+    return cache_dir;
+}
+
+/* The cache key: the driver, which decides the binary format, and everything
+* that went into the program. FNV-1a, as std::hash need not be stable from 
+* one build to the next.
+*/
+static std::string ProgramKey(const std::vector<ShaderStage>& stages, const std::vector<std::string>& sources)
+{
+    std::string text;
+    for (GLenum what : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) {
+        const GLubyte* str = glGetString(what);
+        text += str ? (const char*)str : "";
+        text += '\n';
+    }
+    for (size_t stage = 0; stage < stages.size(); ++stage)
+        text += std::to_string(stages[stage].type) + "\n" + stages[stage].name + "\n" + sources[stage];
+    
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return hex;
+}
+
+static bool LoadProgramBinary(GLuint program, const std::string& path)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+        return false;
+    
+    GLenum format;
+    if (!file.read((char*)&format, sizeof(format)))
+        return false;
+    std::vector<char> binary {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    
+    // A stale or corrupt binary simply fails to link.
+    glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+}
+
+static void SaveProgramBinary(GLuint program, const std::string& dir, const std::string& path)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length == 0)
+        return;
+    
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, NULL, &format, binary.data());
+    
+    // Write aside and rename, so that other processes sharing the cache 
+    // never see a partial file.
+    makeDirectories(dir);
+    std::string temp_path = tempPath(path);
+    {
+        std::ofstream file(temp_path, std::ios::out | std::ios::binary);
+        file.write((const char*)&format, sizeof(format));
+        file.write(binary.data(), binary.size());
+        if (!file) {
+            file.close();
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+        std::remove(temp_path.c_str());
+}
+
+static std::string InfoLog(GLuint object, PFNGLGETSHADERIVPROC get_iv, PFNGLGETSHADERINFOLOGPROC get_log)
+{
+    GLint length = 0;
+    get_iv(object, GL_INFO_LOG_LENGTH, &length);
+    if (length == 0)
+        return std::string();
+    
+    std::vector<char> log(length + 1);
+    get_log(object, length, NULL, log.data());
+    return log.data();
+}
+
+static GLuint CompileShader(const ShaderStage& stage, const std::string& source)
+{
+    GLuint shader = glCreateShader(stage.type);
+    const char* source_ptr = source.c_str();
+    glShaderSource(shader, 1, &source_ptr, NULL);
+    glCompileShader(shader);
+    
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (compiled != GL_TRUE) {
+        std::string log = InfoLog(shader, glGetShaderiv, glGetShaderInfoLog);
+        glDeleteShader(shader);
+        throw std::runtime_error("Compiling " + stage.name + " failed:\n" + log);
+    }
+    return shader;
+}
+
+static GLObject BuildProgram(const std::vector<ShaderStage>& stages, const std::vector<std::string>& sources)
+{
+    GLObject program {GLObject::Kind::Program};
+    
+    std::string dir, cache_file;
+    GLint num_formats = 0;
+    if (GLEW_ARB_get_program_binary) {
+        dir = ShaderCacheDirectory();
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    }
+    if (!dir.empty() && num_formats > 0) {
+        cache_file = dir + "/" + ProgramKey(stages, sources) + ".bin";
+        if (LoadProgramBinary(program, cache_file))
+            return program;
+    }
+    
+    std::vector<GLuint> shaders;
+    try {
+        for (size_t stage = 0; stage < stages.size(); ++stage)
+            shaders.push_back(CompileShader(stages[stage], sources[stage]));
+    }
+    catch (...) {
+        for (auto shader : shaders)
+            glDeleteShader(shader);
+        throw;
+    }
+    
+    for (auto shader : shaders)
+        glAttachShader(program, shader);
+    if (!cache_file.empty())
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    
+    for (auto shader : shaders) {
+        glDetachShader(program, shader);
+        glDeleteShader(shader);
+    }
+    
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked != GL_TRUE) {
+        std::string names;
+        for (auto& stage : stages)
+            names += " " + stage.name;
+        throw std::runtime_error("Linking" + names + " failed:\n" + 
+            InfoLog(program, glGetProgramiv, glGetProgramInfoLog));
+    }
+    
+    if (!cache_file.empty())
+        SaveProgramBinary(program, dir, cache_file);
+    return program;
+}
+
+std::shared_ptr<GLObject> Ashigaru::SharedProgram(const std::vector<ShaderStage>& stages)
+{
+    // Programs belong to the context, hence one table per render thread. 
+    // Holding weak references, it keeps nothing alive by itself.
+    static thread_local std::map<std::string, std::weak_ptr<GLObject>> programs;
+    
+    std::string key;
+    for (auto& stage : stages)
+        key += std::to_string(stage.type) + ":" + stage.name + ";";
+    
+    std::shared_ptr<GLObject> program = programs[key].lock();
+    if (program)
+        return program;
+    
+    std::vector<std::string> sources;
+    for (auto& stage : stages)
+        sources.push_back(ShaderSource(stage.name));
+    
+    program = std::make_shared<GLObject>(BuildProgram(stages, sources));
+    programs[key] = program;
+    return program;
+}
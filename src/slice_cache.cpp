@@ -0,0 +1,122 @@
+#include "slice_cache.h"
+#include "util.h"
+
+#include <mutex>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace Ashigaru;
+
+static const char file_magic[8] = {'A', 'S', 'H', 'S', 'L', 'I', 'C', 'E'};
+
+static std::string DefaultCacheDirectory()
+{
+    const char* env = std::getenv("ASHIGARU_SLICE_CACHE");
+    return env ? env : std::string();
+}
+
+static std::mutex cache_dir_lock;
+static std::string cache_dir = DefaultCacheDirectory();
+
+void Ashigaru::SetSliceCacheDirectory(const std::string& dir)
+{
+    std::lock_guard<std::mutex> lck{cache_dir_lock};
+    cache_dir = dir;
+}
+
+static std::string SliceCacheDirectory()
+{
+    std::lock_guard<std::mutex> lck{cache_dir_lock};
+    return cache_dir;
+}
+
+bool Ashigaru::SliceCacheEnabled()
+{
+    return !SliceCacheDirectory().empty();
+}
+
+uint64_t Ashigaru::HashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t byte = 0; byte < size; ++byte) {
+        hash ^= bytes[byte];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string SlicePath(const std::string& dir, uint64_t key)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.slice", (unsigned long long)key);
+    return dir + "/" + name;
+}
+
+/* The file: the magic, the number of outputs and the size of each, all
+ * 64-bit, then the outputs one after the other.
+ */
+bool Ashigaru::LoadCachedSlice(uint64_t key, const std::vector<char*>& outputs, const std::vector<size_t>& sizes)
+{
+    std::string dir = SliceCacheDirectory();
+    if (dir.empty())
+        return false;
+    
+    std::ifstream file(SlicePath(dir, key), std::ios::in | std::ios::binary);
+    if (!file.is_open())
+        return false;
+    
+    char magic[sizeof(file_magic)];
+    uint64_t num_outputs;
+    if (!file.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), file_magic))
+        return false;
+    if (!file.read((char*)&num_outputs, sizeof(num_outputs)) || num_outputs != sizes.size())
+        return false;
+    
+    for (auto size : sizes) {
+        uint64_t stored_size;
+        if (!file.read((char*)&stored_size, sizeof(stored_size)) || stored_size != size)
+            return false;
+    }
+    for (size_t output = 0; output < outputs.size(); ++output) {
+        if (!file.read(outputs[output], sizes[output]))
+            return false;
+    }
+    
+    // Nothing may follow, or this isn't the file that was written.
+    return file.peek() == std::ifstream::traits_type::eof();
+}
+
+void Ashigaru::StoreCachedSlice(uint64_t key, const std::vector<char*>& outputs, const std::vector<size_t>& sizes)
+{
+    std::string dir = SliceCacheDirectory();
+    if (dir.empty())
+        return;
+    
+    // Write aside and rename, as with program binaries, so that readers
+    // never see a partial file.
+    makeDirectories(dir);
+    std::string path = SlicePath(dir, key);
+    std::string temp_path = tempPath(path);
+    {
+        std::ofstream file(temp_path, std::ios::out | std::ios::binary);
+        uint64_t num_outputs = sizes.size();
+        file.write(file_magic, sizeof(file_magic));
+        file.write((const char*)&num_outputs, sizeof(num_outputs));
+        for (auto size : sizes) {
+            uint64_t stored_size = size;
+            file.write((const char*)&stored_size, sizeof(stored_size));
+        }
+        for (size_t output = 0; output < outputs.size(); ++output)
+            file.write(outputs[output], sizes[output]);
+        
+        if (!file) {
+            file.close();
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+        std::remove(temp_path.c_str());
+}
@@ -0,0 +1,227 @@
+#include "slice_delta.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace Ashigaru;
+
+static const char file_magic[8] = {'A', 'S', 'H', 'S', 'T', 'A', 'C', 'K'};
+
+enum TokenKind { skip_token = 0, run_token = 1, literal_token = 2 };
+
+// Shorter runs are cheaper left in a literal than given a token.
+static const size_t min_run = 4;
+
+static void PutVarint(std::vector<char>& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back((char)((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static uint64_t GetVarint(const char* frame, size_t size, size_t& pos)
+{
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (pos >= size)
+            break;
+        unsigned char byte = (unsigned char)frame[pos++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    throw std::runtime_error("Malformed slice frame: bad varint.");
+}
+
+// How many bytes from `pos` on equal the one at `pos`.
+static size_t RunLength(const std::vector<char>& bytes, size_t pos)
+{
+    size_t end = pos + 1;
+    while (end < bytes.size() && bytes[end] == bytes[pos])
+        ++end;
+    return end - pos;
+}
+
+SliceDeltaEncoder::SliceDeltaEncoder(size_t keyframe_interval)
+    : m_keyframe_interval{std::max<size_t>(1, keyframe_interval)}, m_since_keyframe{0}
+{}
+
+std::vector<char> SliceDeltaEncoder::Encode(const char* slice, size_t size)
+{
+    bool keyframe = m_since_keyframe == 0 || m_since_keyframe >= m_keyframe_interval || m_previous.size() != size;
+    if (keyframe) {
+        m_previous.assign(size, 0);
+        m_since_keyframe = 0;
+    }
+    ++m_since_keyframe;
+    
+    // What changed. A keyframe changes everything from a blank slice.
+    std::vector<char> diff(size);
+    for (size_t byte = 0; byte < size; ++byte)
+        diff[byte] = slice[byte] ^ m_previous[byte];
+    
+    std::vector<char> frame;
+    frame.push_back(keyframe ? 'K' : 'D');
+    PutVarint(frame, size);
+    
+    size_t pos = 0;
+    while (pos < size) {
+        size_t run = RunLength(diff, pos);
+        if (run >= min_run) {
+            bool unchanged = (diff[pos] == 0);
+            PutVarint(frame, (uint64_t)run << 2 | (unchanged ? skip_token : run_token));
+            if (!unchanged)
+                frame.push_back(diff[pos]);
+            pos += run;
+            continue;
+        }
+        
+        // A literal goes on up to the next run worth a token.
+        size_t end = pos + run;
+        while (end < size) {
+            size_t next_run = RunLength(diff, end);
+            if (next_run >= min_run)
+                break;
+            end += next_run;
+        }
+        PutVarint(frame, (uint64_t)(end - pos) << 2 | literal_token);
+        frame.insert(frame.end(), diff.begin() + pos, diff.begin() + end);
+        pos = end;
+    }
+    
+    m_previous.assign(slice, slice + size);
+    return frame;
+}
+
+const std::vector<char>& SliceDeltaDecoder::Decode(const char* frame, size_t size)
+{
+    if (size == 0 || (frame[0] != 'K' && frame[0] != 'D'))
+        throw std::runtime_error("Malformed slice frame: unknown kind.");
+    
+    size_t pos = 1;
+    uint64_t slice_size = GetVarint(frame, size, pos);
+    if (frame[0] == 'K') {
+        m_current.assign(slice_size, 0);
+        m_have_keyframe = true;
+    }
+    else if (!m_have_keyframe || m_current.size() != slice_size) {
+        throw std::runtime_error("Slice delta without its keyframe.");
+    }
+    
+    size_t out = 0;
+    while (out < slice_size) {
+        uint64_t token = GetVarint(frame, size, pos);
+        uint64_t count = token >> 2;
+        if (count > slice_size - out)
+            throw std::runtime_error("Malformed slice frame: token past the slice.");
+        
+        switch (token & 3) {
+        case skip_token:
+            break;
+        case run_token: {
+            if (pos >= size)
+                throw std::runtime_error("Malformed slice frame: truncated.");
+            char value = frame[pos++];
+            for (uint64_t byte = 0; byte < count; ++byte)
+                m_current[out + byte] ^= value;
+            break;
+        }
+        case literal_token:
+            if (count > size - pos)
+                throw std::runtime_error("Malformed slice frame: truncated.");
+            for (uint64_t byte = 0; byte < count; ++byte)
+                m_current[out + byte] ^= frame[pos + byte];
+            pos += count;
+            break;
+        default:
+            throw std::runtime_error("Malformed slice frame: unknown token.");
+        }
+        out += count;
+    }
+    
+    return m_current;
+}
+
+SliceStackWriter::SliceStackWriter(const std::string& path, size_t slice_size, size_t keyframe_interval)
+    : m_file(path, std::ios::out | std::ios::binary), m_path{path}, m_slice_size{slice_size},
+      m_encoder{keyframe_interval}
+{
+    if (!m_file.is_open())
+        throw std::runtime_error("Can't create slice stack " + path);
+    
+    uint64_t stored_size = slice_size;
+    m_file.write(file_magic, sizeof(file_magic));
+    m_file.write((const char*)&stored_size, sizeof(stored_size));
+}
+
+void SliceStackWriter::Write(const char* slice)
+{
+    std::vector<char> frame = m_encoder.Encode(slice, m_slice_size);
+    uint64_t length = frame.size();
+    m_file.write((const char*)&length, sizeof(length));
+    m_file.write(frame.data(), frame.size());
+    if (!m_file)
+        throw std::runtime_error("Can't write slice stack " + m_path);
+}
+
+SliceStackReader::SliceStackReader(const std::string& path)
+    : m_file(path, std::ios::in | std::ios::binary), m_path{path}, m_slice_size{0}, m_decoded{0}
+{
+    char magic[sizeof(file_magic)];
+    uint64_t stored_size;
+    if (!m_file.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), file_magic) ||
+        !m_file.read((char*)&stored_size, sizeof(stored_size)))
+    {
+        throw std::runtime_error("Not a slice stack: " + path);
+    }
+    m_slice_size = (size_t)stored_size;
+    
+    // Only the lengths and kinds are read here; frames are read on demand.
+    uint64_t length;
+    while (m_file.read((char*)&length, sizeof(length))) {
+        uint64_t offset = (uint64_t)m_file.tellg();
+        char kind;
+        if (length == 0 || !m_file.read(&kind, 1))
+            throw std::runtime_error("Truncated slice stack: " + path);
+        
+        if (kind == 'K')
+            m_keyframes.push_back(m_offsets.size());
+        m_offsets.push_back(offset);
+        m_lengths.push_back(length);
+        m_file.seekg((std::streamoff)(offset + length));
+    }
+    m_file.clear();
+    m_decoded = NumSlices();
+}
+
+const std::vector<char>& SliceStackReader::ReadSlice(size_t slice_num)
+{
+    if (slice_num >= NumSlices())
+        throw std::runtime_error("Slice " + std::to_string(slice_num) + " is past the end of " + m_path);
+    
+    auto keyframe = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), slice_num);
+    if (keyframe == m_keyframes.begin())
+        throw std::runtime_error("No keyframe before slice " + std::to_string(slice_num) + " in " + m_path);
+    size_t start = *(keyframe - 1);
+    
+    // Carry on from the slice decoded last, if it's on the way.
+    if (m_decoded < NumSlices() && m_decoded >= start && m_decoded <= slice_num)
+        start = m_decoded + 1;
+    
+    // A decode that throws may leave the decoder half-updated, so nothing 
+    // counts as decoded until it succeeds.
+    for (size_t frame_ix = start; frame_ix <= slice_num; ++frame_ix) {
+        m_decoded = NumSlices();
+        m_frame.resize(m_lengths[frame_ix]);
+        m_file.clear();
+        m_file.seekg((std::streamoff)m_offsets[frame_ix]);
+        if (!m_file.read(m_frame.data(), m_frame.size()))
+            throw std::runtime_error("Truncated slice stack: " + m_path);
+        m_decoder.Decode(m_frame.data(), m_frame.size());
+        m_decoded = frame_ix;
+    }
+    
+    return m_decoder.Current();
+}
@@ -0,0 +1,139 @@
+#include "slice_file.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using namespace Ashigaru;
+
+static const uint32_t file_magic = 0x46485341; // "ASHF"
+
+static uint64_t AlignUp(uint64_t size, uint64_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// Mappings start on page boundaries, whatever the page size here.
+static uint64_t PageSize()
+{
+    return std::max<uint64_t>(4096, (uint64_t)sysconf(_SC_PAGESIZE));
+}
+
+SliceFile::SliceFile(int fd, const std::string& path, const FileHeader& header)
+    : m_fd{fd}, m_path{path}, m_header(header), m_mapping{nullptr}, m_mapped_slice{0},
+      m_have_published{false}, m_published_slice{0}
+{}
+
+SliceFile::~SliceFile()
+{
+    Unmap();
+    close(m_fd);
+}
+
+std::unique_ptr<SliceFile> SliceFile::Create(const std::string& path,
+    uint64_t first_slice, uint64_t num_slices, const std::vector<size_t>& output_sizes)
+{
+    if (num_slices == 0 || output_sizes.empty() || output_sizes.size() > max_outputs)
+        throw std::runtime_error("A slice file needs slices, and 1 to 32 outputs per slice.");
+    
+    uint64_t page = PageSize();
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = file_magic;
+    header.num_outputs = (uint32_t)output_sizes.size();
+    header.first_slice = first_slice;
+    header.num_slices = num_slices;
+    header.header_size = AlignUp(sizeof(FileHeader), page);
+    
+    uint64_t region_size = 0;
+    for (size_t output = 0; output < output_sizes.size(); ++output) {
+        header.output_offsets[output] = region_size;
+        header.output_sizes[output] = output_sizes[output];
+        region_size += AlignUp(output_sizes[output], page);
+    }
+    header.slice_stride = region_size;
+    uint64_t total = header.header_size + num_slices*header.slice_stride;
+    
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Can't create slice file " + path + ": " + std::strerror(errno));
+    
+    // Sized, but not allocated: holes read as zeros and take no disk.
+    if (ftruncate(fd, (off_t)total) != 0 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        std::string error = std::strerror(errno);
+        close(fd);
+        unlink(path.c_str());
+        throw std::runtime_error("Can't size slice file " + path + ": " + error);
+    }
+    
+    return std::unique_ptr<SliceFile>(new SliceFile(fd, path, header));
+}
+
+std::vector<size_t> SliceFile::OutputSizes() const
+{
+    return std::vector<size_t>(m_header.output_sizes, m_header.output_sizes + m_header.num_outputs);
+}
+
+uint64_t SliceFile::RegionOffset(uint64_t slice_num) const
+{
+    return m_header.header_size + (slice_num - m_header.first_slice)*m_header.slice_stride;
+}
+
+void SliceFile::Unmap()
+{
+    if (!m_mapping)
+        return;
+    munmap(m_mapping, m_header.slice_stride);
+    m_mapping = nullptr;
+}
+
+std::vector<char*> SliceFile::AcquireOutputs(size_t slice_num)
+{
+    if (slice_num < m_header.first_slice || slice_num - m_header.first_slice >= m_header.num_slices)
+        throw std::runtime_error("Slice " + std::to_string(slice_num) + " is outside slice file " + m_path);
+    
+    // A slice acquired but never published, after a failed render.
+    Unmap();
+    
+    void* mem = mmap(nullptr, m_header.slice_stride, PROT_READ | PROT_WRITE, MAP_SHARED,
+        m_fd, (off_t)RegionOffset(slice_num));
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("Can't map slice file " + m_path + ": " + std::strerror(errno));
+    m_mapping = (char*)mem;
+    m_mapped_slice = slice_num;
+    
+    // Tiles land all over the region, so reading ahead of a fault only
+    // brings in pages that are about to be overwritten.
+    madvise(m_mapping, m_header.slice_stride, MADV_RANDOM);
+    
+    std::vector<char*> outputs;
+    for (uint32_t output = 0; output < m_header.num_outputs; ++output)
+        outputs.push_back(m_mapping + m_header.output_offsets[output]);
+    return outputs;
+}
+
+void SliceFile::PublishOutputs()
+{
+    if (!m_mapping)
+        return;
+    
+    // Start writing this slice out, and let go of the last one, whose
+    // writeback had a slice's time to finish. Dirty pages stay regardless.
+    msync(m_mapping, m_header.slice_stride, MS_ASYNC);
+    Unmap();
+
+#ifdef POSIX_FADV_DONTNEED
+    if (m_have_published) {
+        posix_fadvise(m_fd, (off_t)RegionOffset(m_published_slice),
+            (off_t)m_header.slice_stride, POSIX_FADV_DONTNEED);
+    }
+#endif
+    m_have_published = true;
+    m_published_slice = m_mapped_slice;
+}
@@ -0,0 +1,273 @@
+#include "slice_ring.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using namespace Ashigaru;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Shared memory counters must be lock free.");
+
+static const uint32_t ring_magic = 0x41534852; // "ASHR"
+static const size_t line_size = 64;
+static const size_t page_size = 4096;
+
+// How often a producer waiting for a frame checks that the consumer lives.
+static const int consumer_check_ms = 250;
+
+static size_t AlignUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+/* The start of the segment. Frames follow, from the next page. The counters
+ * only grow (and wrap); frame i lives in slot i % num_frames.
+ */
+struct SliceRing::Header {
+    std::atomic<uint32_t> magic; // set last by the producer, once the rest is.
+    uint32_t num_frames;
+    uint32_t num_outputs;
+    uint64_t frame_stride;
+    uint64_t output_offsets[max_outputs]; // within a frame.
+    uint64_t output_sizes[max_outputs];
+    
+    // Each on its own line, since each side writes one and reads the other.
+    alignas(line_size) std::atomic<uint32_t> published;
+    alignas(line_size) std::atomic<uint32_t> released;
+    
+    // Also the consumer's: set when it closes its end, and its process ID
+    // while open, 0 before any consumer opened the ring.
+    std::atomic<uint32_t> closed;
+    std::atomic<int32_t> consumer_pid;
+};
+
+// Frames start with their slice number, the outputs after.
+struct FrameInfo {
+    uint64_t slice_num;
+};
+
+/* WaitChange() blocks while a shared counter still holds a value, until
+ * another process changes it and calls WakeAll().
+ * 
+ * Returns:
+ * false if timeout_ms passed first (negative waits forever).
+ */
+static bool WaitChange(std::atomic<uint32_t>& word, uint32_t value, int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    
+    while (word.load(std::memory_order_acquire) == value) {
+        auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+        if (timeout_ms >= 0 && left.count() <= 0)
+            return false;
+#ifdef __linux__
+        // The counter is the futex word. Not FUTEX_PRIVATE: the waker is 
+        // another process.
+        timespec limit {(time_t)(left.count() / 1000000000), (long)(left.count() % 1000000000)};
+        syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAIT, value, timeout_ms >= 0 ? &limit : nullptr, nullptr, 0);
+#else
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+#endif
+    }
+    return true;
+}
+
+static void WakeAll(std::atomic<uint32_t>& word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+SliceRing::SliceRing(const std::string& name, bool owner) 
+    : m_header{nullptr}, m_mapped_size{0}, m_name{name}, m_owner{owner}, m_next_read{0}
+{}
+
+void SliceRing::Map(int fd, size_t size)
+{
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("Can't map slice ring " + m_name + ": " + std::strerror(errno));
+    
+    m_header = (Header*)mem;
+    m_mapped_size = size;
+}
+
+SliceRing::~SliceRing()
+{
+    // Don't leave the producer waiting on us.
+    if (m_header && !m_owner) {
+        m_header->closed.store(1, std::memory_order_release);
+        WakeAll(m_header->released);
+    }
+    if (m_header)
+        munmap(m_header, m_mapped_size);
+    if (m_owner)
+        shm_unlink(m_name.c_str());
+}
+
+std::unique_ptr<SliceRing> SliceRing::Create(const std::string& name, unsigned int num_frames, 
+    const std::vector<size_t>& output_sizes)
+{
+    if (num_frames == 0 || output_sizes.empty() || output_sizes.size() > max_outputs)
+        throw std::runtime_error("A slice ring needs frames, and 1 to 32 outputs per frame.");
+    
+    std::unique_ptr<SliceRing> ring {new SliceRing(name, true)};
+    
+    size_t frame_size = AlignUp(sizeof(FrameInfo), line_size);
+    std::vector<uint64_t> offsets;
+    for (auto size : output_sizes) {
+        offsets.push_back(frame_size);
+        frame_size += AlignUp(size, line_size);
+    }
+    size_t frame_stride = AlignUp(frame_size, page_size);
+    size_t total = AlignUp(sizeof(Header), page_size) + num_frames*frame_stride;
+    
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Can't create slice ring " + name + ": " + std::strerror(errno));
+    if (ftruncate(fd, total) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Can't size slice ring " + name);
+    }
+    ring->Map(fd, total);
+    
+    // A fresh segment is zeroed, so the counters start at 0, and so does the
+    // magic until all else is written.
+    Header& header = *new (ring->m_header) Header;
+    header.num_frames = num_frames;
+    header.num_outputs = output_sizes.size();
+    header.frame_stride = frame_stride;
+    for (size_t output = 0; output < output_sizes.size(); ++output) {
+        header.output_offsets[output] = offsets[output];
+        header.output_sizes[output] = output_sizes[output];
+    }
+    header.published.store(0);
+    header.released.store(0);
+    header.closed.store(0);
+    header.consumer_pid.store(0);
+    header.magic.store(ring_magic, std::memory_order_release);
+    
+    return ring;
+}
+
+std::unique_ptr<SliceRing> SliceRing::Open(const std::string& name)
+{
+    std::unique_ptr<SliceRing> ring {new SliceRing(name, false)};
+    
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        throw std::runtime_error("Can't open slice ring " + name + ": " + std::strerror(errno));
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+        close(fd);
+        throw std::runtime_error("Not a slice ring: " + name);
+    }
+    ring->Map(fd, info.st_size);
+    
+    Header& header = *ring->m_header;
+    if (header.magic.load(std::memory_order_acquire) != ring_magic)
+        throw std::runtime_error("Not a slice ring, or not ready yet: " + name);
+    
+    header.consumer_pid.store((int32_t)getpid(), std::memory_order_relaxed);
+    header.closed.store(0, std::memory_order_release);
+    ring->m_next_read = header.released.load(std::memory_order_acquire);
+    return ring;
+}
+
+std::vector<size_t> SliceRing::OutputSizes() const
+{
+    return std::vector<size_t>(m_header->output_sizes, m_header->output_sizes + m_header->num_outputs);
+}
+
+unsigned int SliceRing::NumFrames() const
+{
+    return m_header->num_frames;
+}
+
+char* SliceRing::FrameBase(uint32_t sequence) const
+{
+    return (char*)m_header + AlignUp(sizeof(Header), page_size) 
+        + (sequence % m_header->num_frames)*m_header->frame_stride;
+}
+
+SliceRing::Frame SliceRing::MakeFrame(uint32_t sequence) const
+{
+    char* base = FrameBase(sequence);
+    
+    Frame frame;
+    frame.slice_num = ((FrameInfo*)base)->slice_num;
+    for (uint32_t output = 0; output < m_header->num_outputs; ++output)
+        frame.outputs.push_back(base + m_header->output_offsets[output]);
+    return frame;
+}
+
+SliceRing::Frame SliceRing::AcquireFrame(uint64_t slice_num)
+{
+    Header& header = *m_header;
+    uint32_t next = header.published.load(std::memory_order_relaxed);
+    
+    // Full while the consumer hasn't released the frame that slot last held.
+    while (true) {
+        uint32_t released = header.released.load(std::memory_order_acquire);
+        if (next - released < header.num_frames)
+            break;
+        
+        // Nobody will release it if the consumer is gone.
+        pid_t consumer = (pid_t)header.consumer_pid.load(std::memory_order_relaxed);
+        if (header.closed.load(std::memory_order_acquire) || 
+            (consumer != 0 && kill(consumer, 0) != 0 && errno == ESRCH))
+        {
+            throw std::runtime_error("Slice ring " + m_name + " is full, and its consumer is gone.");
+        }
+        WaitChange(header.released, released, consumer_check_ms);
+    }
+    
+    ((FrameInfo*)FrameBase(next))->slice_num = slice_num;
+    return MakeFrame(next);
+}
+
+void SliceRing::PublishFrame()
+{
+    m_header->published.fetch_add(1, std::memory_order_release);
+    WakeAll(m_header->published);
+}
+
+bool SliceRing::WaitFrame(Frame& frame, int timeout_ms)
+{
+    Header& header = *m_header;
+    while (header.published.load(std::memory_order_acquire) == m_next_read) {
+        if (!WaitChange(header.published, m_next_read, timeout_ms))
+            return false;
+    }
+    
+    frame = MakeFrame(m_next_read++);
+    return true;
+}
+
+void SliceRing::ReleaseFrame()
+{
+    m_header->released.fetch_add(1, std::memory_order_release);
+    WakeAll(m_header->released);
+}
@@ -0,0 +1,327 @@
+#include "worker_protocol.h"
+#include "render_server.h"
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <map>
+#include <set>
+#include <list>
+#include <cerrno>
+#include <atomic>
+#include <future>
+#include <iostream>
+
+using namespace Ashigaru;
+using namespace Ashigaru::Worker;
+
+using ViewHandle = RenderServer::ViewHandle;
+
+static std::string OkReply()
+{
+    Writer reply;
+    reply.Put<uint8_t>(1);
+    return reply.Data();
+}
+
+static std::string ErrorReply(const std::string& what)
+{
+    Writer reply;
+    reply.Put<uint8_t>(0);
+    reply.PutString(what);
+    return reply.Data();
+}
+
+/* PublishSlice() writes a slice's outputs, back to back, into a new shared 
+ * memory segment. The front-end unlinks it once read, or the session when 
+ * it ends (see WorkerSession::UnlinkSegments()).
+ * 
+ * Returns:
+ * the segment's name, for shm_open().
+ */
+static std::string PublishSlice(const std::vector<std::unique_ptr<char>>& outputs, const std::vector<uint64_t>& sizes)
+{
+    static std::atomic<unsigned long> counter {0};
+    std::string name = "/ashigaru-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+    
+    uint64_t total = 0;
+    for (auto size : sizes)
+        total += size;
+    
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        throw std::runtime_error("Can't create shared memory segment " + name);
+    if (ftruncate(fd, total) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Can't size shared memory segment " + name);
+    }
+    
+    void* mem = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Can't map shared memory segment " + name);
+    }
+    
+    char* dest = (char*)mem;
+    for (size_t output = 0; output < outputs.size(); ++output) {
+        std::memcpy(dest, outputs[output].get(), sizes[output]);
+        dest += sizes[output];
+    }
+    munmap(mem, total);
+    
+    return name;
+}
+
+/* One front-end's session: its own server, and the actions its views use.
+ * Requests are handled in order, except that slices reply when done.
+ */
+class WorkerSession {
+    Connection& m_conn;
+    
+    // Declared before the server, so that they outlive it.
+    std::map<ViewHandle, std::vector<std::unique_ptr<RenderAction>>> m_actions;
+    std::map<ViewHandle, std::vector<uint64_t>> m_output_sizes; // bytes per output.
+    
+    RenderServer m_server;
+    std::list<std::future<void>> m_slices_in_flight;
+    
+    // Segments published, which the front-end may not have read yet.
+    std::mutex m_segments_lock;
+    std::set<std::string> m_segments;
+    
+    std::string RegisterModels(Reader& req);
+    std::string RegisterView(Reader& req);
+    std::string EditView(Reader& req);
+    std::string UnregisterView(Reader& req);
+    void ViewSlice(uint64_t request_id, Reader& req);
+    
+    /* UnlinkSegments() forgets the segments the front-end has unlinked. With
+     * `all`, it unlinks the rest too, which nobody will read any more.
+     */
+    void UnlinkSegments(bool all);
+
+public:
+    WorkerSession(Connection& conn, unsigned int tile_width, unsigned int tile_height) 
+        : m_conn{conn}, m_server{tile_width, tile_height} {}
+    ~WorkerSession();
+    
+    void Run();
+};
+
+std::string WorkerSession::RegisterModels(Reader& req)
+{
+    uint64_t num_models = req.Get<uint64_t>();
+    bool transformed = req.Get<uint8_t>() != 0;
+    
+    std::vector<std::shared_ptr<const Model>> models;
+    std::vector<glm::mat4> transforms;
+    for (uint64_t model_ix = 0; model_ix < num_models; ++model_ix) {
+        auto model = std::make_shared<Model>();
+        model->first.resize(req.Get<uint64_t>());
+        req.GetArray(model->first.data(), model->first.size());
+        model->second.resize(req.Get<uint64_t>());
+        req.GetArray(model->second.data(), model->second.size());
+        models.push_back(model);
+        
+        if (transformed)
+            transforms.push_back(req.Get<glm::mat4>());
+    }
+    
+    std::vector<RenderServer::ModelHandle> handles = m_server.RegisterModels(models, transforms);
+    
+    Writer reply;
+    reply.Put<uint8_t>(1);
+    reply.Put<uint64_t>(handles.size());
+    for (auto handle : handles)
+        reply.Put<uint64_t>(handle);
+    return reply.Data();
+}
+
+std::string WorkerSession::RegisterView(Reader& req)
+{
+    std::vector<ActionSpec> specs(req.Get<uint32_t>());
+    req.GetArray(specs.data(), specs.size());
+    uint32_t full_width = req.Get<uint32_t>();
+    uint32_t full_height = req.Get<uint32_t>();
+    std::vector<RenderServer::Placement> placements(req.Get<uint64_t>());
+    req.GetArray(placements.data(), placements.size());
+    
+    std::vector<std::unique_ptr<RenderAction>> actions;
+    std::vector<RenderAction*> action_ptrs;
+    for (auto& spec : specs) {
+        actions.push_back(MakeAction(spec));
+        action_ptrs.push_back(actions.back().get());
+    }
+    
+    ViewHandle view = m_server.RegisterView(action_ptrs, full_width, full_height, placements).get();
+    m_actions[view] = std::move(actions);
+    for (auto size : m_server.OutputSizes(view))
+        m_output_sizes[view].push_back(size);
+    
+    Writer reply;
+    reply.Put<uint8_t>(1);
+    reply.Put<uint32_t>(view);
+    return reply.Data();
+}
+
+std::string WorkerSession::EditView(Reader& req)
+{
+    ViewHandle view = req.Get<uint32_t>();
+    EditKind kind = req.Get<EditKind>();
+    RenderServer::Placement placement = req.Get<RenderServer::Placement>();
+    
+    switch (kind) {
+    case EditKind::Add: m_server.AddInstance(view, placement).get(); break;
+    case EditKind::Remove: m_server.RemoveInstance(view, placement.id).get(); break;
+    case EditKind::Move: m_server.MoveInstance(view, placement.id, placement.transform).get(); break;
+    }
+    return OkReply();
+}
+
+std::string WorkerSession::UnregisterView(Reader& req)
+{
+    ViewHandle view = req.Get<uint32_t>();
+    m_server.UnregisterView(view).get();
+    m_actions.erase(view);
+    m_output_sizes.erase(view);
+    return OkReply();
+}
+
+void WorkerSession::ViewSlice(uint64_t request_id, Reader& req)
+{
+    ViewHandle view = req.Get<uint32_t>();
+    uint64_t slice_num = req.Get<uint64_t>();
+    std::vector<uint64_t> sizes = m_output_sizes.at(view);
+    auto results = m_server.ViewSlice(view, slice_num);
+    
+    // Wait off the request loop, so that more slices can queue meanwhile.
+    // The session waits for these before it goes.
+    Connection& conn = m_conn;
+    m_slices_in_flight.push_back(std::async(std::launch::async, 
+        [this, &conn, request_id, sizes, results = std::move(results)]() mutable 
+    {
+        std::string reply;
+        try {
+            std::vector<std::unique_ptr<char>> outputs;
+            for (auto& result : results)
+                outputs.push_back(result.get());
+            
+            std::string segment = PublishSlice(outputs, sizes);
+            {
+                std::lock_guard<std::mutex> lck {m_segments_lock};
+                m_segments.insert(segment);
+            }
+            
+            Writer ok;
+            ok.Put<uint8_t>(1);
+            ok.PutString(segment);
+            ok.Put<uint64_t>(sizes.size());
+            ok.PutArray(sizes.data(), sizes.size());
+            reply = ok.Data();
+        }
+        catch (std::exception& e) {
+            reply = ErrorReply(e.what());
+        }
+        
+        try {
+            conn.Send(MessageType::Reply, request_id, reply);
+        }
+        catch (std::exception&) {} // the front-end is gone; the session ends with it.
+    }));
+}
+
+void WorkerSession::UnlinkSegments(bool all)
+{
+    std::lock_guard<std::mutex> lck {m_segments_lock};
+    for (auto segment = m_segments.begin(); segment != m_segments.end(); ) {
+        if (all) {
+            shm_unlink(segment->c_str());
+            segment = m_segments.erase(segment);
+            continue;
+        }
+        
+        int fd = shm_open(segment->c_str(), O_RDONLY, 0);
+        if (fd >= 0)
+            close(fd);
+        if (fd < 0 && errno == ENOENT)
+            segment = m_segments.erase(segment);
+        else
+            ++segment;
+    }
+}
+
+void WorkerSession::Run()
+{
+    MessageType type;
+    uint64_t request_id;
+    std::string payload;
+    
+    while (m_conn.Receive(type, request_id, payload)) {
+        // Forget slices that are done.
+        m_slices_in_flight.remove_if([](const std::future<void>& slice) {
+            return slice.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        UnlinkSegments(false);
+        
+        std::string reply;
+        try {
+            Reader req {payload};
+            switch (type) {
+            case MessageType::RegisterModels: reply = RegisterModels(req); break;
+            case MessageType::RegisterView: reply = RegisterView(req); break;
+            case MessageType::EditView: reply = EditView(req); break;
+            case MessageType::UnregisterView: reply = UnregisterView(req); break;
+            case MessageType::ViewSlice: ViewSlice(request_id, req); break;
+            default: reply = ErrorReply("Unknown request."); break;
+            }
+        }
+        catch (std::exception& e) {
+            reply = ErrorReply(e.what());
+        }
+        
+        if (!reply.empty())
+            m_conn.Send(MessageType::Reply, request_id, reply);
+    }
+}
+
+WorkerSession::~WorkerSession()
+{
+    // Also when Run() ends in an exception.
+    for (auto& slice : m_slices_in_flight)
+        slice.wait();
+    
+    // Whatever the front-end didn't get to would stay in /dev/shm for good.
+    UnlinkSegments(true);
+}
+
+int Worker::RunWorker(const std::string& socket_path, unsigned int tile_width, unsigned int tile_height)
+{
+    int listener;
+    try {
+        listener = Listen(socket_path);
+    }
+    catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Worker listening at " << socket_path << std::endl;
+    
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        
+        Connection conn {fd};
+        try {
+            WorkerSession session {conn, tile_width, tile_height};
+            session.Run();
+        }
+        catch (std::exception& e) {
+            std::cerr << "Worker session ended: " << e.what() << std::endl;
+        }
+    }
+}
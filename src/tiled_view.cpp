@@ -1,7 +1,14 @@
 #include <list>
 #include <set>
 #include <algorithm>
+#include <limits>
 #include <iostream>
+#include <cmath>
+#include <map>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "tiled_view.h"
 
@@ -32,104 +39,265 @@ static bool CopyTileToResult(const char* source, Rect<unsigned int> tile_rect, c
     unsigned int tw = tile_rect.Width()*elem_size;
     for (unsigned int row = 0; row < tile_rect.Height(); ++row) {
         unsigned int image_row = row + tile_rect.bottom();
-        std::copy(source + row*tw, source + (row + 1)*tw, img_buf + (image_row*stride + tile_rect.left())*elem_size);
+        std::copy(source + row*tw, source + (row + 1)*tw, img_buf + ((size_t)image_row*stride + tile_rect.left())*elem_size);
     }
     
     return true;
 }
 
-/* SetPromisesWhenDone() receives a vector of copy-job futures, waits for the 
- * copies to complete, then sets promises for the images these copies create.
- * Meant to be called async.
+/* FillTileConstant() sets every pixel of a tile's region in the full image
+* to the same value. Used for tiles that have nothing to render in a slice.
+* 
+* Arguments:
+* pixel - the value of one pixel, `elem_size` bytes long.
+* tile_rect, img_buf, stride, elem_size - as in CopyTileToResult().
+* 
+* Returns: 
+* always true, to signal completion.
+*/
+static bool FillTileConstant(std::vector<char> pixel, Rect<unsigned int> tile_rect, char* img_buf, unsigned int stride, unsigned int elem_size)
+{
+    // Build one tile row, then stamp it on all rows.
+    std::vector<char> tile_row(tile_rect.Width()*elem_size);
+    for (unsigned int col = 0; col < tile_rect.Width(); ++col)
+        std::copy(pixel.begin(), pixel.end(), tile_row.begin() + col*elem_size);
+    
+    for (unsigned int row = 0; row < tile_rect.Height(); ++row) {
+        unsigned int image_row = row + tile_rect.bottom();
+        std::copy(tile_row.begin(), tile_row.end(), img_buf + ((size_t)image_row*stride + tile_rect.left())*elem_size);
+    }
+    
+    return true;
+}
+
+// A tile's region in an output downsampled by `scale`, which divides the tile.
+static Rect<unsigned int> ScaledRect(const Rect<unsigned int>& rect, unsigned int scale)
+{
+    return Rect<unsigned int>{rect.top()/scale, rect.left()/scale, rect.bottom()/scale, rect.right()/scale};
+}
+
+/* KeepTileResult() copies a tile's rendering result aside, for later slices 
+* to reuse, and places it as CopyTileToResult() does.
+* 
+* Arguments:
+* kept - where the copy goes, of the size of the tile's result.
+* rest - as in CopyTileToResult().
+*/
+static bool KeepTileResult(const char* source, std::shared_ptr<std::vector<char>> kept, 
+    Rect<unsigned int> tile_rect, char* img_buf, unsigned int stride, unsigned int elem_size)
+{
+    std::copy(source, source + kept->size(), kept->begin());
+    return CopyTileToResult(kept->data(), tile_rect, img_buf, stride, elem_size);
+}
+
+// Places a kept result, which lives at least until the copy is done.
+static bool CopyKeptTile(std::shared_ptr<const std::vector<char>> kept, 
+    Rect<unsigned int> tile_rect, char* img_buf, unsigned int stride, unsigned int elem_size)
+{
+    return CopyTileToResult(kept->data(), tile_rect, img_buf, stride, elem_size);
+}
+
+/* CompleteWhenDone() receives a vector of copy-job futures, waits for the 
+ * copies to complete, then hands over the images these copies create.
+ * Meant to be called async. If a copy, the region stream or the store 
+ * failed, each output gets the first error instead of its image, and it's
+ * thrown again, for a sink's writer.
  * 
  * Arguments:
  * waiting_copies - futures from async calls to the tile copy operation.
- * promises - the promises to set when images are done.
- * image_bufs - the respective values to set in the promises when the 
- *      time comes.
+ * copied - set when the copies are done, so that their sources may go.
+ * streamed - if valid, ready when all regions are streamed, which must come
+ *    before the images are given away.
+ * store - if not empty, called before the images are given away, e.g. to 
+ *    write them to the slice cache.
+ * on_output - called for each image when the time comes.
+ * image_bufs - the respective images to give.
  */
-static void SetPromisesWhenDone(
+static void CompleteWhenDone(
     std::shared_ptr<std::vector<std::future<bool>>> waiting_copies, 
-    std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>> promises, 
+    std::shared_ptr<std::promise<void>> copied,
+    std::shared_future<void> streamed,
+    std::function<void()> store,
+    OutputCallback on_output, 
     std::vector<char*> image_bufs)
 {
-    for (auto& job : *waiting_copies)
-        job.get();
+    std::exception_ptr error;
+    for (auto& job : *waiting_copies) {
+        try {
+            job.get();
+        }
+        catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    copied->set_value();
+    
+    // A RegionCallback that threw ended the stream early.
+    try {
+        if (streamed.valid())
+            streamed.get();
+        if (store && !error)
+            store();
+    }
+    catch (...) {
+        if (!error)
+            error = std::current_exception();
+    }
     
-    for (unsigned int image = 0; image < (unsigned int)image_bufs.size(); ++image)
-        promises[image]->set_value(std::unique_ptr<char>(image_bufs[image]));
+    for (unsigned int image = 0; image < (unsigned int)image_bufs.size(); ++image) {
+        if (!error) {
+            on_output(image, std::unique_ptr<char>(image_bufs[image]), nullptr);
+            continue;
+        }
+        delete[] image_bufs[image];
+        on_output(image, nullptr, error);
+    }
+    if (error)
+        std::rethrow_exception(error);
 }
 
-/* TakeTouchingFaces() records all vertices of a model that belong to a face 
+/* RegionStream hands the regions of a slice (tiles, or bands of tiles) to a 
+ * RegionCallback as they are placed, in order. Each tile copy counts itself
+ * off its region with Placed(). Deliver() waits for each region in turn and
+ * is meant to be called async.
+ */
+class RegionStream {
+    std::vector<Rect<unsigned int>> m_regions;
+    std::unique_ptr<std::atomic<unsigned int>[]> m_pending; // copies per region.
+    std::vector<std::promise<void>> m_placed;
+    std::vector<std::future<void>> m_placed_futures;
+    
+public:
+    /* Arguments:
+     * regions - in delivery order.
+     * copies - how many tile copies fill each region.
+     */
+    RegionStream(const std::vector<Rect<unsigned int>>& regions, const std::vector<unsigned int>& copies)
+        : m_regions{regions}, m_pending{new std::atomic<unsigned int>[regions.size()]}, m_placed(regions.size())
+    {
+        for (size_t region = 0; region < regions.size(); ++region) {
+            m_placed_futures.push_back(m_placed[region].get_future());
+            m_pending[region] = copies[region];
+            if (copies[region] == 0)
+                m_placed[region].set_value();
+        }
+    }
+    
+    void Placed(size_t region) 
+    {
+        if (--m_pending[region] == 0)
+            m_placed[region].set_value();
+    }
+    
+    void Deliver(RegionCallback on_region, size_t slice_num, std::vector<const char*> images) 
+    {
+        for (size_t region = 0; region < m_regions.size(); ++region) {
+            m_placed_futures[region].wait();
+            on_region(slice_num, m_regions[region], images);
+        }
+    }
+};
+
+/* LaunchCopy() runs a tile copy in the background, counting it off its 
+ * streamed region when done, if streaming.
+ */
+template <typename Copy>
+static std::future<bool> LaunchCopy(Copy copy, std::shared_ptr<RegionStream> stream, size_t region)
+{
+    // A failed copy still counts, or the stream would wait for it forever.
+    return std::async(std::launch::async, [copy, stream, region]() {
+        bool done;
+        try {
+            done = copy();
+        }
+        catch (...) {
+            if (stream)
+                stream->Placed(region);
+            throw;
+        }
+        if (stream)
+            stream->Placed(region);
+        return done;
+    });
+}
+
+/* TakeTouchingFaces() marks all faces of a placed model that have a vertex 
  * incident on a given tile.
  * 
  * Arguments:
- * model - containing the vertex and face info.
+ * vertices - the model's vertices, already transformed into the tray.
+ * faces - the model's faces, indexing `vertices`.
  * region - the tile corners.
- * taken_verts - output. Vertices are appended to the back.
+ * taken_faces - output. Touching faces are marked true, others left as they are,
+ *    so that marks from several instances of a model accumulate.
+ * z_min, z_max - updated to include the Z extent of the touching faces.
  * 
  * Returns:
- * number of vertices taken.
+ * number of touching faces.
  */
 static unsigned int TakeTouchingFaces(
-    const Model& model, const Rect<unsigned int> region, std::vector<Vertex>& taken_verts)
+    const VertexSoA& vertices, const TriangleVec& faces, const Rect<unsigned int> region, 
+    std::vector<bool>& taken_faces, float& z_min, float& z_max)
 {
-	std::vector<bool> taken(model.first.size());
 	// Check which vertices incident on region:
-	for (size_t vertIx = 0; vertIx < model.first.size(); ++vertIx) {
-		const Vertex& vert = model.first[vertIx];
-		if (vert.x >= region.left() && vert.x <= region.right() &&
-			vert.y >= region.bottom() && vert.y <= region.top())
-		{
-			taken[vertIx] = true;
-		}
-	}
-	// Complete marking vertices of faces that have one touching vertex.
-	for (const Triangle& face : model.second) {
+	std::vector<uint8_t> incident;
+	vertices.MarkInRect((float)region.left(), (float)region.bottom(), (float)region.right(), (float)region.top(), incident);
+	const float* zs = vertices.Z();
+	
+	// Take faces that have one touching vertex.
+	unsigned int num_taken = 0;
+	for (size_t faceIx = 0; faceIx < faces.size(); ++faceIx) {
+		const Triangle& face = faces[faceIx];
 		bool touch = std::any_of(
 			face.begin(), face.end(),
-			[&taken](Triangle::value_type ind) {return taken[ind]; }
+			[&incident](Triangle::value_type ind) {return incident[ind]; }
 		);
-		if (touch)
-			for (auto ind : face)
-				taken[ind] = true;
-	}
-
-	// Convert to vertex vector.
-	for (size_t vertIx = 0; vertIx < model.first.size(); ++vertIx) {
-		if (taken[vertIx])
-			taken_verts.push_back(model.first[vertIx]);
+		if (!touch)
+			continue;
+		
+		taken_faces[faceIx] = true;
+		for (auto ind : face) {
+			z_min = std::min(z_min, zs[ind]);
+			z_max = std::max(z_max, zs[ind]);
+		}
+		++num_taken;
 	}
     // Another future improvement: hold the vertices in a way more conducive to 
     // tile division. Anyway, this very suboptimal version will do for now.
     
-    return static_cast<unsigned int>(taken_verts.size());
+    return num_taken;
+}
+
+/* Stretch() grows a mesh's record of how far instances stretch each of its
+ * axes, by the lengths of a transform's columns.
+ */
+static void Stretch(glm::vec3& stretch, const glm::mat4& transform)
+{
+    for (int axis = 0; axis < 3; ++axis)
+        stretch[axis] = std::max(stretch[axis], glm::length(glm::vec3(transform[axis])));
 }
 
 TiledView::TiledView(
-    RenderAction& render_action,
+    const std::vector<RenderAction*>& render_actions,
     unsigned int full_width, unsigned int full_height, unsigned int tile_width, unsigned int tile_height, 
-    std::vector<std::shared_ptr<const Model>>& geometry
+    const std::vector<ModelInstance>& instances
 )
-    : m_render_action{render_action},
-      m_full_width{full_width}, m_full_height{full_height}, m_tile_width{tile_width}, m_tile_height{tile_height}
+    : m_render_actions{render_actions},
+      m_full_width{full_width}, m_full_height{full_height}, m_tile_width{tile_width}, m_tile_height{tile_height},
+      m_resident{true}, m_gpu_bytes{0}, m_keep_results{false}, m_max_quantization_error{0}, 
+      m_cache_key{0}, m_cache_key_valid{false}, m_prebuild_pos{0}
 {
-	m_models = geometry;
-    m_render_action.InitGL();
-    
-    // Here we start representing the model. The vertex array holds
-    // a series of vertex attribute buffers.
-    glGenVertexArrays(1, &m_varray);
-    glBindVertexArray(m_varray);
-    
-    // Future: per-tile structures. But for now, all tiles share the same VBO.
-    GLfloat* positions = (float *)m_models[0]->first.data();
+    for (auto action : m_render_actions) {
+        action->InitGL();
+        m_keep_results = m_keep_results || action->ShiftInvariant();
+    }
     
-    unsigned int num_width_tiles = m_full_width / m_tile_width;
-    unsigned int num_height_tiles = m_full_height / m_tile_height;
+    m_num_width_tiles = m_full_width / m_tile_width;
+    m_num_height_tiles = m_full_height / m_tile_height;
     
-    for (unsigned int wtile = 0; wtile < num_width_tiles; ++wtile) {
-        for (unsigned int htile = 0; htile < num_height_tiles; ++htile) 
+    for (unsigned int wtile = 0; wtile < m_num_width_tiles; ++wtile) {
+        for (unsigned int htile = 0; htile < m_num_height_tiles; ++htile) 
         {
             Tile tile;
             tile.region = {
@@ -138,109 +306,843 @@ TiledView::TiledView(
                 (htile)*m_tile_height, 
                 (wtile + 1)*m_tile_width,
             };
+            tile.built = false;
+            tile.occupied = false;
+            tile.kept.assign(m_render_actions.size(), KeptResult{false});
+            m_tiles.push_back(std::move(tile));
+        }
+    }
+    SetTileOrder(TileOrder::Columns);
+    
+    // Place everything. Each tile/mesh pair is binned once, when its tile 
+    // is built.
+    DirtySet dirty;
+    for (auto& placement : instances) {
+        UseMesh(placement.model);
+        Stretch(m_meshes.at(placement.model.get()).stretch, placement.transform);
+        m_instances.push_back(Instance{placement, Footprint(placement)});
+        for (auto tile_ix : m_instances.back().footprint)
+            dirty.insert(std::make_pair(tile_ix, placement.model.get()));
+    }
+    Rebuild(dirty);
+}
+
+void TiledView::UseMesh(const std::shared_ptr<const Model>& model)
+{
+    auto found = m_meshes.find(model.get());
+    if (found != m_meshes.end()) {
+        ++found->second.num_instances;
+        return;
+    }
+    
+    // Uploaded with the first tile that draws it, see RebuildBatch().
+    Mesh mesh {model, GLObject(), VertexSoA(), 0, ComputeBounds(model->first), 1, 0, 
+        false, glm::mat4(1.0f), glm::vec3(0.0f)};
+    m_meshes.emplace(model.get(), std::move(mesh));
+}
+
+const VertexSoA& TiledView::BinningVertices(Mesh& mesh)
+{
+    if (mesh.soa.size() != mesh.model->first.size())
+        mesh.soa = VertexSoA(mesh.model->first);
+    return mesh.soa;
+}
+
+// Steps of a 16-bit normalized coordinate.
+static const float quantization_steps = 65535.f;
+
+bool TiledView::ShouldQuantize(const Mesh& mesh) const
+{
+    if (m_max_quantization_error <= 0)
+        return false;
+    
+    // Rounding errs by half a step along each axis, at most, and each axis
+    // is stretched by no more than `stretch` in the tray.
+    glm::vec3 half_steps = (mesh.bounds.max - mesh.bounds.min) / (2*quantization_steps);
+    return glm::dot(half_steps, mesh.stretch) <= m_max_quantization_error;
+}
+
+size_t TiledView::MeshBytes(const Mesh& mesh)
+{
+    if (mesh.positions == 0)
+        return 0;
+    return mesh.model->first.size()*(mesh.quantized ? 4*sizeof(uint16_t) : sizeof(Vertex));
+}
+
+size_t TiledView::BatchBytes(const Batch& batch)
+{
+    return batch.vertices.IndexCount()*sizeof(GLuint) + batch.vertices.InstanceCount()*sizeof(InstanceRecord);
+}
+
+void TiledView::UploadMesh(Mesh& mesh)
+{
+    const VertexVec& verts = mesh.model->first;
+    m_gpu_bytes -= MeshBytes(mesh);
+    mesh.positions = GLObject(GLObject::Kind::Buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.positions);
+    
+    mesh.quantized = ShouldQuantize(mesh);
+    m_gpu_bytes += MeshBytes(mesh);
+    if (!mesh.quantized) {
+        mesh.dequantize = glm::mat4(1.0f);
+        glBufferData(GL_ARRAY_BUFFER, verts.size()*sizeof(Vertex), verts.data(), GL_STATIC_DRAW);
+        return;
+    }
+    
+    // Four components, not three, to keep vertices 4-byte aligned.
+    glm::vec3 extent = mesh.bounds.max - mesh.bounds.min;
+    glm::vec3 to_steps;
+    for (int axis = 0; axis < 3; ++axis)
+        to_steps[axis] = extent[axis] > 0 ? quantization_steps / extent[axis] : 0.f;
+    
+    std::vector<uint16_t> quantized(verts.size()*4, 0);
+    for (size_t vert = 0; vert < verts.size(); ++vert) {
+        glm::vec3 steps = (verts[vert] - mesh.bounds.min)*to_steps;
+        for (int axis = 0; axis < 3; ++axis)
+            quantized[vert*4 + axis] = (uint16_t)std::min(quantization_steps, std::round(steps[axis]));
+    }
+    glBufferData(GL_ARRAY_BUFFER, quantized.size()*sizeof(uint16_t), quantized.data(), GL_STATIC_DRAW);
+    
+    // The GPU reads each coordinate as a fraction of the bounds.
+    mesh.dequantize = glm::scale(glm::translate(glm::mat4(1.0f), mesh.bounds.min), extent);
+}
+
+void TiledView::UpdateMeshFormat(const Model* model, DirtySet& dirty)
+{
+    Mesh& mesh = m_meshes.at(model);
+    if (!m_resident || mesh.positions == 0 || mesh.quantized == ShouldQuantize(mesh))
+        return;
+    
+    // Batches name the old buffer, so all of them go.
+    UploadMesh(mesh);
+    for (auto& instance : m_instances) {
+        if (instance.placement.model.get() != model)
+            continue;
+        for (auto tile_ix : instance.footprint)
+            dirty.insert(std::make_pair(tile_ix, model));
+    }
+}
+
+void TiledView::SetVertexQuantization(float max_error)
+{
+    if (max_error == m_max_quantization_error)
+        return;
+    
+    m_max_quantization_error = max_error;
+    m_cache_key_valid = false;
+    if (m_resident) {
+        Evict();
+        MakeResident();
+    }
+}
+
+void TiledView::ReleaseMesh(const Model* model)
+{
+    Mesh& mesh = m_meshes.at(model);
+    if (--mesh.num_instances > 0)
+        return;
+    
+    // Tiles not built yet have nothing of it to rebuild any more.
+    for (auto pair = m_unbuilt.begin(); pair != m_unbuilt.end(); ) {
+        if (pair->second == model)
+            pair = m_unbuilt.erase(pair);
+        else
+            ++pair;
+    }
+    m_gpu_bytes -= MeshBytes(mesh);
+    m_meshes.erase(model);
+}
+
+std::vector<size_t> TiledView::Footprint(const ModelInstance& placement) const
+{
+    // Transform the corners of the mesh's box, and box them again.
+    const BoundingBox& local = m_meshes.at(placement.model.get()).bounds;
+    VertexVec corners;
+    for (int corner = 0; corner < 8; ++corner) {
+        corners.push_back(Vertex{
+            (corner & 1) ? local.max.x : local.min.x,
+            (corner & 2) ? local.max.y : local.min.y,
+            (corner & 4) ? local.max.z : local.min.z
+        });
+    }
+    BoundingBox placed = TransformVertices(corners, corners, placement.transform);
+    
+    // Tiles include their edges, so a box touching an edge belongs to both sides.
+    std::vector<size_t> tiles;
+    if (placed.max.x < 0 || placed.max.y < 0)
+        return tiles;
+    
+    int wlo = std::max(0, (int)std::ceil(placed.min.x / m_tile_width) - 1);
+    int whi = std::min((int)m_num_width_tiles - 1, (int)std::floor(placed.max.x / m_tile_width));
+    int hlo = std::max(0, (int)std::ceil(placed.min.y / m_tile_height) - 1);
+    int hhi = std::min((int)m_num_height_tiles - 1, (int)std::floor(placed.max.y / m_tile_height));
+    
+    for (int wtile = wlo; wtile <= whi; ++wtile)
+        for (int htile = hlo; htile <= hhi; ++htile)
+            tiles.push_back(wtile*m_num_height_tiles + htile);
+    
+    return tiles;
+}
+
+void TiledView::RebuildBatch(size_t tile_ix, const Model* mesh)
+{
+    Tile& tile = m_tiles[tile_ix];
+    
+    auto old_batch = tile.mesh_batches.find(mesh);
+    if (old_batch != tile.mesh_batches.end()) {
+        m_gpu_bytes -= BatchBytes(old_batch->second);
+        tile.mesh_batches.erase(old_batch);
+    }
+    if (m_meshes.at(mesh).positions == 0)
+        UploadMesh(m_meshes.at(mesh));
+    
+    // Which faces are touched by any instance of the mesh, and which instances touch at all.
+    std::vector<bool> faces(mesh->second.size());
+    std::vector<InstanceRecord> instances;
+    Batch batch;
+    batch.z_min = std::numeric_limits<float>::max();
+    batch.z_max = std::numeric_limits<float>::lowest();
+    
+    const VertexSoA& local = BinningVertices(m_meshes.at(mesh));
+    VertexSoA placed;
+    std::vector<VertexSoA> drawn; // placed touching instances, if needed below.
+    for (auto& instance : m_instances) {
+        if (instance.placement.model.get() != mesh || 
+            std::find(instance.footprint.begin(), instance.footprint.end(), tile_ix) == instance.footprint.end())
+        {
+            continue;
+        }
+        
+        local.Transform(instance.placement.transform, placed);
+        if (TakeTouchingFaces(placed, mesh->second, tile.region, faces, batch.z_min, batch.z_max)) {
+            instances.push_back(InstanceRecord{
+                instance.placement.transform*m_meshes.at(mesh).dequantize, instance.placement.id});
+            if (m_keep_results)
+                drawn.push_back(placed);
+        }
+    }
+    if (instances.empty())
+        return;
+    
+    // Every taken face is drawn for every instance. Vertical ones are those 
+    // whose normal has no Z component, up to rounding.
+    for (auto& vertices : drawn) {
+        const float *xs = vertices.X(), *ys = vertices.Y(), *zs = vertices.Z();
+        for (size_t faceIx = 0; faceIx < faces.size(); ++faceIx) {
+            if (!faces[faceIx])
+                continue;
+            const Triangle& face = mesh->second[faceIx];
+            glm::vec3 a {xs[face[0]], ys[face[0]], zs[face[0]]};
+            glm::vec3 normal = glm::cross(
+                glm::vec3{xs[face[1]], ys[face[1]], zs[face[1]]} - a, 
+                glm::vec3{xs[face[2]], ys[face[2]], zs[face[2]]} - a);
+            if (std::abs(normal.z) <= 1e-6f*glm::length(normal))
+                continue;
             
-            // if a face touches the tile, take all its vertices to this tile's list.
-            // Future: maybe just work with faces and glDrawElements()?
-            std::vector<Vertex> tile_verts;
-            std::vector<unsigned short> shell_IDs;
-            unsigned short shell_ID = 0;
-            for (auto model : m_models) {
-                auto num_taken = TakeTouchingFaces(*model, tile.region, tile_verts);
-                shell_IDs.insert(shell_IDs.end(), num_taken, shell_ID++ );
+            batch.slanted_bottoms.push_back(std::min({zs[face[0]], zs[face[1]], zs[face[2]]}));
+            batch.slanted_tops.push_back(std::max({zs[face[0]], zs[face[1]], zs[face[2]]}));
+        }
+    }
+    std::sort(batch.slanted_bottoms.begin(), batch.slanted_bottoms.end());
+    std::sort(batch.slanted_tops.begin(), batch.slanted_tops.end());
+    
+    std::vector<GLuint> indices;
+    for (size_t faceIx = 0; faceIx < faces.size(); ++faceIx) {
+        if (!faces[faceIx])
+            continue;
+        for (auto ind : mesh->second[faceIx])
+            indices.push_back(ind);
+    }
+    
+    batch.indices = GLObject(GLObject::Kind::Buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.indices);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    
+    batch.instances = GLObject(GLObject::Kind::Buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, batch.instances);
+    glBufferData(GL_ARRAY_BUFFER, instances.size()*sizeof(InstanceRecord), instances.data(), GL_STATIC_DRAW);
+    
+    batch.vertices = VertexDB((unsigned int)mesh->first.size());
+    batch.vertices.AddBuffer("positions", m_meshes.at(mesh).positions);
+    if (m_meshes.at(mesh).quantized)
+        batch.vertices.SetFormat("positions", ColumnFormat{3, GL_UNSIGNED_SHORT, GL_TRUE, 4*sizeof(uint16_t)});
+    batch.vertices.AddBuffer("instances", batch.instances);
+    batch.vertices.SetIndices(batch.indices, (unsigned int)indices.size());
+    batch.vertices.SetInstanceCount((unsigned int)instances.size());
+    
+    // Each action reads the shared buffers its own way. The element buffer 
+    // binding is vertex array state, recorded with the rest.
+    for (auto action : m_render_actions) {
+        batch.varrays.push_back(GLObject(GLObject::Kind::VertexArray));
+        GLState::BindVertexArray(batch.varrays.back());
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.indices);
+        action->SetupVertexArray(batch.vertices);
+    }
+    
+    m_gpu_bytes += BatchBytes(batch);
+    tile.mesh_batches.emplace(mesh, std::move(batch));
+}
+
+void TiledView::Rebuild(const DirtySet& dirty)
+{
+    // An evicted view is rebuilt whole when it becomes resident.
+    if (!m_resident)
+        return;
+    
+    std::set<size_t> dirty_tiles;
+    std::set<const Model*> binned;
+    for (auto& tile_mesh : dirty) {
+        if (!m_tiles[tile_mesh.first].built) {
+            if (m_unbuilt.insert(tile_mesh).second)
+                ++m_meshes.at(tile_mesh.second).unbuilt;
+            continue;
+        }
+        RebuildBatch(tile_mesh.first, tile_mesh.second);
+        dirty_tiles.insert(tile_mesh.first);
+        binned.insert(tile_mesh.second);
+    }
+    
+    // SoA vertices stay only for meshes with tiles left to build.
+    for (auto model : binned) {
+        auto mesh = m_meshes.find(model);
+        if (mesh != m_meshes.end() && mesh->second.unbuilt == 0)
+            mesh->second.soa = VertexSoA();
+    }
+    
+    for (auto tile_ix : dirty_tiles) {
+        Tile& tile = m_tiles[tile_ix];
+        ForgetResults(tile);
+        tile.batches.assign(m_render_actions.size(), std::vector<VertexDB>{});
+        tile.z_min = std::numeric_limits<float>::max();
+        tile.z_max = std::numeric_limits<float>::lowest();
+        for (auto& mesh_batch : tile.mesh_batches) {
+            for (size_t action = 0; action < m_render_actions.size(); ++action) {
+                tile.batches[action].push_back(mesh_batch.second.vertices);
+                tile.batches[action].back().SetVertexArray(mesh_batch.second.varrays[action]);
             }
-            tile.vertices.SetNumVerts(tile_verts.size());
-            
-            GLuint vert_buf, shellIds_buf;
-            glGenBuffers(1, &vert_buf);
-            glBindBuffer(GL_ARRAY_BUFFER, vert_buf);
-            glBufferData(GL_ARRAY_BUFFER, tile_verts.size()*sizeof(Vertex), tile_verts.data(), GL_STATIC_DRAW);
-            tile.vertices.AddBuffer("positions", vert_buf);
-            
-            glGenBuffers(1, &shellIds_buf);
-            glBindBuffer(GL_ARRAY_BUFFER, shellIds_buf);
-            glBufferData(GL_ARRAY_BUFFER, shell_IDs.size()*sizeof(unsigned short), shell_IDs.data(), GL_STATIC_DRAW);
-            tile.vertices.AddBuffer("shellIDs", shellIds_buf);
-            
-            m_tiles.push_back(tile);
+            tile.z_min = std::min(tile.z_min, mesh_batch.second.z_min);
+            tile.z_max = std::max(tile.z_max, mesh_batch.second.z_max);
         }
+        tile.occupied = !tile.mesh_batches.empty();
     }
 }
 
+void TiledView::BuildTile(size_t tile_ix)
+{
+    Tile& tile = m_tiles[tile_ix];
+    if (tile.built || !m_resident)
+        return;
+    tile.built = true;
+    
+    // The set is ordered by tile, so the tile's pairs are all together.
+    auto first = m_unbuilt.lower_bound(std::make_pair(tile_ix, (const Model*)nullptr));
+    auto last = m_unbuilt.lower_bound(std::make_pair(tile_ix + 1, (const Model*)nullptr));
+    DirtySet pairs {first, last};
+    m_unbuilt.erase(first, last);
+    for (auto& tile_mesh : pairs)
+        --m_meshes.at(tile_mesh.second).unbuilt;
+    Rebuild(pairs);
+}
+
+bool TiledView::BuildNextTile()
+{
+    if (!m_resident)
+        return false;
+    
+    while (m_prebuild_pos < m_tile_order.size() && m_tiles[m_tile_order[m_prebuild_pos]].built)
+        ++m_prebuild_pos;
+    if (m_prebuild_pos == m_tile_order.size())
+        return false;
+    
+    BuildTile(m_tile_order[m_prebuild_pos++]);
+    return true;
+}
+
+void TiledView::ForgetResults(Tile& tile)
+{
+    tile.kept.assign(m_render_actions.size(), KeptResult{false});
+}
+
+bool TiledView::Prismatic(const Tile& tile, float z_min, float z_max) const
+{
+    // Faces reaching into the band are those starting below its top, less 
+    // those ending below its bottom.
+    for (auto& mesh_batch : tile.mesh_batches) {
+        const Batch& batch = mesh_batch.second;
+        auto starting = std::upper_bound(batch.slanted_bottoms.begin(), batch.slanted_bottoms.end(), z_max);
+        auto ended = std::lower_bound(batch.slanted_tops.begin(), batch.slanted_tops.end(), z_min);
+        if (starting - batch.slanted_bottoms.begin() > ended - batch.slanted_tops.begin())
+            return false;
+    }
+    return true;
+}
+
+uint64_t TiledView::SliceCacheKey(size_t slice_num)
+{
+    if (!SliceCacheEnabled())
+        return 0;
+    
+    if (!m_cache_key_valid) {
+        m_cache_key_valid = true;
+        m_cache_key = 0;
+        
+        std::string actions;
+        for (auto action : m_render_actions) {
+            std::string key = action->CacheKey();
+            if (key.empty())
+                return 0;
+            actions += key;
+        }
+        
+        unsigned int sizes[] = {m_full_width, m_full_height, m_tile_width, m_tile_height};
+        uint64_t hash = HashBytes(actions.data(), actions.size());
+        hash = HashBytes(sizes, sizeof(sizes), hash);
+        hash = HashBytes(&m_max_quantization_error, sizeof(float), hash);
+        for (auto& instance : m_instances) {
+            Mesh& mesh = m_meshes.at(instance.placement.model.get());
+            if (mesh.hash == 0) {
+                const Model& model = *mesh.model;
+                mesh.hash = HashBytes(model.first.data(), model.first.size()*sizeof(Vertex));
+                mesh.hash = HashBytes(model.second.data(), model.second.size()*sizeof(Triangle), mesh.hash);
+            }
+            hash = HashBytes(&mesh.hash, sizeof(mesh.hash), hash);
+            hash = HashBytes(&instance.placement.transform, sizeof(glm::mat4), hash);
+            hash = HashBytes(&instance.placement.id, sizeof(instance.placement.id), hash);
+        }
+        m_cache_key = hash;
+    }
+    if (m_cache_key == 0)
+        return 0;
+    
+    uint64_t slice = slice_num;
+    return HashBytes(&slice, sizeof(slice), m_cache_key);
+}
+
+std::vector<TiledView::Instance>::iterator TiledView::FindInstance(unsigned int id)
+{
+    return std::find_if(m_instances.begin(), m_instances.end(), 
+        [id](const Instance& instance) { return instance.placement.id == id; });
+}
+
+void TiledView::SetTileOrder(TileOrder order)
+{
+    m_tile_order.resize(m_tiles.size());
+    for (size_t tile_ix = 0; tile_ix < m_tiles.size(); ++tile_ix)
+        m_tile_order[tile_ix] = tile_ix;
+    m_prebuild_pos = 0;
+    
+    // Tiles are stored column by column, so bands just sort them by row.
+    if (order == TileOrder::Columns)
+        return;
+    
+    bool reversed = (order == TileOrder::BandsReversed);
+    std::stable_sort(m_tile_order.begin(), m_tile_order.end(), [this, reversed](size_t a, size_t b) {
+        unsigned int row_a = m_tiles[a].region.bottom(), row_b = m_tiles[b].region.bottom();
+        return reversed ? row_a > row_b : row_a < row_b;
+    });
+}
+
+void TiledView::Evict()
+{
+    for (auto& tile : m_tiles) {
+        tile.mesh_batches.clear();
+        tile.batches.clear();
+        tile.built = false;
+        tile.occupied = false;
+        ForgetResults(tile);
+    }
+    for (auto& mesh : m_meshes) {
+        mesh.second.positions.Reset();
+        mesh.second.soa = VertexSoA();
+        mesh.second.unbuilt = 0;
+    }
+    
+    m_unbuilt.clear();
+    m_prebuild_pos = 0;
+    m_resident = false;
+    m_gpu_bytes = 0;
+}
+
+void TiledView::MakeResident()
+{
+    if (m_resident)
+        return;
+    m_resident = true;
+    
+    // Tiles, and the meshes they draw, are built again as they're used.
+    DirtySet dirty;
+    for (auto& instance : m_instances)
+        for (auto tile_ix : instance.footprint)
+            dirty.insert(std::make_pair(tile_ix, instance.placement.model.get()));
+    Rebuild(dirty);
+}
+
+void TiledView::AddInstance(const ModelInstance& instance)
+{
+    m_cache_key_valid = false;
+    UseMesh(instance.model);
+    Stretch(m_meshes.at(instance.model.get()).stretch, instance.transform);
+    m_instances.push_back(Instance{instance, Footprint(instance)});
+    
+    DirtySet dirty;
+    for (auto tile_ix : m_instances.back().footprint)
+        dirty.insert(std::make_pair(tile_ix, instance.model.get()));
+    UpdateMeshFormat(instance.model.get(), dirty);
+    Rebuild(dirty);
+}
+
+bool TiledView::RemoveInstance(unsigned int id)
+{
+    auto found = FindInstance(id);
+    if (found == m_instances.end())
+        return false;
+    
+    m_cache_key_valid = false;
+    const Model* mesh = found->placement.model.get();
+    DirtySet dirty;
+    for (auto tile_ix : found->footprint)
+        dirty.insert(std::make_pair(tile_ix, mesh));
+    
+    // Keep the mesh alive until its batches are gone.
+    std::shared_ptr<const Model> keep_mesh = found->placement.model;
+    m_instances.erase(found);
+    Rebuild(dirty);
+    ReleaseMesh(mesh);
+    
+    return true;
+}
+
+bool TiledView::MoveInstance(unsigned int id, const glm::mat4& transform)
+{
+    auto found = FindInstance(id);
+    if (found == m_instances.end())
+        return false;
+    
+    m_cache_key_valid = false;
+    const Model* mesh = found->placement.model.get();
+    DirtySet dirty;
+    for (auto tile_ix : found->footprint)
+        dirty.insert(std::make_pair(tile_ix, mesh));
+    
+    found->placement.transform = transform;
+    found->footprint = Footprint(found->placement);
+    for (auto tile_ix : found->footprint)
+        dirty.insert(std::make_pair(tile_ix, mesh));
+    Stretch(m_meshes.at(mesh).stretch, transform);
+    UpdateMeshFormat(mesh, dirty);
+    Rebuild(dirty);
+    
+    return true;
+}
+
 // Each tile result generates a Sync and PBO object. These are stored 
 // in a TileJob struct together with the necessary tile/image information
 // for later processing. Then, tile jobs are async executed whenever their 
 // fence is ready.
 struct TileJob {
     GLsync fence;
-    GLuint pbo;
+    GLObject pbo;
     Rect<unsigned int> tile_rect;
     
     // Yeah, these 3 should be in some Image class. Later.
     char* img;
     unsigned int img_width;
     unsigned int elem_size;
+    
+    // For reduction outputs, which one of whose; `img` is then the slice's 
+    // result. -1 for images.
+    int reduction;
+    const RenderAction* action;
+    
+    size_t region; // streamed region the tile is in, if streaming.
+    
+    std::shared_ptr<std::vector<char>> kept; // where to keep the result too, if anywhere.
 };
 
-void TiledView::Render(size_t slice_num, std::vector<std::shared_ptr<std::promise<std::unique_ptr<char>>>>& promises)
+size_t TiledView::NumOutputs() const
+{
+    size_t outputs = 0;
+    for (auto action : m_render_actions)
+        outputs += action->OutputPixelSizes().size() + action->ReductionSizes().size();
+    return outputs;
+}
+
+std::vector<size_t> TiledView::OutputSizes() const
 {
-    std::vector<unsigned int> output_sizes = m_render_action.OutputPixelSizes();
-    std::vector<char*> image_bufs(output_sizes.size());
-    for (unsigned int image = 0; image < (unsigned int)output_sizes.size(); ++image)
-        image_bufs[image] = new char[m_full_height*m_full_width*output_sizes[image]];
+    std::vector<size_t> sizes;
+    for (auto action : m_render_actions) {
+        std::vector<unsigned int> pixel_sizes = action->OutputPixelSizes(), scales = action->OutputScales();
+        for (size_t image = 0; image < pixel_sizes.size(); ++image)
+            sizes.push_back((size_t)(m_full_width/scales[image])*(m_full_height/scales[image])*pixel_sizes[image]);
+        for (auto reduction_size : action->ReductionSizes())
+            sizes.push_back(reduction_size);
+    }
+    return sizes;
+}
+
+void TiledView::Render(size_t slice_num, OutputCallback on_output, SliceSink* sink,
+    RegionCallback on_region, bool whole_bands)
+{
+    MakeResident();
     
-    std::list<TileJob> tile_jobs {};
+    // Forget slices that are handed over.
+    m_completions.remove_if([](const std::future<void>& completion) {
+        return completion.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
     
-    unsigned int num_width_tiles = m_full_width / m_tile_width;
-    unsigned int num_height_tiles = m_full_height / m_tile_height;
+    // With a sink, tiles go straight into its buffers. This may wait for
+    // the sink to make room.
+    std::vector<char*> sink_bufs;
+    if (sink)
+        sink_bufs = sink->AcquireOutputs(slice_num);
     
-    glBindVertexArray(m_varray);
+    // Each action's outputs, placed in image_bufs one action after the other.
+    struct ActionOutputs {
+        std::vector<unsigned int> output_sizes, reduction_sizes;
+        size_t first; // index of the first output in image_bufs.
+        std::vector<unsigned int> scales; // of each image.
+        std::pair<float, float> influence;
+        std::vector<std::vector<char>> background;
+    };
+    std::vector<ActionOutputs> outputs;
+    std::vector<char*> image_bufs;
     
-    // Give the GPU its day's orders:
-    m_render_action.PrepareSlice(slice_num);
-    for (auto& tile : m_tiles) {
-        m_render_action.PrepareTile(tile.region);
-        auto tile_res = m_render_action.StartRender(tile.vertices);
+    for (auto action : m_render_actions) {
+        ActionOutputs out {action->OutputPixelSizes(), action->ReductionSizes(), image_bufs.size(), action->OutputScales()};
+        for (size_t image = 0; image < out.output_sizes.size(); ++image) {
+            size_t pixels = (size_t)(m_full_height/out.scales[image])*(m_full_width/out.scales[image]);
+            image_bufs.push_back(sink ? sink_bufs[image_bufs.size()] : new char[pixels*out.output_sizes[image]]);
+        }
         
-        for (unsigned int image = 0; image < (unsigned int)output_sizes.size(); ++image) {
-            tile_jobs.push_back(TileJob{
-                tile_res[image].first, tile_res[image].second, tile.region, image_bufs[image], m_full_width, output_sizes[image]
-            });
+        // Reduction results follow the images, and are only a few bytes each.
+        for (unsigned int reduction = 0; reduction < (unsigned int)out.reduction_sizes.size(); ++reduction) {
+            image_bufs.push_back(sink ? sink_bufs[image_bufs.size()] : new char[out.reduction_sizes[reduction]]);
+            action->InitReduction(reduction, image_bufs.back());
         }
+        
+        // Give the GPU its day's orders:
+        action->PrepareSlice(slice_num);
+        out.influence = action->SliceInfluence();
+        out.background = action->BackgroundPixels();
+        outputs.push_back(std::move(out));
     }
     
-    // Wait for GPU to finish tiles, and send finished tiles to placement.
+    // A slice rendered before, by any process sharing the slice cache, 
+    // needs no tiles at all.
+    uint64_t cache_key = SliceCacheKey(slice_num);
+    bool from_cache = cache_key != 0 && LoadCachedSlice(cache_key, image_bufs, OutputSizes());
+    if (cache_key != 0 && !from_cache) {
+        // Undo whatever a failed load left in the reductions.
+        for (size_t action_ix = 0; action_ix < m_render_actions.size(); ++action_ix) {
+            const ActionOutputs& out = outputs[action_ix];
+            for (unsigned int reduction = 0; reduction < (unsigned int)out.reduction_sizes.size(); ++reduction)
+                m_render_actions[action_ix]->InitReduction(reduction, image_bufs[out.first + out.output_sizes.size() + reduction]);
+        }
+    }
+    const std::vector<size_t>& render_order = from_cache ? std::vector<size_t>{} : m_tile_order;
+    
+    // Streaming: each tile belongs to a region (itself, or its band), which 
+    // is delivered when all its image copies are placed. Regions go in tile
+    // order, as soon as they're done, while later tiles still render.
+    std::shared_ptr<RegionStream> stream;
+    std::vector<size_t> tile_region(m_tiles.size(), 0);
+    std::shared_future<void> streamed;
+    if (on_region) {
+        unsigned int images_per_tile = 0;
+        for (auto& out : outputs)
+            images_per_tile += out.output_sizes.size();
+        
+        std::vector<Rect<unsigned int>> regions;
+        std::vector<unsigned int> copies;
+        std::map<unsigned int, size_t> band_regions; // by the band's first row.
+        for (auto tile_ix : m_tile_order) {
+            const Rect<unsigned int>& tile_rect = m_tiles[tile_ix].region;
+            auto band = band_regions.find(tile_rect.bottom());
+            
+            if (!whole_bands || band == band_regions.end()) {
+                if (whole_bands) {
+                    band = band_regions.emplace(tile_rect.bottom(), regions.size()).first;
+                    regions.push_back(Rect<unsigned int>{tile_rect.top(), 0, tile_rect.bottom(), m_full_width});
+                }
+                else
+                    regions.push_back(tile_rect);
+                copies.push_back(0);
+            }
+            
+            tile_region[tile_ix] = whole_bands ? band->second : regions.size() - 1;
+            if (!from_cache)
+                copies[tile_region[tile_ix]] += images_per_tile;
+        }
+        
+        std::vector<const char*> images;
+        for (auto& out : outputs) {
+            for (size_t image = 0; image < out.output_sizes.size(); ++image)
+                images.push_back(image_bufs[out.first + image]);
+            images.resize(images.size() + out.reduction_sizes.size(), nullptr);
+        }
+        
+        stream = std::make_shared<RegionStream>(regions, copies);
+        streamed = std::async(std::launch::async, 
+            &RegionStream::Deliver, stream, on_region, slice_num, images).share();
+    }
+    
+    std::list<TileJob> tile_jobs {};
+    
+    // Tiles that see no geometry this slice are filled on the CPU, 
+    // alongside the copies of rendered tiles.
     using WaitingVec = std::vector<std::future<bool>>;
     std::shared_ptr<WaitingVec> waiting_copies = std::make_shared<WaitingVec>();
-	std::vector<GLuint> discardablePBOs;
+    
+    // One pass over the tiles, with all actions drawing from the same buffers.
+    for (auto tile_ix : render_order) {
+        Tile& tile = m_tiles[tile_ix];
+        BuildTile(tile_ix);
+        for (size_t action_ix = 0; action_ix < m_render_actions.size(); ++action_ix) {
+            RenderAction* action = m_render_actions[action_ix];
+            const ActionOutputs& out = outputs[action_ix];
+            const std::vector<unsigned int>& output_sizes = out.output_sizes;
+            const std::vector<unsigned int>& reduction_sizes = out.reduction_sizes;
+            char** action_bufs = image_bufs.data() + out.first;
+            
+            // Where each image output of the tile goes, at its own scale.
+            std::vector<Rect<unsigned int>> image_rects;
+            for (auto scale : out.scales)
+                image_rects.push_back(ScaledRect(tile.region, scale));
+            
+            if (!tile.occupied || tile.z_max < out.influence.first || tile.z_min > out.influence.second) {
+                for (unsigned int image = 0; image < (unsigned int)output_sizes.size(); ++image) {
+                    waiting_copies->push_back(LaunchCopy(std::bind(FillTileConstant, 
+                        out.background[image], image_rects[image], action_bufs[image], 
+                        m_full_width/out.scales[image], output_sizes[image]
+                    ), stream, tile_region[tile_ix]));
+                }
+                continue;
+            }
+            
+            // Nothing but walls between here and the slice the tile's results
+            // were kept for: the same walls, seen from the same place.
+            KeptResult& kept = tile.kept[action_ix];
+            float band_min = out.influence.first, band_max = out.influence.second;
+            if (kept.valid && Prismatic(tile, std::min(kept.z_min, band_min), std::max(kept.z_max, band_max))) {
+                for (unsigned int image = 0; image < (unsigned int)output_sizes.size(); ++image) {
+                    waiting_copies->push_back(LaunchCopy(std::bind(CopyKeptTile, 
+                        kept.outputs[image], image_rects[image], action_bufs[image], 
+                        m_full_width/out.scales[image], output_sizes[image]
+                    ), stream, tile_region[tile_ix]));
+                }
+                for (unsigned int reduction = 0; reduction < (unsigned int)reduction_sizes.size(); ++reduction) {
+                    action->CombineReduction(reduction, action_bufs[output_sizes.size() + reduction], 
+                        kept.outputs[output_sizes.size() + reduction]->data(), tile.region);
+                }
+                kept.z_min = band_min;
+                kept.z_max = band_max;
+                continue;
+            }
+            
+            // Keep this slice's results if a later one may reuse them.
+            kept = KeptResult{action->ShiftInvariant() && Prismatic(tile, band_min, band_max), band_min, band_max};
+            auto keep = [&kept](size_t size) {
+                if (!kept.valid)
+                    return std::shared_ptr<std::vector<char>>();
+                kept.outputs.push_back(std::make_shared<std::vector<char>>(size));
+                return kept.outputs.back();
+            };
+            
+            action->PrepareTile(tile.region);
+            auto tile_res = action->StartRender(tile.batches[action_ix]);
+            
+            for (unsigned int image = 0; image < (unsigned int)output_sizes.size(); ++image) {
+                const Rect<unsigned int>& image_rect = image_rects[image];
+                tile_jobs.push_back(TileJob{
+                    tile_res[image].first, GLObject(GLObject::Kind::Buffer, tile_res[image].second), image_rect, 
+                    action_bufs[image], m_full_width/out.scales[image], output_sizes[image], -1, action, tile_region[tile_ix],
+                    keep((size_t)image_rect.Width()*image_rect.Height()*output_sizes[image])
+                });
+            }
+            for (unsigned int reduction = 0; reduction < (unsigned int)reduction_sizes.size(); ++reduction) {
+                auto& res = tile_res[output_sizes.size() + reduction];
+                tile_jobs.push_back(TileJob{
+                    res.first, GLObject(GLObject::Kind::Buffer, res.second), tile.region, 
+                    action_bufs[output_sizes.size() + reduction], 1, reduction_sizes[reduction], (int)reduction, action, 
+                    tile_region[tile_ix], keep(reduction_sizes[reduction])
+                });
+            }
+        }
+    }
+    
+    // Wait for GPU to finish tiles, and send finished tiles to placement.
+    // The PBOs stay mapped until the copies reading them are done.
+	std::vector<GLObject> mapped_pbos;
 
-    auto job = tile_jobs.cbegin();
+    auto job = tile_jobs.begin();
     while(!tile_jobs.empty()) {
-        if (job == tile_jobs.cend())
-            job = tile_jobs.cbegin();
+        if (job == tile_jobs.end())
+            job = tile_jobs.begin();
         
         auto wait_state = glClientWaitSync(job->fence, 0, 0);
-        if (wait_state == GL_ALREADY_SIGNALED) {
+        if (wait_state == GL_ALREADY_SIGNALED || wait_state == GL_CONDITION_SATISFIED) {
+            glDeleteSync(job->fence);
             glBindBuffer(GL_PIXEL_PACK_BUFFER, job->pbo);
             const char *data = (char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+            
+            // Reductions are tiny, fold them right here.
+            if (job->reduction >= 0) {
+                if (job->kept)
+                    std::copy(data, data + job->kept->size(), job->kept->begin());
+                job->action->CombineReduction(job->reduction, job->img, data, job->tile_rect);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                job = tile_jobs.erase(job);
+                continue;
+            }
                 
-            waiting_copies->push_back(std::async(
-                std::launch::async, CopyTileToResult, 
-                data, job->tile_rect, job->img, job->img_width, job->elem_size
-            ));
+            if (job->kept) {
+                waiting_copies->push_back(LaunchCopy(std::bind(KeepTileResult, 
+                    data, job->kept, job->tile_rect, job->img, job->img_width, job->elem_size
+                ), stream, job->region));
+            }
+            else {
+                waiting_copies->push_back(LaunchCopy(std::bind(CopyTileToResult, 
+                    data, job->tile_rect, job->img, job->img_width, job->elem_size
+                ), stream, job->region));
+            }
             
-            auto erase_pos = job++;
-			discardablePBOs.push_back(job->pbo);
-            tile_jobs.erase(erase_pos);
+            mapped_pbos.push_back(std::move(job->pbo));
+            job = tile_jobs.erase(job);
         }
         else {
             ++job;
         }
     }
     
-    // Ensure copies finished. This can be done async because it has no OpenGL in it.
-    std::async(std::launch::async, 
-        SetPromisesWhenDone, waiting_copies, promises, image_bufs);
+    // Newly rendered slices go to the slice cache, once placed.
+    std::function<void()> store;
+    if (cache_key != 0 && !from_cache) {
+        std::vector<size_t> sizes = OutputSizes();
+        store = [cache_key, image_bufs, sizes]() { StoreCachedSlice(cache_key, image_bufs, sizes); };
+    }
+    
+    // Ensure copies finished. This has no OpenGL in it, but the mappings 
+    // must outlive the copies - not the callbacks, which run on after. 
+    // Sink buffers aren't ours to give out.
+    auto copied = std::make_shared<std::promise<void>>();
+    std::future<void> placed = copied->get_future();
+    m_completions.push_back(std::async(std::launch::async, 
+        CompleteWhenDone, waiting_copies, copied, streamed, store, on_output, sink ? std::vector<char*>{} : image_bufs));
+    placed.wait();
 
-	for (auto pbo : discardablePBOs)
-		glDeleteBuffers(1, &pbo);
+	for (auto& pbo : mapped_pbos) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    
+    // The sink's buffers are the consumer's once published, so streaming
+    // and storing them must be done by then. A failed slice isn't published
+    // but thrown, for the caller to report.
+    if (sink) {
+        std::future<void> completion = std::move(m_completions.back());
+        m_completions.pop_back();
+        completion.get();
+        sink->PublishOutputs();
+    }
 }
@@ -0,0 +1,160 @@
+#include "transform.h"
+
+#include <algorithm>
+#include <future>
+#include <limits>
+#include <thread>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <cmath>
+#include <stdexcept>
+
+#include "vertex_soa.h"
+
+using namespace Ashigaru;
+
+// Below this many vertices per chunk, threading costs more than it saves.
+static const size_t min_chunk_verts = 1 << 16;
+
+// Vertices a chunk converts to SoA at a time, to stay in cache.
+static const size_t block_verts = 4096;
+
+static BoundingBox EmptyBox()
+{
+    Vertex::value_type big = std::numeric_limits<Vertex::value_type>::max();
+    return BoundingBox{ Vertex{ big, big, big }, Vertex{ -big, -big, -big } };
+}
+
+static BoundingBox Union(const BoundingBox& a, const BoundingBox& b)
+{
+    return BoundingBox{ glm::min(a.min, b.min), glm::max(a.max, b.max) };
+}
+
+/* TransformChunk() does the work of TransformVertices() on `count` vertices 
+ * starting at `source`, writing them to `dest`. If `dest` is NULL, only 
+ * the bounds are computed, as if by the identity transform. The vector 
+ * kernels are VertexSoA's, run a block at a time.
+ */
+static BoundingBox TransformChunk(const Vertex* source, Vertex* dest, size_t count, glm::mat4 transform)
+{
+    BoundingBox box = EmptyBox();
+    VertexSoA block;
+    for (size_t start = 0; start < count; start += block_verts) {
+        size_t block_size = std::min(block_verts, count - start);
+        block.Assign(source + start, block_size);
+        if (dest == NULL) {
+            box = Union(box, block.Bounds());
+            continue;
+        }
+        
+        box = Union(box, block.Transform(transform, block));
+        block.CopyTo(dest + start);
+    }
+    return box;
+}
+
+/* RunChunked() splits `count` vertices into chunks, runs TransformChunk() on
+ * them in parallel and merges the resulting bounds.
+ */
+static BoundingBox RunChunked(const Vertex* source, Vertex* dest, size_t count, const glm::mat4& transform)
+{
+    size_t num_chunks = std::max<size_t>(1, std::min<size_t>(
+        std::thread::hardware_concurrency(), count / min_chunk_verts));
+    size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+    
+    // The calling thread takes the first chunk itself.
+    std::vector<std::future<BoundingBox>> chunks;
+    for (size_t start = chunk_size; start < count; start += chunk_size) {
+        chunks.push_back(std::async(std::launch::async, TransformChunk, 
+            source + start, dest == NULL ? NULL : dest + start, 
+            std::min(chunk_size, count - start), transform
+        ));
+    }
+    
+    BoundingBox box = TransformChunk(source, dest, std::min(chunk_size, count), transform);
+    for (auto& chunk : chunks)
+        box = Union(box, chunk.get());
+    
+    return box;
+}
+
+BoundingBox Ashigaru::TransformVertices(const VertexVec& source, VertexVec& dest, const glm::mat4& transform)
+{
+    dest.resize(source.size());
+    if (source.empty())
+        return EmptyBox();
+    
+    return RunChunked(source.data(), dest.data(), source.size(), transform);
+}
+
+BoundingBox Ashigaru::ComputeBounds(const VertexVec& vertices)
+{
+    if (vertices.empty())
+        return EmptyBox();
+    
+    return RunChunked(vertices.data(), NULL, vertices.size(), glm::mat4(1.0f));
+}
+
+// Faces as sets of vertices, for dropping repeats regardless of winding.
+struct FaceKeyHash {
+    size_t operator()(const Triangle& face) const {
+        return std::hash<unsigned long long>()(((unsigned long long)face[0] * 73856093u) ^ 
+            ((unsigned long long)face[1] * 19349663u) ^ ((unsigned long long)face[2] * 83492791u));
+    }
+};
+
+Model Ashigaru::ClusterVertices(const Model& model, float cell_size, float z_cell_size)
+{
+    const VertexVec& vertices = model.first;
+    BoundingBox bounds = ComputeBounds(vertices);
+    glm::vec3 cell_sizes {cell_size, cell_size, z_cell_size};
+    
+    // Cells are numbered from the bounds' corner, 21 bits per axis, which 
+    // covers 2 million cells along each. More would alias other cells.
+    const float max_cells = (float)(1 << 21);
+    glm::vec3 span = glm::floor((bounds.max - bounds.min) / cell_sizes);
+    if (!vertices.empty() && !(span.x < max_cells && span.y < max_cells && span.z < max_cells))
+        throw std::runtime_error("Mesh too large to cluster at this cell size.");
+    
+    auto cell_of = [&bounds, cell_sizes](const Vertex& vertex) {
+        glm::vec3 cell = glm::floor((vertex - bounds.min) / cell_sizes);
+        return ((unsigned long long)cell.x << 42) | ((unsigned long long)cell.y << 21) | (unsigned long long)cell.z;
+    };
+    
+    // Each vertex goes to its cell's merged vertex, which first sums the 
+    // cell's vertices, then averages them.
+    std::unordered_map<unsigned long long, unsigned int> cells;
+    std::vector<unsigned int> merged_into(vertices.size());
+    VertexVec merged;
+    std::vector<unsigned int> merged_count;
+    for (size_t vertIx = 0; vertIx < vertices.size(); ++vertIx) {
+        auto found = cells.emplace(cell_of(vertices[vertIx]), (unsigned int)merged.size());
+        if (found.second) {
+            merged.push_back(Vertex{0.f, 0.f, 0.f});
+            merged_count.push_back(0);
+        }
+        unsigned int target = found.first->second;
+        merged_into[vertIx] = target;
+        merged[target] += vertices[vertIx];
+        ++merged_count[target];
+    }
+    for (size_t target = 0; target < merged.size(); ++target)
+        merged[target] = merged[target] / (float)merged_count[target];
+    
+    TriangleVec faces;
+    std::unordered_set<Triangle, FaceKeyHash> seen;
+    for (auto& face : model.second) {
+        Triangle remapped {merged_into[face[0]], merged_into[face[1]], merged_into[face[2]]};
+        if (remapped[0] == remapped[1] || remapped[1] == remapped[2] || remapped[0] == remapped[2])
+            continue;
+        
+        Triangle key = remapped;
+        std::sort(key.begin(), key.end());
+        if (seen.insert(key).second)
+            faces.push_back(remapped);
+    }
+    
+    return std::make_pair(std::move(merged), std::move(faces));
+}
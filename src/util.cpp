@@ -7,6 +7,18 @@
 
 #include <utility>
 #include <fstream>
+#include <stdexcept>
+#include <string>
+#include <cstdint>
+#include <atomic>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // http://www.labbookpages.co.uk/software/imgProc/libPNG.html
 int writeImage(const char* filename, int width, int height, ImageType type, const char *buffer, const char* title)
@@ -82,12 +94,12 @@ int writeImage(const char* filename, int width, int height, ImageType type, cons
     // Write image data
     for (int y=0 ; y<height ; y++) {
         if (type == ImageType::Color)
-            std::copy(&(buffer[y*width*pixel_size]), &(buffer[(y + 1)*width*pixel_size]), row);
+            std::copy(&(buffer[(size_t)y*width*pixel_size]), &(buffer[(size_t)(y + 1)*width*pixel_size]), row);
         else { 
             // One little / two litte / three little endians :)
             // The data to the PNG library hyas to be big-endian.
             for (int x = 0; x < width; ++x) {
-                unsigned short grayval = ((unsigned short *)buffer)[y*width + x];
+                unsigned short grayval = ((unsigned short *)buffer)[(size_t)y*width + x];
                 row[x*2] = grayval >> 8;
                 row[x*2 + 1] = grayval & 0xFF;
             }
@@ -155,3 +167,59 @@ Model readBinarySTL(const char *filename)
 	}
 	return std::make_pair(std::move(vertices), std::move(faces));
 }
+
+void writeBinarySTL(const char *filename, const Model& model)
+{
+    std::ofstream stl_file(filename, std::ios::out | std::ios::binary);
+    if (!stl_file)
+        throw std::runtime_error(std::string("Can't write ") + filename);
+    
+    char header_info[80] = "Ashigaru";
+    uint32_t num_triangles = (uint32_t)model.second.size();
+    stl_file.write(header_info, sizeof(header_info));
+    stl_file.write((const char*)&num_triangles, sizeof(num_triangles));
+    
+    for (auto& face : model.second) {
+        const Vertex& v1 = model.first[face[0]];
+        const Vertex& v2 = model.first[face[1]];
+        const Vertex& v3 = model.first[face[2]];
+        
+        Vertex normal = glm::cross(v2 - v1, v3 - v1);
+        float length = glm::length(normal);
+        if (length > 0)
+            normal = normal / length;
+        
+        for (const Vertex& point : {normal, v1, v2, v3})
+            stl_file.write((const char*)&point[0], 3*sizeof(float));
+        char attributes[2] = {0, 0};
+        stl_file.write(attributes, sizeof(attributes));
+    }
+    
+    if (!stl_file)
+        throw std::runtime_error(std::string("Can't write ") + filename);
+}
+
+void makeDirectories(const std::string& path)
+{
+    size_t sep = 0;
+    do {
+        sep = path.find_first_of("/\\", sep + 1);
+        std::string prefix = path.substr(0, sep);
+#ifdef _WIN32
+        _mkdir(prefix.c_str());
+#else
+        mkdir(prefix.c_str(), 0755);
+#endif
+    } while (sep != std::string::npos);
+}
+
+std::string tempPath(const std::string& path)
+{
+    static std::atomic<unsigned long> counter {0};
+#ifdef _WIN32
+    unsigned long pid = (unsigned long)_getpid();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    return path + "." + std::to_string(pid) + "-" + std::to_string(counter++) + ".tmp";
+}
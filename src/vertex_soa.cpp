@@ -0,0 +1,303 @@
+#include "vertex_soa.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__AVX2__)
+#define ASHIGARU_USE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define ASHIGARU_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace Ashigaru;
+
+static const float big = std::numeric_limits<float>::max();
+
+VertexSoA::VertexSoA(const VertexVec& vertices) 
+{
+    Assign(vertices.data(), vertices.size());
+}
+
+void VertexSoA::Assign(const Vertex* vertices, size_t count)
+{
+    Resize(count);
+    for (size_t vertIx = 0; vertIx < m_x.size(); ++vertIx) {
+        const Vertex& vert = vertices[std::min(vertIx, m_size - 1)];
+        m_x[vertIx] = vert.x;
+        m_y[vertIx] = vert.y;
+        m_z[vertIx] = vert.z;
+    }
+}
+
+void VertexSoA::Resize(size_t size)
+{
+    m_size = size;
+    size_t padded = (size + lanes - 1) / lanes * lanes;
+    m_x.resize(padded);
+    m_y.resize(padded);
+    m_z.resize(padded);
+}
+
+VertexVec VertexSoA::Interleaved() const
+{
+    VertexVec vertices(m_size);
+    CopyTo(vertices.data());
+    return vertices;
+}
+
+void VertexSoA::CopyTo(Vertex* dest) const
+{
+    for (size_t vertIx = 0; vertIx < m_size; ++vertIx)
+        dest[vertIx] = Vertex{ m_x[vertIx], m_y[vertIx], m_z[vertIx] };
+}
+
+#if defined(ASHIGARU_USE_AVX2)
+
+static float ReduceMin(__m256 lanes)
+{
+    __m128 half = _mm_min_ps(_mm256_castps256_ps128(lanes), _mm256_extractf128_ps(lanes, 1));
+    half = _mm_min_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_min_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+static float ReduceMax(__m256 lanes)
+{
+    __m128 half = _mm_max_ps(_mm256_castps256_ps128(lanes), _mm256_extractf128_ps(lanes, 1));
+    half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+/* BoundsKernel() finds the bounds of padded SoA arrays, 8 vertices at once. */
+static BoundingBox BoundsKernel(const float* xs, const float* ys, const float* zs, size_t padded)
+{
+    __m256 lo_x = _mm256_set1_ps(big), lo_y = lo_x, lo_z = lo_x;
+    __m256 hi_x = _mm256_set1_ps(-big), hi_y = hi_x, hi_z = hi_x;
+    
+    for (size_t vertIx = 0; vertIx < padded; vertIx += 8) {
+        __m256 x = _mm256_load_ps(xs + vertIx), y = _mm256_load_ps(ys + vertIx), z = _mm256_load_ps(zs + vertIx);
+        lo_x = _mm256_min_ps(lo_x, x); hi_x = _mm256_max_ps(hi_x, x);
+        lo_y = _mm256_min_ps(lo_y, y); hi_y = _mm256_max_ps(hi_y, y);
+        lo_z = _mm256_min_ps(lo_z, z); hi_z = _mm256_max_ps(hi_z, z);
+    }
+    
+    return BoundingBox{ 
+        Vertex{ ReduceMin(lo_x), ReduceMin(lo_y), ReduceMin(lo_z) },
+        Vertex{ ReduceMax(hi_x), ReduceMax(hi_y), ReduceMax(hi_z) }
+    };
+}
+
+/* TransformKernel() applies an affine transform, 8 vertices at once, and 
+ * finds the bounds of the result in the same pass. Each block is loaded 
+ * whole before storing, so the output may be the input.
+ */
+static BoundingBox TransformKernel(const float* xs, const float* ys, const float* zs, 
+    float* out_x, float* out_y, float* out_z, size_t padded, const glm::mat4& transform)
+{
+    __m256 m[4][3];
+    for (int col = 0; col < 4; ++col)
+        for (int row = 0; row < 3; ++row)
+            m[col][row] = _mm256_set1_ps(transform[col][row]);
+    
+    float* outs[3] = { out_x, out_y, out_z };
+    __m256 lo[3], hi[3];
+    for (int row = 0; row < 3; ++row) {
+        lo[row] = _mm256_set1_ps(big);
+        hi[row] = _mm256_set1_ps(-big);
+    }
+    
+    for (size_t vertIx = 0; vertIx < padded; vertIx += 8) {
+        __m256 x = _mm256_load_ps(xs + vertIx), y = _mm256_load_ps(ys + vertIx), z = _mm256_load_ps(zs + vertIx);
+        __m256 sums[3];
+        for (int row = 0; row < 3; ++row) {
+            sums[row] = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(m[0][row], x), _mm256_mul_ps(m[1][row], y)),
+                _mm256_add_ps(_mm256_mul_ps(m[2][row], z), m[3][row])
+            );
+            lo[row] = _mm256_min_ps(lo[row], sums[row]);
+            hi[row] = _mm256_max_ps(hi[row], sums[row]);
+        }
+        for (int row = 0; row < 3; ++row)
+            _mm256_store_ps(outs[row] + vertIx, sums[row]);
+    }
+    
+    return BoundingBox{ 
+        Vertex{ ReduceMin(lo[0]), ReduceMin(lo[1]), ReduceMin(lo[2]) },
+        Vertex{ ReduceMax(hi[0]), ReduceMax(hi[1]), ReduceMax(hi[2]) }
+    };
+}
+
+static void InRectKernel(const float* xs, const float* ys, size_t padded, 
+    float left, float bottom, float right, float top, uint8_t* inside)
+{
+    __m256 lo_x = _mm256_set1_ps(left), hi_x = _mm256_set1_ps(right);
+    __m256 lo_y = _mm256_set1_ps(bottom), hi_y = _mm256_set1_ps(top);
+    
+    for (size_t vertIx = 0; vertIx < padded; vertIx += 8) {
+        __m256 x = _mm256_load_ps(xs + vertIx), y = _mm256_load_ps(ys + vertIx);
+        __m256 in = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(x, lo_x, _CMP_GE_OQ), _mm256_cmp_ps(x, hi_x, _CMP_LE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(y, lo_y, _CMP_GE_OQ), _mm256_cmp_ps(y, hi_y, _CMP_LE_OQ))
+        );
+        int mask = _mm256_movemask_ps(in);
+        for (int lane = 0; lane < 8; ++lane)
+            inside[vertIx + lane] = (mask >> lane) & 1;
+    }
+}
+
+#elif defined(ASHIGARU_USE_SSE)
+
+static float ReduceMin(__m128 lanes)
+{
+    lanes = _mm_min_ps(lanes, _mm_movehl_ps(lanes, lanes));
+    lanes = _mm_min_ss(lanes, _mm_shuffle_ps(lanes, lanes, 1));
+    return _mm_cvtss_f32(lanes);
+}
+
+static float ReduceMax(__m128 lanes)
+{
+    lanes = _mm_max_ps(lanes, _mm_movehl_ps(lanes, lanes));
+    lanes = _mm_max_ss(lanes, _mm_shuffle_ps(lanes, lanes, 1));
+    return _mm_cvtss_f32(lanes);
+}
+
+// As the AVX2 kernels above, 4 vertices at once.
+static BoundingBox BoundsKernel(const float* xs, const float* ys, const float* zs, size_t padded)
+{
+    __m128 lo_x = _mm_set1_ps(big), lo_y = lo_x, lo_z = lo_x;
+    __m128 hi_x = _mm_set1_ps(-big), hi_y = hi_x, hi_z = hi_x;
+    
+    for (size_t vertIx = 0; vertIx < padded; vertIx += 4) {
+        __m128 x = _mm_load_ps(xs + vertIx), y = _mm_load_ps(ys + vertIx), z = _mm_load_ps(zs + vertIx);
+        lo_x = _mm_min_ps(lo_x, x); hi_x = _mm_max_ps(hi_x, x);
+        lo_y = _mm_min_ps(lo_y, y); hi_y = _mm_max_ps(hi_y, y);
+        lo_z = _mm_min_ps(lo_z, z); hi_z = _mm_max_ps(hi_z, z);
+    }
+    
+    return BoundingBox{ 
+        Vertex{ ReduceMin(lo_x), ReduceMin(lo_y), ReduceMin(lo_z) },
+        Vertex{ ReduceMax(hi_x), ReduceMax(hi_y), ReduceMax(hi_z) }
+    };
+}
+
+static BoundingBox TransformKernel(const float* xs, const float* ys, const float* zs, 
+    float* out_x, float* out_y, float* out_z, size_t padded, const glm::mat4& transform)
+{
+    __m128 m[4][3];
+    for (int col = 0; col < 4; ++col)
+        for (int row = 0; row < 3; ++row)
+            m[col][row] = _mm_set1_ps(transform[col][row]);
+    
+    float* outs[3] = { out_x, out_y, out_z };
+    __m128 lo[3], hi[3];
+    for (int row = 0; row < 3; ++row) {
+        lo[row] = _mm_set1_ps(big);
+        hi[row] = _mm_set1_ps(-big);
+    }
+    
+    for (size_t vertIx = 0; vertIx < padded; vertIx += 4) {
+        __m128 x = _mm_load_ps(xs + vertIx), y = _mm_load_ps(ys + vertIx), z = _mm_load_ps(zs + vertIx);
+        __m128 sums[3];
+        for (int row = 0; row < 3; ++row) {
+            sums[row] = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(m[0][row], x), _mm_mul_ps(m[1][row], y)),
+                _mm_add_ps(_mm_mul_ps(m[2][row], z), m[3][row])
+            );
+            lo[row] = _mm_min_ps(lo[row], sums[row]);
+            hi[row] = _mm_max_ps(hi[row], sums[row]);
+        }
+        for (int row = 0; row < 3; ++row)
+            _mm_store_ps(outs[row] + vertIx, sums[row]);
+    }
+    
+    return BoundingBox{ 
+        Vertex{ ReduceMin(lo[0]), ReduceMin(lo[1]), ReduceMin(lo[2]) },
+        Vertex{ ReduceMax(hi[0]), ReduceMax(hi[1]), ReduceMax(hi[2]) }
+    };
+}
+
+static void InRectKernel(const float* xs, const float* ys, size_t padded, 
+    float left, float bottom, float right, float top, uint8_t* inside)
+{
+    __m128 lo_x = _mm_set1_ps(left), hi_x = _mm_set1_ps(right);
+    __m128 lo_y = _mm_set1_ps(bottom), hi_y = _mm_set1_ps(top);
+    
+    for (size_t vertIx = 0; vertIx < padded; vertIx += 4) {
+        __m128 x = _mm_load_ps(xs + vertIx), y = _mm_load_ps(ys + vertIx);
+        __m128 in = _mm_and_ps(
+            _mm_and_ps(_mm_cmpge_ps(x, lo_x), _mm_cmple_ps(x, hi_x)),
+            _mm_and_ps(_mm_cmpge_ps(y, lo_y), _mm_cmple_ps(y, hi_y))
+        );
+        int mask = _mm_movemask_ps(in);
+        for (int lane = 0; lane < 4; ++lane)
+            inside[vertIx + lane] = (mask >> lane) & 1;
+    }
+}
+
+#else
+
+// Plain loops, for targets without either. Compilers may still vectorize them.
+static BoundingBox BoundsKernel(const float* xs, const float* ys, const float* zs, size_t padded)
+{
+    BoundingBox box { Vertex{ big, big, big }, Vertex{ -big, -big, -big } };
+    for (size_t vertIx = 0; vertIx < padded; ++vertIx) {
+        Vertex vert { xs[vertIx], ys[vertIx], zs[vertIx] };
+        box.min = glm::min(box.min, vert);
+        box.max = glm::max(box.max, vert);
+    }
+    return box;
+}
+
+static BoundingBox TransformKernel(const float* xs, const float* ys, const float* zs, 
+    float* out_x, float* out_y, float* out_z, size_t padded, const glm::mat4& transform)
+{
+    BoundingBox box { Vertex{ big, big, big }, Vertex{ -big, -big, -big } };
+    for (size_t vertIx = 0; vertIx < padded; ++vertIx) {
+        Vertex pos { transform*glm::vec4(xs[vertIx], ys[vertIx], zs[vertIx], 1.f) };
+        box.min = glm::min(box.min, pos);
+        box.max = glm::max(box.max, pos);
+        out_x[vertIx] = pos.x;
+        out_y[vertIx] = pos.y;
+        out_z[vertIx] = pos.z;
+    }
+    return box;
+}
+
+static void InRectKernel(const float* xs, const float* ys, size_t padded, 
+    float left, float bottom, float right, float top, uint8_t* inside)
+{
+    for (size_t vertIx = 0; vertIx < padded; ++vertIx) {
+        inside[vertIx] = xs[vertIx] >= left && xs[vertIx] <= right && 
+            ys[vertIx] >= bottom && ys[vertIx] <= top;
+    }
+}
+
+#endif
+
+BoundingBox VertexSoA::Bounds() const
+{
+    if (m_size == 0)
+        return BoundingBox{ Vertex{ big, big, big }, Vertex{ -big, -big, -big } };
+    
+    return BoundsKernel(X(), Y(), Z(), PaddedSize());
+}
+
+BoundingBox VertexSoA::Transform(const glm::mat4& transform, VertexSoA& dest) const
+{
+    if (m_size == 0) {
+        dest.Resize(0);
+        return Bounds();
+    }
+    
+    dest.Resize(m_size);
+    return TransformKernel(X(), Y(), Z(), dest.m_x.data(), dest.m_y.data(), dest.m_z.data(), PaddedSize(), transform);
+}
+
+void VertexSoA::MarkInRect(float left, float bottom, float right, float top, std::vector<uint8_t>& inside) const
+{
+    inside.resize(PaddedSize());
+    InRectKernel(X(), Y(), PaddedSize(), left, bottom, right, top, inside.data());
+}
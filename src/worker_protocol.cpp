@@ -0,0 +1,134 @@
+#include "worker_protocol.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+
+using namespace Ashigaru;
+using namespace Ashigaru::Worker;
+
+#ifdef MSG_NOSIGNAL
+static const int send_flags = MSG_NOSIGNAL; // a dead peer is an error, not a signal.
+#else
+static const int send_flags = 0;
+#endif
+
+struct MessageHeader {
+    MessageType type;
+    uint32_t reserved;
+    uint64_t request_id;
+    uint64_t length;
+};
+
+std::unique_ptr<RenderAction> Worker::MakeAction(const ActionSpec& spec)
+{
+    return std::unique_ptr<RenderAction>(
+        new TestRenderAction(spec.width, spec.height, spec.with_stats != 0, spec.layered != 0, 
+            spec.level_scale, spec.box_filter != 0, spec.depth_range));
+}
+
+static sockaddr_un SocketAddress(const std::string& socket_path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    std::strcpy(addr.sun_path, socket_path.c_str());
+    return addr;
+}
+
+Connection::~Connection()
+{
+    close(m_fd);
+}
+
+std::unique_ptr<Connection> Connection::Connect(const std::string& socket_path)
+{
+    sockaddr_un addr = SocketAddress(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        std::string reason = std::strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("Can't connect to worker at " + socket_path + ": " + reason);
+    }
+    return std::unique_ptr<Connection>(new Connection(fd));
+}
+
+static bool SendAll(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, send_flags);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Returns false on EOF or error, also mid-way.
+static bool ReceiveAll(int fd, char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t got = recv(fd, data, size, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+void Connection::Send(MessageType type, uint64_t request_id, const std::string& payload)
+{
+    MessageHeader header {type, 0, request_id, payload.size()};
+    
+    std::lock_guard<std::mutex> lck{m_send_lock};
+    if (!SendAll(m_fd, (const char*)&header, sizeof(header)) || 
+        !SendAll(m_fd, payload.data(), payload.size()))
+    {
+        throw std::runtime_error("Worker connection lost.");
+    }
+}
+
+bool Connection::Receive(MessageType& type, uint64_t& request_id, std::string& payload)
+{
+    MessageHeader header;
+    if (!ReceiveAll(m_fd, (char*)&header, sizeof(header)))
+        return false;
+    
+    payload.resize(header.length);
+    if (header.length > 0 && !ReceiveAll(m_fd, &payload[0], header.length))
+        return false;
+    
+    type = header.type;
+    request_id = header.request_id;
+    return true;
+}
+
+void Connection::Shutdown()
+{
+    shutdown(m_fd, SHUT_RDWR);
+}
+
+int Worker::Listen(const std::string& socket_path)
+{
+    sockaddr_un addr = SocketAddress(socket_path);
+    unlink(socket_path.c_str());
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        std::string reason = std::strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("Can't listen at " + socket_path + ": " + reason);
+    }
+    return fd;
+}
@@ -0,0 +1,151 @@
+/* Times view registration and slicing on synthetic scenes, sweeping one of
+ * triangle count, tile count and part count at a time, to see how each 
+ * stage scales. Prints CSV, one row per scene, for charting.
+ * 
+ * $ ashigaru_benchmark --sweep all > bench.csv
+ */
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <boost/program_options.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "util.h"
+#include "transform.h"
+#include "mesh_generators.h"
+#include "render_server.h"
+
+using namespace Ashigaru;
+using Clock = std::chrono::steady_clock;
+
+static double Millis(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+struct Scene {
+    std::string sweep;
+    std::shared_ptr<const Model> part;
+    unsigned int parts_per_side; // placed as instances of `part`.
+    unsigned int img_size, tile_size;
+};
+
+/* Run() registers a scene's view, scaled so the parts fill the tray, and 
+ * renders `slices` slices spread over its height, one at a time. Prints 
+ * the timings as a CSV row.
+ */
+static void Run(const Scene& scene, unsigned int slices)
+{
+    // The action must outlive the server, which releases it on shutdown.
+    TestRenderAction action {scene.tile_size, scene.tile_size};
+    RenderServer server {scene.tile_size, scene.tile_size};
+    
+    BoundingBox bounds = ComputeBounds(scene.part->first);
+    glm::vec3 dims = bounds.max - bounds.min;
+    float cell = (float)scene.img_size / scene.parts_per_side;
+    float scale = cell / std::max({dims.x, dims.y, dims.z});
+    glm::mat4 size_to_fit = glm::translate(glm::scale(glm::mat4(1.0f), glm::vec3{scale}), -bounds.min);
+    
+    auto start = Clock::now();
+    auto models = server.RegisterModels(std::vector<std::shared_ptr<const Model>>{scene.part}, 
+        std::vector<glm::mat4>{size_to_fit});
+    std::vector<RenderServer::Placement> tray;
+    for (unsigned int row = 0; row < scene.parts_per_side; ++row) {
+        for (unsigned int col = 0; col < scene.parts_per_side; ++col) {
+            tray.push_back(RenderServer::Placement{models[0], 
+                glm::translate(glm::mat4(1.0f), glm::vec3{col*cell, row*cell, 0.f}), (unsigned int)tray.size()});
+        }
+    }
+    auto view = server.RegisterView(action, scene.img_size, scene.img_size, tray).get();
+    double register_ms = Millis(start, Clock::now());
+    
+    // The first slice also pays for shaders and buffers, so it's apart.
+    double height = dims.z*scale, first_ms = 0, total_ms = 0, max_ms = 0;
+    for (unsigned int slice = 0; slice < slices; ++slice) {
+        auto slice_start = Clock::now();
+        for (auto& output : server.ViewSlice(view, (size_t)(height*(slice + 0.5)/slices)))
+            output.get();
+        double slice_ms = Millis(slice_start, Clock::now());
+        
+        if (slice == 0) {
+            first_ms = slice_ms;
+            continue;
+        }
+        total_ms += slice_ms;
+        max_ms = std::max(max_ms, slice_ms);
+    }
+    
+    unsigned int tiles_per_side = scene.img_size / scene.tile_size;
+    std::cout << scene.sweep << "," << scene.parts_per_side*scene.parts_per_side << "," 
+        << scene.part->second.size()*scene.parts_per_side*scene.parts_per_side << "," 
+        << tiles_per_side*tiles_per_side << "," << register_ms << "," << first_ms << "," 
+        << (slices > 1 ? total_ms/(slices - 1) : 0.) << "," << max_ms << std::endl;
+}
+
+static std::shared_ptr<const Model> SpherePart(unsigned int rings)
+{
+    return std::make_shared<Model>(Generate::Sphere(glm::vec3{0.f}, 1.f, rings, 2*rings));
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    
+    po::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "Show this.")
+            ("sweep", po::value<std::string>()->default_value("all"), "triangles, tiles, parts, or all.")
+            ("img-size", po::value<unsigned int>()->default_value(2048u), "Side of the square image.")
+            ("tile-size", po::value<unsigned int>()->default_value(512u), "Side of the square tile, where not swept.")
+            ("slices", po::value<unsigned int>()->default_value(50u), "Slices timed per scene.")
+    ;
+    
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    
+    glewExperimental = true; // Needed for core profile
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW\n";
+        return -1;
+    }
+    
+    std::string sweep = vm["sweep"].as<std::string>();
+    unsigned int img_size = vm["img-size"].as<unsigned int>();
+    unsigned int tile_size = vm["tile-size"].as<unsigned int>();
+    
+    std::vector<Scene> scenes;
+    if (sweep == "all" || sweep == "triangles") {
+        for (unsigned int rings : {16u, 64u, 256u, 1024u, 2048u})
+            scenes.push_back(Scene{"triangles", SpherePart(rings), 1, img_size, tile_size});
+    }
+    if (sweep == "all" || sweep == "tiles") {
+        auto part = SpherePart(256);
+        for (unsigned int tile = img_size; tile >= 128; tile /= 2)
+            scenes.push_back(Scene{"tiles", part, 1, img_size, tile});
+    }
+    if (sweep == "all" || sweep == "parts") {
+        auto part = SpherePart(16);
+        for (unsigned int per_side : {1u, 2u, 4u, 8u, 16u, 32u})
+            scenes.push_back(Scene{"parts", part, per_side, img_size, tile_size});
+    }
+    if (scenes.empty()) {
+        std::cerr << "Unknown sweep: " << sweep << std::endl;
+        return 1;
+    }
+    
+    std::cout << "sweep,parts,triangles,tiles,register_ms,first_slice_ms,mean_slice_ms,max_slice_ms" << std::endl;
+    for (auto& scene : scenes)
+        Run(scene, vm["slices"].as<unsigned int>());
+    
+    return 0;
+}
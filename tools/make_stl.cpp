@@ -0,0 +1,63 @@
+/* Writes synthetic binary STLs of known complexity, for reproducing 
+ * performance on inputs like production ones. See mesh_generators.h.
+ * 
+ * $ ashigaru_make_stl --shape sphere --detail 256 --output sphere.stl
+ */
+
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "util.h"
+#include "mesh_generators.h"
+
+using namespace Ashigaru;
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    
+    po::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "Show this.")
+            ("shape", po::value<std::string>()->default_value("sphere"), 
+                "sphere, lattice (of struts), array (of small spheres), or giant (one huge sphere).")
+            ("detail", po::value<unsigned int>()->default_value(0u), 
+                "Rings of a sphere (segments are twice that), or cells per side of a lattice. "
+                "0 for the shape's default.")
+            ("count", po::value<unsigned int>()->default_value(16u), "Parts per side of an array.")
+            ("output", po::value<std::string>()->default_value("synthetic.stl"), "STL file to write.")
+    ;
+    
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    
+    std::string shape = vm["shape"].as<std::string>();
+    unsigned int detail = vm["detail"].as<unsigned int>();
+    unsigned int count = vm["count"].as<unsigned int>();
+    
+    // Sizes are arbitrary, as ashigaru scales models to the tray anyway.
+    Model model;
+    if (shape == "sphere")
+        model = Generate::Sphere(glm::vec3{0.f}, 50.f, detail ? detail : 64, 2*(detail ? detail : 64));
+    else if (shape == "lattice")
+        model = Generate::Lattice(detail ? detail : 10, 10.f, 1.f);
+    else if (shape == "array")
+        model = Generate::Array(Generate::Sphere(glm::vec3{0.f}, 2.f, detail ? detail : 8, 2*(detail ? detail : 8)), count, 5.f);
+    else if (shape == "giant")
+        model = Generate::Sphere(glm::vec3{0.f}, 500.f, detail ? detail : 1024, 2*(detail ? detail : 1024));
+    else {
+        std::cerr << "Unknown shape: " << shape << std::endl;
+        return 1;
+    }
+    
+    writeBinarySTL(vm["output"].as<std::string>().c_str(), model);
+    std::cout << model.second.size() << " triangles written to " << vm["output"].as<std::string>() << std::endl;
+    return 0;
+}
@@ -0,0 +1,163 @@
+/* Round-trips synthetic slice stacks through SliceStackWriter and
+ * SliceStackReader, checking every slice comes back as written, and prints
+ * how much the stack shrank and how long coding took. Prints CSV, one row
+ * per pattern.
+ * 
+ * Patterns, 16 bits a pixel:
+ * disk - one ID inside a disk whose radius grows with the slice, 0 outside.
+ *    Only the rim changes from slice to slice, as with most real parts.
+ * cone - the disk again, holding the distance from its rim instead, so
+ *    every pixel inside changes each slice: a worst case for delta coding.
+ * 
+ * $ ashigaru_stack_benchmark --pattern all > stack.csv
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+
+#include <boost/program_options.hpp>
+
+#include "slice_delta.h"
+
+using namespace Ashigaru;
+using Clock = std::chrono::steady_clock;
+
+static double Millis(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/* MakeSlice() draws slice `slice_num` of `slices` of a pattern, `size` pixels
+ * square, into `pixels`. The disk grows from nothing to the slice's edges.
+ */
+static void MakeSlice(const std::string& pattern, unsigned int size, unsigned int slice_num,
+    unsigned int slices, std::vector<uint16_t>& pixels)
+{
+    pixels.assign((size_t)size*size, 0);
+    float center = size/2.f;
+    float radius = center*(slice_num + 1)/slices;
+    
+    for (unsigned int row = 0; row < size; ++row) {
+        for (unsigned int col = 0; col < size; ++col) {
+            float dist = std::hypot(col + 0.5f - center, row + 0.5f - center);
+            if (dist >= radius)
+                continue;
+            pixels[(size_t)row*size + col] = pattern == "cone" ? (uint16_t)(radius - dist) + 1 : 1;
+        }
+    }
+}
+
+/* Run() writes a pattern's stack to `path`, reads it back in order and in
+ * random order, and prints the sizes and timings as a CSV row. Generating
+ * the slices is not timed.
+ * 
+ * Throws std::runtime_error if any slice reads back different.
+ */
+static void Run(const std::string& pattern, unsigned int size, unsigned int slices,
+    unsigned int keyframe_interval, const std::string& path)
+{
+    std::vector<std::vector<uint16_t>> stack(slices);
+    for (unsigned int slice = 0; slice < slices; ++slice)
+        MakeSlice(pattern, size, slice, slices, stack[slice]);
+    size_t slice_bytes = (size_t)size*size*sizeof(uint16_t);
+    
+    auto start = Clock::now();
+    {
+        SliceStackWriter writer {path, slice_bytes, keyframe_interval};
+        for (auto& slice : stack)
+            writer.Write((const char*)slice.data());
+    }
+    double write_ms = Millis(start, Clock::now());
+    
+    auto check = [&](SliceStackReader& reader, unsigned int slice) {
+        const std::vector<char>& read = reader.ReadSlice(slice);
+        if (read.size() != slice_bytes || !std::equal(read.begin(), read.end(), (const char*)stack[slice].data()))
+            throw std::runtime_error(pattern + " slice " + std::to_string(slice) + " did not round-trip.");
+    };
+    
+    start = Clock::now();
+    SliceStackReader reader {path};
+    for (unsigned int slice = 0; slice < slices; ++slice)
+        check(reader, slice);
+    double read_ms = Millis(start, Clock::now());
+    
+    // Random access pays for decoding from the keyframe each time.
+    std::mt19937 rng {1};
+    std::uniform_int_distribution<unsigned int> pick {0, slices - 1};
+    start = Clock::now();
+    for (unsigned int read = 0; read < slices; ++read)
+        check(reader, pick(rng));
+    double random_ms = Millis(start, Clock::now());
+    
+    size_t stack_bytes = 0;
+    if (FILE* file = std::fopen(path.c_str(), "rb")) {
+        std::fseek(file, 0, SEEK_END);
+        stack_bytes = (size_t)std::ftell(file);
+        std::fclose(file);
+    }
+    std::remove(path.c_str());
+    
+    std::cout << pattern << "," << size << "," << slices << "," << slice_bytes*slices << ","
+        << stack_bytes << "," << write_ms << "," << read_ms << "," << random_ms << std::endl;
+}
+
+int main(int argc, char **argv) {
+    namespace po = boost::program_options;
+    
+    po::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "Show this.")
+            ("pattern", po::value<std::string>()->default_value("all"), "disk, cone, or all.")
+            ("size", po::value<unsigned int>()->default_value(512u), "Side of the square slice.")
+            ("slices", po::value<unsigned int>()->default_value(100u), "Slices in the stack.")
+            ("keyframe-interval", po::value<unsigned int>()->default_value(32u), "Slices from one keyframe to the next.")
+            ("output", po::value<std::string>()->default_value("stack_benchmark.stack"), "Scratch stack file, removed after.")
+    ;
+    
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    
+    std::string pattern = vm["pattern"].as<std::string>();
+    std::vector<std::string> patterns;
+    if (pattern == "all")
+        patterns = {"disk", "cone"};
+    else if (pattern == "disk" || pattern == "cone")
+        patterns = {pattern};
+    else {
+        std::cerr << "Unknown pattern: " << pattern << std::endl;
+        return 1;
+    }
+    
+    unsigned int slices = vm["slices"].as<unsigned int>();
+    unsigned int keyframe_interval = vm["keyframe-interval"].as<unsigned int>();
+    if (slices == 0 || keyframe_interval == 0) {
+        std::cerr << "Slices and keyframe interval must be at least 1." << std::endl;
+        return 1;
+    }
+    
+    std::cout << "pattern,size,slices,raw_bytes,stack_bytes,write_ms,read_ms,random_read_ms" << std::endl;
+    try {
+        for (auto& name : patterns)
+            Run(name, vm["size"].as<unsigned int>(), slices, keyframe_interval, vm["output"].as<std::string>());
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    
+    return 0;
+}